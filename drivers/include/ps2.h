@@ -66,6 +66,18 @@
 // The number of scancodes to buffer
 #define PS2_SCANCODE_QUEUE_SIZE           10
 
+// ======================================================================
+// Scancode set 2
+// ======================================================================
+// Precedes the scancode of the key being released.
+#define PS2_SCANCODE_BREAK                0xf0
+// Precedes the scancodes of the extended keys (e.g. the right Ctrl and Alt,
+// which otherwise send the same scancodes as the left ones).
+#define PS2_SCANCODE_EXTENDED             0xe0
+#define PS2_SCANCODE_CTRL                 0x14
+#define PS2_SCANCODE_ALT                  0x11
+#define PS2_SCANCODE_M                    0x3a
+
 bool ps2_controller_input_buffer_full();
 bool ps2_controller_output_buffer_full();
 void ps2_controller_send_cmd(uint8_t);
@@ -4,6 +4,7 @@
 #include <portio.h>
 #include <pic.h>
 #include <printk.h>
+#include <memstat.h>
 
 struct scancode_queue_context {
     uint32_t start;
@@ -11,12 +12,53 @@ struct scancode_queue_context {
     uint8_t buf[PS2_SCANCODE_QUEUE_SIZE];
 } scancode_queue_ctx;
 
+// The state of the modifier keys (used to detect the key combinations handled
+// by the kernel itself).
+struct keyboard_state {
+    // Whether the last scancode was PS2_SCANCODE_BREAK.
+    bool is_break;
+    bool ctrl;
+    bool alt;
+} keyboard_state;
+
 static void
 init_scancode_queue() {
     scancode_queue_ctx.start = 0;
     scancode_queue_ctx.end = 0;
 }
 
+// Handle the key combinations that have a meaning for the kernel:
+//   * Ctrl+Alt+M: print a memory usage report
+static void
+ps2_handle_key_combination(uint8_t scancode) {
+    if (scancode == PS2_SCANCODE_BREAK) {
+        keyboard_state.is_break = true;
+        return;
+    }
+
+    if (scancode == PS2_SCANCODE_EXTENDED) {
+        return;
+    }
+
+    bool pressed = !keyboard_state.is_break;
+    keyboard_state.is_break = false;
+
+    switch (scancode) {
+        case PS2_SCANCODE_CTRL:
+            keyboard_state.ctrl = pressed;
+            break;
+        case PS2_SCANCODE_ALT:
+            keyboard_state.alt = pressed;
+            break;
+        case PS2_SCANCODE_M:
+            if (pressed && keyboard_state.ctrl && keyboard_state.alt) {
+                // The report is too slow to print from an interrupt handler.
+                memstat_request_dump();
+            }
+            break;
+    }
+}
+
 static void
 ps2_controller_wait_ready_for_cmd() {
     // XXX: introduce a timeout/error handling so we don't loop forever if the
@@ -112,6 +154,7 @@ ps2_handle_irq1() {
     uint8_t scancode = inb(PS2_DATA);
     scancode_queue_ctx.buf[scancode_queue_ctx.end] = scancode;
     scancode_queue_ctx.end = (scancode_queue_ctx.end + 1) % PS2_SCANCODE_QUEUE_SIZE;
+    ps2_handle_key_combination(scancode);
     for (int i = 0; i < PS2_SCANCODE_QUEUE_SIZE; ++i) {
         printk_debug("%d: %d\n", i, scancode_queue_ctx.buf[i]);
     }
@@ -6,8 +6,17 @@
 #define KERNEL_STACK_SIZE       KERNEL_STACK_PAGE_COUNT * PAGE_SIZE
 
 #define USER_STACK_TOP          0xA0000000
-#define USER_STACK_PAGE_COUNT   10
+// The number of pages of a new user stack (which grows downwards on demand).
+#define USER_STACK_PAGE_COUNT   1
 #define USER_STACK_SIZE         USER_STACK_PAGE_COUNT * PAGE_SIZE
+// The size the user stack can grow to. The page right below it is a guard
+// page, which is never mapped.
+#define USER_STACK_MAX_PAGE_COUNT 256
+#define USER_STACK_MAX_SIZE     USER_STACK_MAX_PAGE_COUNT * PAGE_SIZE
+
+// The lowest address vmm_find_user_range hands out: page 0 is never mapped, so
+// that NULL pointer accesses fault.
+#define USER_MIN_ADDR           PAGE_SIZE
 
 #ifndef __ASSEMBLY__
 #include <mm/vmm.h>
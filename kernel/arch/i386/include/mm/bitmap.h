@@ -0,0 +1,57 @@
+#ifndef __BITMAP_H__
+#define __BITMAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The maximum number of levels of a bitmap (including the bitmap itself). Four
+// levels are enough to summarize 2^20 bits (the number of 4 KB frames in the
+// 32-bit physical address space) with a single top-level word. With PAE, the
+// top level of the larger bitmaps has several words, which are searched one by
+// one.
+#define BITMAP_MAX_LEVELS 4
+// Returned by bitmap_find_clear if all the bits are set.
+#define BITMAP_NOT_FOUND  UINT32_MAX
+
+#define BITMAP_WORDS(bits) (((bits) + 31) / 32)
+// The number of words needed to store a bitmap of `bits` bits, along with all
+// its summary levels.
+#define BITMAP_STORAGE_WORDS(bits)                                   \
+    (BITMAP_WORDS(bits) + BITMAP_WORDS(BITMAP_WORDS(bits))           \
+     + BITMAP_WORDS(BITMAP_WORDS(BITMAP_WORDS(bits)))                \
+     + BITMAP_WORDS(BITMAP_WORDS(BITMAP_WORDS(BITMAP_WORDS(bits)))))
+
+// A hierarchical bitmap.
+//
+// Level 0 is the bitmap itself. Bit `i` of level `n + 1` is set if word `i` of
+// level `n` is full (i.e. all its bits are set), so looking for a clear bit
+// only ever needs to inspect one word per level.
+typedef struct bitmap {
+    uint32_t *levels[BITMAP_MAX_LEVELS];
+    // The number of bits in each level.
+    uint32_t bit_count[BITMAP_MAX_LEVELS];
+    uint32_t level_count;
+    // Where the next search starts (see bitmap_find_clear).
+    uint32_t cursor;
+} bitmap_t;
+
+// Initialize a bitmap of `bit_count` clear bits, using the specified storage
+// (which must be at least BITMAP_STORAGE_WORDS(bit_count) words long).
+void bitmap_init(bitmap_t *, uint32_t *storage, uint32_t bit_count);
+
+bool bitmap_test(bitmap_t *, uint32_t bit);
+void bitmap_set(bitmap_t *, uint32_t bit);
+void bitmap_clear(bitmap_t *, uint32_t bit);
+
+// Set `count` bits starting at `start`, one word at a time.
+void bitmap_set_range(bitmap_t *, uint32_t start, uint32_t count);
+// Clear `count` bits starting at `start`, one word at a time.
+void bitmap_clear_range(bitmap_t *, uint32_t start, uint32_t count);
+// Check whether all the bits in the specified range are clear.
+bool bitmap_range_clear(bitmap_t *, uint32_t start, uint32_t count);
+
+// Find a clear bit, starting the search where the previous search left off
+// (next-fit), or return BITMAP_NOT_FOUND if all bits are set.
+uint32_t bitmap_find_clear(bitmap_t *);
+
+#endif /* __BITMAP_H__ */
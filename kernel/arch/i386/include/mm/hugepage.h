@@ -0,0 +1,20 @@
+#ifndef __HUGEPAGE_H__
+#define __HUGEPAGE_H__
+
+// The largest number of 4 MB regions assembled each time hugepage_scan runs
+// (which copies 4 MB each).
+#define HUGEPAGE_COLLAPSES_PER_SCAN 1
+
+// Transparent huge pages: the 4 MB regions of the user address spaces whose
+// pages are all present, private and writable are copied into a single 4 MB
+// page (see paging_collapse_large_page), which takes up a single TLB entry
+// instead of 1024.
+
+// Look at the user address space of the next task (in PID order), collapsing
+// up to HUGEPAGE_COLLAPSES_PER_SCAN regions.
+void hugepage_scan();
+
+// The kernel task that keeps collapsing regions in the background.
+void hugepage_task();
+
+#endif /* __HUGEPAGE_H__ */
@@ -0,0 +1,44 @@
+#ifndef __KSM_H__
+#define __KSM_H__
+
+#include <stdint.h>
+
+#include <mm/paging.h>
+#include <syscall/memstat.h>
+
+// The number of frames ksm_task looks at each time it runs.
+#define KSM_PAGES_PER_SCAN 64
+// The number of buckets of the table of candidate and merged pages.
+#define KSM_BUCKET_COUNT   1024
+
+// Kernel same-page merging: the private user pages that hold the same data
+// (e.g. the pages of the processes running the same program, or pages that
+// are all zeroes) are replaced by a single read-only frame. The first write
+// to a merged page gives it a private copy again (see paging_copy_on_write).
+//
+// The frames are scanned in order through their descriptors (like
+// reclaim_pages does), which finds the pages of all the address spaces without
+// walking them. A page is first recorded as a candidate under the checksum of
+// its contents; it is merged once another page with the same contents is
+// found. The candidates are forgotten at the end of each full scan, as their
+// contents might have changed since.
+
+// Create the cache the nodes of the table are allocated from. This must be
+// called before ksm_task runs.
+void ksm_init();
+
+// Look at the next `count` frames, merging the ones that hold the same data as
+// another page.
+void ksm_scan(uint32_t count);
+
+// The kernel task that keeps merging pages in the background.
+void ksm_task();
+
+// Account for a write that gave one of the mappings of the page at
+// physical_addr a private copy (see paging_copy_on_write).
+void ksm_unmerge(phys_addr_t physical_addr);
+
+// Fill in the same-page merging section of the specified memstat_t.
+void ksm_memstat(memstat_t *);
+
+#endif /* __KSM_H__ */
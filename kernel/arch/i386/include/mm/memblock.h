@@ -0,0 +1,44 @@
+#ifndef __MEMBLOCK_H__
+#define __MEMBLOCK_H__
+
+#include <stdint.h>
+
+#include "multiboot2.h"
+
+// The maximum number of regions of each memblock type.
+#define MEMBLOCK_MAX_REGIONS 32
+
+// memblock is the boot-time physical memory allocator.
+//
+// It knows which physical memory is usable (according to the memory map
+// provided by the bootloader), and which parts of it are already in use (the
+// kernel image, the boot modules, the multiboot information structure...). It
+// is used to allocate the memory needed to set up the PMM, which then takes
+// over all the memory that isn't reserved.
+typedef struct memblock_region {
+    uint64_t base;
+    uint64_t size;
+} memblock_region_t;
+
+typedef struct memblock_type {
+    uint32_t count;
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+} memblock_type_t;
+
+// Read the memory map and reserve all the physical memory in use at boot time.
+void memblock_init(multiboot_info_t);
+// Mark the specified physical range as reserved.
+void memblock_reserve(uint64_t base, uint64_t size);
+// Allocate (and reserve) `size` bytes of physical memory aligned to `align`
+// bytes, preferably at or above the `min_addr` physical address. The memory is
+// always below 4 GB.
+uint64_t memblock_alloc(uint64_t size, uint64_t align, uint64_t min_addr);
+// The end of the highest usable physical memory region.
+uint64_t memblock_end_of_ram(void);
+
+// The usable physical memory regions.
+memblock_type_t *memblock_memory(void);
+// The reserved physical memory regions (these may overlap).
+memblock_type_t *memblock_reserved(void);
+
+#endif /* __MEMBLOCK_H__ */
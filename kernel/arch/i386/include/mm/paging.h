@@ -6,9 +6,89 @@
 // ======================================================================
 // 4 KB pages
 #define PAGE_SIZE            (1 << 12)
+#define PAGE_TABLE_START     12
+
+#ifdef CONFIG_PAE
+// With PAE (physical address extension), the entries are 64 bits wide, which
+// lets them refer to the physical memory above 4 GB. A page table only holds
+// 512 of them, so there are 4 page directories (of 512 entries each), which
+// the entries of the page directory pointer table (PDPT) CR3 points to refer
+// to.
+//
+// The 4 page directories are kept physically contiguous, so they can be
+// indexed as a single page directory of 2048 entries (see page_directory_t).
+// A page directory entry covers 2 MB (rather than 4 MB), which is also the
+// size of the large pages.
+//
+// 2 MB pages (a page directory entry with PAGE_FLAG_PAGE_SIZE set)
+#define LARGE_PAGE_SIZE      (1 << 21)
+// The order of the PMM blocks that back 2 MB pages.
+#define LARGE_PAGE_ORDER     9
+#define PAGE_TABLE_SIZE      512
+#define PAGE_DIRECTORY_START 21
+// The number of pages the page directory takes.
+#define PAGING_DIRECTORY_PAGES 4
+// The order of the PMM block the page directory is allocated as.
+#define PAGING_DIRECTORY_ORDER 2
+// Where the active page directory is mapped (through its last 4 entries, which
+// point to the page directory itself).
+#define PAGING_RECURSIVE_PAGE_DIRECTORY 0xFFFFC000
+// Where the page tables of the active page directory are mapped (by the same
+// entries).
+#define PAGING_RECURSIVE_PAGE_TABLES    0xFF800000
+// The bits of an entry that hold a physical address (the rest are flags).
+#define PAGING_ENTRY_ADDR_MASK          0x000FFFFFFFFFF000ull
+#else
+// 4 MB pages (a page directory entry with PAGE_FLAG_PAGE_SIZE set)
+#define LARGE_PAGE_SIZE      (1 << 22)
+// The order of the PMM blocks that back 4 MB pages.
+#define LARGE_PAGE_ORDER     10
 #define PAGE_TABLE_SIZE      1024
 #define PAGE_DIRECTORY_START 22
-#define PAGE_TABLE_START     12
+// The number of pages the page directory takes.
+#define PAGING_DIRECTORY_PAGES 1
+// The order of the PMM block the page directory is allocated as.
+#define PAGING_DIRECTORY_ORDER 0
+// Where the active page directory is mapped (through its last entry, which
+// points to the page directory itself).
+#define PAGING_RECURSIVE_PAGE_DIRECTORY 0xFFFFF000
+// Where the page tables of the active page directory are mapped (by the same
+// entry).
+#define PAGING_RECURSIVE_PAGE_TABLES    0xFFC00000
+// The bits of an entry that hold a physical address (the rest are flags).
+#define PAGING_ENTRY_ADDR_MASK          0xFFFFF000u
+#endif
+
+// The number of entries of the page directory.
+#define PAGE_DIRECTORY_SIZE  (PAGE_TABLE_SIZE * PAGING_DIRECTORY_PAGES)
+// The index of the first of the page directory entries that point to the page
+// directory itself (see init_paging).
+#define PAGING_RECURSIVE_PDE (PAGE_DIRECTORY_SIZE - PAGING_DIRECTORY_PAGES)
+// A kernel page used to temporarily map physical pages that aren't otherwise
+// mapped (e.g. to zero them).
+#define PAGING_SCRATCH_VIRT_ADDR 0xDFFFF000
+// A kernel page used to temporarily map the page tables of the contexts other
+// than the active one.
+#define PAGING_TABLE_SCRATCH_VIRT_ADDR 0xDFFFE000
+// Changing the mappings of more pages than this at once flushes the whole TLB
+// (rather than invalidating the pages one by one).
+#define PAGING_INVLPG_MAX 32
+// ======================================================================
+// CR0 flags
+// ======================================================================
+// Write protect. If 1, the kernel can't write to read-only pages either.
+#define CR0_WP (1 << 16)
+
+// ======================================================================
+// CR4 flags
+// ======================================================================
+// Page size extensions (4 MB pages).
+#define CR4_PSE (1 << 4)
+// Physical address extension (64-bit page table entries).
+#define CR4_PAE (1 << 5)
+// Page global enable. If 1, the translations of the pages with
+// PAGE_FLAG_GLOBAL set survive CR3 reloads.
+#define CR4_PGE (1 << 7)
 
 // ======================================================================
 // Page table entry flags
@@ -35,25 +115,119 @@
 // global.
 #define PAGE_FLAG_GLOBAL         (1 << 8)
 
+// The first of the bits of a page table entry that are ignored by the CPU. If
+// the entry isn't present, and this is 1, the rest of the entry is the slot of
+// the swap store that holds the contents of the page (see mm/swap.h).
+#define PAGE_FLAG_SWAP           (1 << 9)
+
+#define PAGING_SWAP_ENTRY(slot)       (((slot) << PAGE_TABLE_START) | PAGE_FLAG_SWAP)
+#define PAGING_SWAP_SLOT(entry)       ((entry) >> PAGE_TABLE_START)
+#define PAGING_IS_SWAP_ENTRY(entry)   (!((entry) & PAGE_FLAG_PRESENT) && ((entry) & PAGE_FLAG_SWAP))
+
 #define PAGE_DIRECTORY_INDEX(vaddr)   ((vaddr) >> PAGE_DIRECTORY_START)
-#define PAGE_TABLE_INDEX(vaddr)       (((vaddr) >> PAGE_TABLE_START) & ((1 << 10) - 1))
+#define PAGE_TABLE_INDEX(vaddr)       (((vaddr) >> PAGE_TABLE_START) & (PAGE_TABLE_SIZE - 1))
+#define PAGING_ENTRY_ADDR(entry)      ((phys_addr_t)((entry) & PAGING_ENTRY_ADDR_MASK))
 
 #ifndef __ASSEMBLY__
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <syscall/memstat.h>
+
+#ifdef CONFIG_PAE
+typedef uint64_t page_entry_t;
+// A physical address, which might be above 4 GB.
+//
+// NOTE: only the user pages are ever allocated above 4 GB (see
+// pmm_alloc_user_page): everything the kernel accesses through a physical
+// address (the page tables, the heap, the PMM metadata...) stays below 4 GB,
+// so it is still referred to by a uint32_t (or a pointer).
+typedef uint64_t phys_addr_t;
+#else
+typedef uint32_t page_entry_t;
+typedef uint32_t phys_addr_t;
+#endif
+
 typedef struct page_table {
-    uint32_t entries[PAGE_TABLE_SIZE];
+    page_entry_t entries[PAGE_TABLE_SIZE];
 } __attribute__ ((aligned(4096))) page_table_t;
 
+typedef struct page_directory {
+    page_entry_t entries[PAGE_DIRECTORY_SIZE];
+} __attribute__ ((aligned(4096))) page_directory_t;
+
+#ifdef CONFIG_PAE
+// The page directory pointer table, whose entries point to each page of the
+// page directory. Only its present flag can be set.
+typedef struct paging_pdpt {
+    page_entry_t entries[PAGING_DIRECTORY_PAGES];
+} __attribute__ ((aligned(32))) paging_pdpt_t;
+#endif
+
+// An address space.
+//
+// Only the page directory is permanently mapped: the page tables are
+// allocated when they are first needed, and are accessed through the
+// recursive mapping (or through a scratch page, if the context is not the
+// active one).
 typedef struct paging_context {
-    page_table_t *page_directory;
-    page_table_t *page_tables;
+    // The page directory (mapped in the kernel's part of the address space).
+    page_directory_t *page_directory;
+    // The value of CR3: the physical address of the page directory (or, with
+    // PAE, of the page directory pointer table).
+    uint32_t cr3;
 } paging_context_t;
 
 
 paging_context_t init_paging();
-void paging_set_page_directory(uint32_t);
+// Create a context that shares the kernel's part of the address space with the
+// kernel context (and whose user part is empty).
+//
+// page_directory is the block of PAGING_DIRECTORY_PAGES pages to use as the
+// page directory, mapped at a kernel address, and physical_addr is its
+// physical address.
+paging_context_t paging_clone_kernel_context(page_directory_t *page_directory,
+        uint32_t physical_addr);
+// Create a context that shares the kernel's part of the address space with the
+// kernel context, and whose user part is a copy-on-write copy of the user part
+// of `paging_ctx`.
+//
+// This takes O(1) per user page table (regardless of how many pages are
+// mapped): the user page tables are shared by both contexts, and only copied
+// when one of the contexts changes them or writes to one of their pages.
+paging_context_t paging_fork_context(paging_context_t paging_ctx, page_directory_t *page_directory,
+                                     uint32_t physical_addr);
+// Handle a write to the (present, read-only) user page at virtual_addr of the
+// active context, which must be writable: copy the page if it is still shared
+// with another context (see paging_fork_context), or replace it with a new
+// zeroed page if it is the zero page (see pmm_zero_page), and make it
+// writable.
+void paging_copy_on_write(paging_context_t paging_ctx, uint32_t virtual_addr);
+
+// Map the 4 MB block of physical memory at physical_addr (allocated with
+// order LARGE_PAGE_ORDER) at the user address virtual_addr, using a single 4
+// MB page. The page directory entry must not be present.
+//
+// The block belongs to the mapping: it is freed when the page is unmapped. Any
+// other change to the mappings of the region (a partial unmap, a fork or a
+// change to one of its pages) first splits the 4 MB page into 4 KB pages,
+// which are then managed like any others.
+void paging_map_large_page(paging_context_t, uint32_t virtual_addr, uint32_t physical_addr,
+                           uint32_t flags);
+
+// If the user page table that covers the 4 MB region at virtual_addr maps
+// private, writable pages at all of its entries, copy them into a single 4 MB
+// page (allocated with pmm_try_alloc_pages), which replaces the page table.
+// Returns whether the region was collapsed.
+//
+// The pages are copied with interrupts enabled. If the task writes to any of
+// them (or the table gets shared) in the meantime, the copy is thrown away.
+bool paging_collapse_large_page(paging_context_t, uint32_t virtual_addr);
+
+// Fill in the large page section of the specified memstat_t.
+void paging_memstat(memstat_t *);
+// Load CR3 (see paging_context_t).
+void paging_set_page_directory(uint32_t cr3);
 
 // The format of a page directory entry (with 4KB pages) is:
 // | 31                   12| 11     8 | 7 | 6   | 5 | 4   | 3   | 2   | 1   | 0 |
@@ -64,11 +238,80 @@ void paging_set_page_directory(uint32_t);
 // | 31                   12| 11     9 | 8 | 7   | 6 | 5  | 4   | 3   | 2   | 1   | 0 |
 // |----------------------------------------------------------------------------------|
 // | address of 4KB page    | ignored  | G | PAT | D | A  | PCT | PWT | U/S | R/W | P |
-void paging_map_virtual_to_physical(paging_context_t, uint32_t, uint32_t, uint32_t);
+//
+// With PAE, the entries are 64 bits wide, and the address field extends up to
+// bit 51.
+//
+// NOTE: a kernel address must not be mapped by a 4 MB page (a 4 MB user page is
+// split first). The TLB is not updated, so if the page was already mapped, it
+// is up to the caller to invalidate it.
+void paging_map_virtual_to_physical(paging_context_t, uint32_t, phys_addr_t, uint32_t);
+
+// Map page_count pages starting at virtual_addr to the physically contiguous
+// pages starting at physical_addr, walking each page table only once. The TLB
+// entries of the pages that were already mapped are invalidated.
+void paging_map_range(paging_context_t, uint32_t virtual_addr, uint32_t physical_addr,
+                      uint32_t page_count, uint32_t flags);
+
+// Unmap page_count pages starting at virtual_addr, and invalidate their TLB
+// entries.
+void paging_unmap_range(paging_context_t, uint32_t virtual_addr, uint32_t page_count);
 
-// Unamp the specified address.
+// Map [physical_addr, physical_addr + size) at virtual_addr using 4 MB pages in
+// the page directory the CPU is currently using.
+//
+// This is only meant to be used before init_paging (while the bootstrap page
+// directory is in use). Both addresses must be 4 MB aligned.
+void paging_early_map(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size);
+
+// Copy the missing kernel page directory entries that cover [virtual_start,
+// virtual_end) from the kernel page directory to the active one. Returns
+// whether any entries were copied.
+//
+// NOTE: the kernel page tables are shared by all the page directories, but a
+// page directory entry created after a page directory was cloned is only
+// copied to it when it is first needed (usually by the page fault handler).
+bool paging_sync_kernel_pdes(uint32_t virtual_start, uint32_t virtual_end);
+
+// Fill the specified physical page with zeroes (using the scratch page, with
+// interrupts disabled).
+void paging_zero_physical_page(phys_addr_t physical_addr);
+
+// Copy `size` bytes from src to the specified physical page, starting at
+// `offset` bytes into the page (using the scratch page).
+//
+// NOTE: src must already be present in the page tables, as the page fault
+// handler might need the scratch page itself.
+void paging_copy_to_physical_page(phys_addr_t physical_addr, uint32_t offset, const void *src,
+                                  uint32_t size);
+
+// Copy the specified physical page to dst (using the scratch page).
+void paging_copy_from_physical_page(phys_addr_t physical_addr, void *dst);
+
+// Return the page table entry that maps virtual_addr in the specified context
+// (or 0 if there isn't one).
+//
+// NOTE: the address must not be mapped by a 4 MB page.
+page_entry_t paging_entry(paging_context_t paging_ctx, uint32_t virtual_addr);
+
+// Return the user page table entry `pte` refers to (see PMM_RMAP_PTE), in
+// whichever context it belongs to.
+page_entry_t paging_rmap_entry(uint32_t pte);
+
+// Replace the user page table entry `pte` refers to with `entry`, and
+// invalidate the TLB entry of the page it maps. The reverse mappings are left
+// alone.
+void paging_rmap_set_entry(uint32_t pte, page_entry_t entry);
+
+// Unamp the specified address (and invalidate its TLB entry).
+//
+// NOTE: a kernel address must not be mapped by a 4 MB page.
 void paging_unmap_addr(paging_context_t paging_ctx, uint32_t virtual_addr);
 
+// Return the physical address the specified virtual address is mapped to (or
+// 0 if it isn't mapped).
+phys_addr_t paging_physical_addr(paging_context_t paging_ctx, uint32_t virtual_addr);
+
 // Check whether the specified address is page-aligned.
 bool paging_is_aligned(uint32_t);
 
@@ -1,14 +1,179 @@
 #ifndef __PMM_H__
 #define __PMM_H__
 
-#include "multiboot2.h"
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "mm/meminfo.h"
+#include "mm/addr_space.h"
+#include "mm/paging.h"
+#include "syscall/memstat.h"
+
+// The largest block handed out by the buddy allocator is 2^PMM_MAX_ORDER
+// pages (4 MB).
+#define PMM_MAX_ORDER 10
+
+// The end of the memory addressable by legacy (ISA) DMA.
+#define PMM_ZONE_DMA_END        0x01000000
+// The first frame that can only be mapped with PAE (at 4 GB).
+#define PMM_ZONE_HIGH_FRAME     (1u << 20)
+// Where the PMM bitmaps are mapped.
+#define PMM_METADATA_VIRT_START 0xD0000000
+
+// The frame is a user page table (and its rmap is the first virtual address
+// the page table maps).
+#define PMM_PAGE_TABLE       (1 << 0)
+// The frame is mapped more than once (and its rmap points to a chain of
+// pmm_rmap_t).
+#define PMM_PAGE_RMAP_CHAIN  (1 << 1)
+// The frame is a private user page allocated by the page fault handler, which
+// can be pushed out to the swap store (see reclaim_pages).
+#define PMM_PAGE_RECLAIMABLE (1 << 2)
+// The frame is a read-only page shared by the mappings of several identical
+// pages (see ksm_scan).
+#define PMM_PAGE_MERGED      (1 << 3)
+
+// A reference to a page table entry (the physical address of the page table,
+// and the index of the entry in its lower 12 bits).
+//
+// NOTE: the page tables are always allocated below 4 GB, so this fits in 32
+// bits even with PAE.
+#define PMM_RMAP_PTE(table_physical_addr, index) ((table_physical_addr) | (index))
+#define PMM_RMAP_TABLE(pte)                      ((pte) & ~(PAGE_SIZE - 1))
+#define PMM_RMAP_INDEX(pte)                      ((pte) & (PAGE_SIZE - 1))
+
+// The descriptor of a physical frame.
+//
+// The descriptors of all the frames tracked by the PMM are kept in an array
+// indexed by frame number, so the descriptor of a frame is found in O(1).
+typedef struct pmm_page {
+    // The number of references to the frame, *minus one* (so the frames handed
+    // out by the buddy allocator start out with a single reference without
+    // having to touch the descriptor). Only the frames shared by several
+    // address spaces (see pmm_page_get) have a non-zero count.
+    uint16_t shares;
+    // PMM_PAGE_* flags.
+    uint16_t flags;
+    // The reverse mapping: the user page table entry that maps the frame
+    // (see PMM_RMAP_PTE), or, if PMM_PAGE_RMAP_CHAIN is set, the address of
+    // the chain of entries that map it. 0 if the frame isn't mapped.
+    uint32_t rmap;
+} pmm_page_t;
+
+// A link of the chain of the page table entries that map a frame.
+typedef struct pmm_rmap {
+    uint32_t pte;
+    struct pmm_rmap *next;
+} pmm_rmap_t;
+
+typedef enum pmm_zone_type {
+    // [0, 16 MB): reserved for devices that can't address anything else.
+    PMM_ZONE_DMA,
+    // Everything else (below 4 GB).
+    PMM_ZONE_NORMAL,
+#ifdef CONFIG_PAE
+    // [4 GB, ...): only handed out by pmm_alloc_user_page, as the kernel can't
+    // refer to these frames by pointer.
+    PMM_ZONE_HIGH,
+#endif
+    PMM_ZONE_COUNT,
+} pmm_zone_type_t;
 
 // Initialize the physical memory manager.
-void pmm_init(multiboot_info_t);
+//
+// NOTE: memblock_init must be called first.
+void pmm_init();
+// The mapping of the PMM metadata, which must be present in every page
+// directory.
+addr_space_entry_t pmm_metadata_addr_space();
 // Allocate a (physical) 4 KB page.
+//
+// NOTE: this and all the other functions that return a pointer only allocate
+// memory below 4 GB.
 void *pmm_alloc_page();
+// Allocate a (physical) 4 KB page filled with zeroes.
+//
+// The page is normally taken from a pool of pages zeroed ahead of time by
+// pmm_refill_zeroed_pages.
+void *pmm_alloc_zeroed_page();
+// Allocate a 4 KB page for a user address space. With PAE, the page comes from
+// above 4 GB if there is any memory left there (the kernel only ever accesses
+// such a page through paging_map_scratch), which leaves the memory below 4 GB
+// to the kernel.
+phys_addr_t pmm_alloc_user_page();
+// Like pmm_alloc_user_page, but the page is filled with zeroes.
+//
+// NOTE: with PAE, the pool of zeroed pages (which are below 4 GB) is only used
+// once the memory above 4 GB runs out.
+phys_addr_t pmm_alloc_zeroed_user_page();
+// Zero some free pages for pmm_alloc_zeroed_page. This is meant to be called
+// when the CPU has nothing better to do.
+void pmm_refill_zeroed_pages();
+// Return the (physical) 4 KB page filled with zeroes that the reads from
+// anonymous user memory that hasn't been written to yet are served from.
+//
+// The page is shared by every address space, and is never freed: it isn't
+// reference counted (see pmm_page_get), and is always considered shared, so
+// the first write to it allocates a private page.
+uint32_t pmm_zero_page();
 // Free the specified (physical) 4 KB page.
 void pmm_free_page(void *);
+// Take another reference to the specified (allocated) 4 KB page, e.g. when it
+// is shared copy-on-write by two address spaces. A page starts out with a
+// single reference.
+void pmm_page_get(phys_addr_t physical_addr);
+// Drop a reference to the specified page, freeing it once the last one is
+// gone.
+void pmm_page_put(phys_addr_t physical_addr);
+// Return the number of references to the specified page.
+uint32_t pmm_page_refcount(phys_addr_t physical_addr);
+// Return the number of frames tracked by the PMM.
+uint32_t pmm_frame_count();
+// Return the descriptor of the specified frame (or NULL if the frame isn't
+// tracked, e.g. if it isn't RAM or if it is the zero page).
+pmm_page_t *pmm_page(phys_addr_t physical_addr);
+// Create the cache the reverse mapping chains are allocated from. This must be
+// called before any user pages are mapped.
+void pmm_rmap_init();
+// Record that the specified frame is a user page table that maps the 4 MB
+// starting at virtual_addr.
+void pmm_page_set_table(uint32_t physical_addr, uint32_t virtual_addr);
+// Free the specified user page table, which must not map anything anymore.
+void pmm_free_table(uint32_t physical_addr);
+// Record that the specified frame is mapped by the page table entry `pte` (see
+// PMM_RMAP_PTE).
+void pmm_rmap_add(phys_addr_t physical_addr, uint32_t pte);
+// Record that the specified frame isn't mapped by `pte` anymore.
+void pmm_rmap_remove(phys_addr_t physical_addr, uint32_t pte);
+// Call fn on each page table entry that maps the specified frame.
+void pmm_rmap_walk(phys_addr_t physical_addr, void (*fn)(uint32_t pte, void *data), void *data);
+// Return the virtual address the page table entry `pte` maps.
+uint32_t pmm_rmap_virtual_addr(uint32_t pte);
+// Allocate 2^order physically contiguous (physical) 4 KB pages.
+//
+// The returned address is aligned to the size of the block.
+void *pmm_alloc_pages(uint8_t order);
+// Like pmm_alloc_pages, but return NULL rather than reclaim any memory if there
+// is no free block that large.
+void *pmm_try_alloc_pages(uint8_t order);
+// Like pmm_try_alloc_pages, but the pages are filled with zeroes.
+void *pmm_try_alloc_zeroed_pages(uint8_t order);
+// Allocate 2^order physically contiguous pages from the specified zone (which
+// must be below 4 GB), or return NULL if the zone has no free blocks that
+// large.
+void *pmm_alloc_pages_zone(pmm_zone_type_t, uint8_t order);
+// Free the block of 2^order pages starting at the specified (physical)
+// address.
+void pmm_free_pages(void *, uint8_t order);
+// Free all but the first page_count pages of a block returned by
+// pmm_alloc_pages.
+void pmm_trim_pages(void *, uint8_t order, uint32_t page_count);
+// Return the smallest order of a block that can hold page_count pages.
+uint8_t pmm_page_count_to_order(uint32_t page_count);
+// Fill in the physical memory section of the specified memstat_t.
+//
+// NOTE: the frames that aren't usable RAM (holes in the memory map, the kernel
+// image, etc.) count as used.
+void pmm_memstat(memstat_t *);
 
 #endif /* __PMM_H__ */
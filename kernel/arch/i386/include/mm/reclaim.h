@@ -0,0 +1,23 @@
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+#include <stdint.h>
+
+// The number of pages reclaimed at once when the PMM runs out of memory.
+#define RECLAIM_BATCH 32
+
+// Take up to `target` frames back from the user address spaces, returning the
+// number of frames freed.
+//
+// The frames are picked by a clock (second chance) scan over the frame
+// descriptors: a page whose accessed flag is set gets its flag cleared and is
+// skipped until the next sweep. A clean page still holds what the page fault
+// handler filled it with (zeroes or the contents of a file), so it is simply
+// dropped. A dirty page is compressed into the swap store, and its page table
+// entry is replaced with a swap entry (see PAGING_SWAP_ENTRY).
+//
+// Only the private pages mapped by a single page table entry are reclaimed
+// (see PMM_PAGE_RECLAIMABLE).
+uint32_t reclaim_pages(uint32_t target);
+
+#endif /* __RECLAIM_H__ */
@@ -0,0 +1,48 @@
+#ifndef __SWAP_H__
+#define __SWAP_H__
+
+#include <stdint.h>
+
+#include <mm/paging.h>
+#include <syscall/memstat.h>
+
+// The number of pages the swap store can hold.
+#define SWAP_SLOT_COUNT 8192
+// The pages that don't compress to at most this many bytes aren't worth
+// storing.
+#define SWAP_MAX_COMPRESSED_SIZE (PAGE_SIZE * 3 / 4)
+
+// The swap store: an in-memory pool of compressed pages, which the pages
+// reclaimed from user address spaces are pushed out to (see reclaim_pages).
+//
+// Each stored page occupies a slot, which is referred to by the page table
+// entries that used to map the page (see PAGING_SWAP_ENTRY). The compressed
+// data lives on the kernel heap.
+
+// Compress the page at physical_addr into a new slot, which starts out with a
+// single reference. Returns the slot (which is never 0), or 0 if the page
+// doesn't compress well enough or the store is full.
+//
+// This doesn't allocate any memory: the compressed data is only moved to the
+// heap by swap_commit, which must be called before any other page is stored.
+// This gives the caller a chance to free the page first.
+uint32_t swap_compress(phys_addr_t physical_addr);
+
+// Move the compressed data of the slot returned by the last swap_compress call
+// to the heap.
+void swap_commit(uint32_t slot);
+
+// Decompress the page stored in the slot into the page at physical_addr.
+void swap_read(uint32_t slot, phys_addr_t physical_addr);
+
+// Take another reference to the slot (e.g. when a page table that refers to it
+// is copied).
+void swap_dup(uint32_t slot);
+
+// Drop a reference to the slot, freeing it once the last one is gone.
+void swap_put(uint32_t slot);
+
+// Fill in the swap section of the specified memstat_t.
+void swap_memstat(memstat_t *);
+
+#endif /* __SWAP_H__ */
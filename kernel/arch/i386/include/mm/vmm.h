@@ -2,63 +2,145 @@
 #define __VMM_H__
 
 #include <stdint.h>
+#include <avl.h>
 #include <mm/paging.h>
+#include <syscall/memstat.h>
+
+// The contents of the pages of a file-backed allocation: `size` bytes, starting
+// at `data` (a kernel address), are mapped at `virtual_addr`. The rest of the
+// pages of the allocation are filled with zeroes.
+//
+// The read-only pages are shared by every address space the file is mapped
+// in. If physical_addr (the physical address of `data`) isn't 0, the pages
+// that only hold file data are mapped straight from the file. The other pages
+// are filled in once, and their frames are kept in `frames` (one entry per
+// page, starting at the page that contains virtual_addr, 0 until the page is
+// first accessed).
+typedef struct vmm_file {
+    const char *data;
+    uint32_t virtual_addr;
+    uint32_t size;
+    uint32_t physical_addr;
+    uint32_t *frames;
+} vmm_file_t;
 
 // A virtual allocation.
 //
 // This represents one or more mapped pages, starting at the specified virtual
 // address. The allocated pages are not necessarily present in the page tables.
 //
+// The pages are backed by the physically contiguous pages starting at
+// physical_addr, or, if physical_addr is 0, by pages allocated when they are
+// first accessed (which are filled in from `file` if file.data isn't NULL).
+// Until they are written to, the anonymous user pages (the ones that don't
+// hold any file data) are all backed by the zero page (see pmm_zero_page).
+//
+// The allocations without PAGE_FLAG_PRESENT (e.g. the guard page of the user
+// stack) reserve the addresses, but are never backed by anything.
+//
+// The anonymous user allocations with PAGE_FLAG_PAGE_SIZE are backed by 4 MB
+// pages wherever they cover a whole (4 MB aligned) region, and a free 4 MB
+// block is available (see paging_map_large_page). Any other allocation might
+// still end up backed by 4 MB pages, once all of the pages of a region are
+// present (see hugepage_scan).
+//
 // NOTE: virtual_addr and physical_addr *must* be 4096 bytes aligned.
 typedef struct vmm_allocation {
     uint32_t virtual_addr;
     uint32_t physical_addr;
     uint32_t page_count;
     uint32_t flags;
+    vmm_file_t file;
 } vmm_allocation_t;
 
-// The allocation search tree.
+// A node of the allocation search tree.
+//
+// This is an AVL tree keyed by virtual address, so looking up the allocation
+// that contains an address takes O(log n) steps, even though most allocations
+// are made in ascending address order.
 typedef struct vmm_allocation_tree {
     vmm_allocation_t alloc;
-    struct vmm_allocation_tree *left;
-    struct vmm_allocation_tree *right;
-    struct vmm_allocation_tree *parent;
+    avl_node_t node;
 } vmm_allocation_tree_t;
 
-// A list of free (unmapped) areas in some virtual address space. The free area
-// consists of page_count unmapped pages starting at a specific virtual address.
+// A free (unmapped) area in some virtual address space. The free area consists
+// of page_count unmapped pages starting at a specific virtual address.
+//
+// The free areas of an address space are kept in an AVL tree keyed by virtual
+// address. Each node also records the size of the largest free area in its
+// subtree, which lets the allocator skip the subtrees that are too fragmented
+// to satisfy a request.
 //
 // NOTE: virtual_addr *must* be 4096 bytes aligned.
 typedef struct vmm_free_blocks {
     uint32_t virtual_addr;
     uint32_t page_count;
-    struct vmm_free_blocks *next;
+    // The largest page_count in the subtree rooted at this node.
+    uint32_t max_page_count;
+    avl_node_t node;
 } vmm_free_blocks_t;
 
 typedef struct vmm_context {
-    vmm_allocation_tree_t *allocations;
-    vmm_free_blocks_t *free_blocks;
+    // The vmm_allocation_tree_t nodes.
+    avl_node_t *allocations;
+    // The vmm_free_blocks_t nodes (adjacent free areas are always merged).
+    avl_node_t *free_blocks;
+    // The allocation returned by the last vmm_find_allocation call (if its
+    // page_count is 0, the cache is empty).
+    vmm_allocation_t last_hit;
 } vmm_context_t;
 
 // Initialize the virtual memory manager.
 vmm_context_t vmm_init();
 
 // Create a new address space.
+//
+// A context only tracks the user's part of the address space: the kernel's
+// part is the same in every address space, so it is tracked by a single
+// context shared by all of them.
 vmm_context_t vmm_new_context();
 
-// Clone an existing address space.
+// Clone an existing address space (i.e. its user part).
+//
+// This takes O(1): the clone shares the allocation and free block trees of the
+// original, and the nodes are only copied when one of the contexts changes them
+// (see avl_node_t).
 vmm_context_t vmm_clone_context(vmm_context_t);
 
 // Allocate page_count consecutive pages starting at the specified virtual address.
 //
 // This maps the pages in the virtual address space of the current process,
 // returning a pointer to the beginning of the newly allocated sequence of
-// pages.
+// pages. If virtual_addr is 0 and the flags don't include PAGE_FLAG_USER, the
+// pages are allocated in the kernel's part of the address space.
 //
 // The specified address *must* be 4096 bytes aligned.
 void *vmm_map_pages(vmm_context_t *, uint32_t virtual_addr, uint32_t physical_addr,
                     uint32_t page_count, uint32_t flags);
 
+// Return the lowest `align` aligned address (at or above USER_MIN_ADDR) that
+// starts page_count free pages in the user's part of the address space, or 0
+// if there is no such range. Nothing is mapped: the caller passes the address
+// to vmm_map_pages.
+//
+// `align` *must* be a power of two and at least 4096.
+uint32_t vmm_find_user_range(vmm_context_t *, uint32_t page_count, uint32_t align);
+
+// Allocate page_count consecutive (user) pages starting at the specified
+// virtual address, which are filled in from `file` when they are first
+// accessed.
+//
+// The specified address *must* be 4096 bytes aligned.
+void vmm_map_file(vmm_context_t *, uint32_t virtual_addr, uint32_t page_count, uint32_t flags,
+                  vmm_file_t file);
+
+// Extend the (anonymous, user) allocation that starts at virtual_addr
+// downwards, so it starts at new_virtual_addr instead, and return it. The
+// pages in between must be free.
+//
+// Both addresses *must* be 4096 bytes aligned.
+vmm_allocation_t vmm_grow_down(vmm_context_t *, uint32_t virtual_addr, uint32_t new_virtual_addr);
+
 // Free page_count consecutive pages starting at the specified page.
 //
 // The specified address *must* be 4096 bytes aligned.
@@ -67,12 +149,27 @@ void vmm_unmap_pages(vmm_context_t *, uint32_t virtual_addr, uint32_t page_count
 // Find the allocation that corresponds to the specified address.
 vmm_allocation_t vmm_find_allocation(vmm_context_t *, uint32_t virtual_addr);
 
+// Check whether [virtual_addr, virtual_addr + size) is entirely covered by user
+// allocations that allow the accesses allowed by `flags` (e.g. before the
+// kernel accesses a buffer passed by the user).
+bool vmm_is_user_range(vmm_context_t *, uint32_t virtual_addr, uint32_t size, uint32_t flags);
+
 paging_context_t vmm_clone_paging_context(vmm_context_t *vmm_ctx, paging_context_t paging_ctx);
 
+// Create a page directory for a forked copy of the (user) task whose context is
+// `paging_ctx`: the user pages are shared copy-on-write (see
+// paging_fork_context).
+paging_context_t vmm_fork_paging_context(vmm_context_t *vmm_ctx, paging_context_t paging_ctx);
+
 // Map the specified virtual address to a physical address.
 uint32_t vmm_virtual_to_physical(uint32_t addr);
 
 // Map the specified physical address to a virtual address.
 uint32_t vmm_physical_to_virtual(uint32_t addr);
 
+// Fill in the virtual memory section of the specified memstat_t (the number of
+// nodes in the allocation trees and of free blocks of the context and of the
+// kernel's part of the address space).
+void vmm_memstat(vmm_context_t *, memstat_t *);
+
 #endif /* __VMM_H__ */
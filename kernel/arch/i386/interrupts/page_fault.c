@@ -5,9 +5,14 @@
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/paging.h>
+#include <mm/meminfo.h>
+#include <mm/addr_space.h>
+#include <mm/swap.h>
 #include <task.h>
+#include <sched.h>
 
 extern struct task_list CURRENT_TASK;
+extern kernel_meminfo_t KERNEL_MEMINFO;
 
 // Get the (linear) address that triggered the page fault.
 static uint32_t
@@ -21,6 +26,117 @@ read_page_fault_addr() {
     return addr;
 }
 
+// Terminate the current task, which made an invalid access to addr, the same
+// way exit does: the task is removed from the scheduler, and never runs again.
+__attribute__((noreturn)) static void
+kill_current_task(uint32_t addr) {
+    uint32_t pid = CURRENT_TASK.task->pid;
+
+    printk_info("task %u killed: invalid access to %#x\n", pid, addr);
+    sched_remove(pid);
+    sched_context_switch();
+
+    PANIC("killed task %u was scheduled again", pid);
+}
+
+// Check whether any part of the file is mapped at the page at virtual_addr.
+static bool
+file_page_has_data(vmm_file_t *file, uint32_t virtual_addr) {
+    return file->data && virtual_addr < file->virtual_addr + file->size
+           && file->virtual_addr < virtual_addr + PAGE_SIZE;
+}
+
+// If addr is in the part of the address space the user stack can grow into,
+// extend the stack down to it, and return the stack allocation. Otherwise,
+// return an empty allocation.
+static vmm_allocation_t
+grow_user_stack(vmm_context_t *vmm_ctx, uint32_t addr) {
+    if (addr >= USER_STACK_TOP || addr < USER_STACK_TOP - USER_STACK_MAX_SIZE) {
+        return (vmm_allocation_t) {
+            0
+        };
+    }
+
+    vmm_allocation_t stack = vmm_find_allocation(vmm_ctx, USER_STACK_TOP - PAGE_SIZE);
+
+    ASSERT(stack.page_count, "user stack not found");
+
+    return vmm_grow_down(vmm_ctx, stack.virtual_addr, paging_align_addr(addr));
+}
+
+// Copy the part of the file that is mapped at the page at virtual_addr into
+// the (zeroed) page at physical_addr.
+static void
+fill_file_page(vmm_file_t *file, uint32_t virtual_addr, phys_addr_t physical_addr) {
+    uint32_t file_end = file->virtual_addr + file->size;
+    uint32_t start = virtual_addr > file->virtual_addr ? virtual_addr : file->virtual_addr;
+    uint32_t end = virtual_addr + PAGE_SIZE < file_end ? virtual_addr + PAGE_SIZE : file_end;
+
+    // The pages past the end of the file (e.g. the .bss) are all zeroes.
+    if (start < end) {
+        paging_copy_to_physical_page(physical_addr, start - virtual_addr,
+                                     file->data + (start - file->virtual_addr), end - start);
+    }
+}
+
+// Return the frame to map at the read-only page at virtual_addr of a file
+// allocation, with a reference taken for the new mapping.
+//
+// The pages that only hold file data are mapped straight from the file. The
+// others are filled in by the first address space that accesses them, and
+// shared by the rest (see vmm_file_t).
+static uint32_t
+shared_file_page(vmm_file_t *file, uint32_t virtual_addr) {
+    uint32_t physical_addr;
+
+    if (file->physical_addr && virtual_addr + PAGE_SIZE <= file->virtual_addr + file->size) {
+        physical_addr = file->physical_addr - (file->virtual_addr - virtual_addr);
+    } else {
+        uint32_t *frame = &file->frames[(virtual_addr - paging_align_addr(file->virtual_addr))
+                                        / PAGE_SIZE];
+
+        if (!*frame) {
+            // The cache holds on to its own reference to the frame.
+            *frame = (uint32_t)pmm_alloc_zeroed_page();
+            fill_file_page(file, virtual_addr, *frame);
+        }
+
+        physical_addr = *frame;
+    }
+
+    pmm_page_get(physical_addr);
+
+    return physical_addr;
+}
+
+// Back the 4 MB region that contains virtual_addr with a single (zeroed) 4 MB
+// page, if the allocation is an anonymous one that covers the whole region,
+// and none of the pages of the region are mapped yet. Returns whether the page
+// was mapped.
+static bool
+map_large_page(vmm_allocation_t *alloc, uint32_t virtual_addr) {
+    paging_context_t paging_ctx = CURRENT_TASK.task->paging_ctx;
+    uint32_t start = virtual_addr & ~(LARGE_PAGE_SIZE - 1);
+
+    if (alloc->physical_addr || alloc->file.data || start < alloc->virtual_addr
+            || (start - alloc->virtual_addr) / PAGE_SIZE + PAGE_TABLE_SIZE > alloc->page_count
+            || (paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(start)]
+                & PAGE_FLAG_PRESENT)) {
+        return false;
+    }
+
+    // Fall back to 4 KB pages if there is no free 4 MB block.
+    uint32_t physical_addr = (uint32_t)pmm_try_alloc_zeroed_pages(LARGE_PAGE_ORDER);
+
+    if (!physical_addr) {
+        return false;
+    }
+
+    paging_map_large_page(paging_ctx, start, physical_addr, alloc->flags);
+
+    return true;
+}
+
 void
 page_fault_handler(interrupt_state_t *state, uint32_t err_code) {
     uint32_t addr = read_page_fault_addr();
@@ -36,23 +152,116 @@ page_fault_handler(interrupt_state_t *state, uint32_t err_code) {
                  err_code & PAGING_ERR_CODE_US ? "user": "kernel");
 
     if (err_code & PAGING_ERR_CODE_P) {
-        // A protection fault is always an error
+        // A write to a read-only page of a writable user allocation means the
+        // page is (or was) shared copy-on-write with another task (see
+        // paging_fork_context). This includes the writes made by the kernel on
+        // behalf of the user.
+        if ((err_code & PAGING_ERR_CODE_WR) && addr < KERNEL_MEMINFO.higher_half_base) {
+            vmm_allocation_t alloc = vmm_find_allocation(&CURRENT_TASK.task->vmm_context, addr);
+
+            if (alloc.page_count && (alloc.flags & PAGE_FLAG_WRITE)) {
+                paging_copy_on_write(CURRENT_TASK.task->paging_ctx, addr);
+                return;
+            }
+        }
+
+        // Any other protection fault is an error
         if (err_code & PAGING_ERR_CODE_US) {
-            PANIC("TODO: kill the misbehaving user process");
+            // E.g. a write to the text of the program.
+            kill_current_task(addr);
         } else {
             PANIC("kernel protection fault");
         }
     } else {
         uint32_t aligned_vaddr = paging_align_addr(addr);
+
+        // The kernel page table that maps the address might have been created
+        // after the active page directory was cloned.
+        if (addr >= KERNEL_MEMINFO.higher_half_base
+                && paging_sync_kernel_pdes(aligned_vaddr, aligned_vaddr + PAGE_SIZE)) {
+            return;
+        }
+
         // Page not present
-        vmm_allocation_t alloc = vmm_find_allocation(&CURRENT_TASK.task->vmm_context, aligned_vaddr);
+        vmm_context_t *vmm_ctx = &CURRENT_TASK.task->vmm_context;
+        vmm_allocation_t alloc = vmm_find_allocation(vmm_ctx, aligned_vaddr);
+
+        if (!alloc.page_count) {
+            alloc = grow_user_stack(vmm_ctx, addr);
+        }
+
+        // E.g. a NULL pointer dereference.
+        if (!alloc.page_count && (err_code & PAGING_ERR_CODE_US)) {
+            kill_current_task(addr);
+        }
 
         ASSERT(alloc.page_count, "invalid VMM state");
 
-        uint32_t physical_addr = alloc.physical_addr ? alloc.physical_addr : (uint32_t)pmm_alloc_page();
+        if (!(alloc.flags & PAGE_FLAG_PRESENT)) {
+            // E.g. the guard page below the user stack (which means the
+            // stack overflowed).
+            kill_current_task(addr);
+        }
+
+        // PAGE_FLAG_PAGE_SIZE asks for the allocation to be backed by 4 MB
+        // pages where possible (see vmm_allocation_t).
+        if ((alloc.flags & PAGE_FLAG_PAGE_SIZE) && map_large_page(&alloc, aligned_vaddr)) {
+            printk_debug("mapped 4 MB page at %#x\n", aligned_vaddr);
+            return;
+        }
+
+        alloc.flags &= ~PAGE_FLAG_PAGE_SIZE;
+
+        // The page might have been pushed out to the swap store (see
+        // reclaim_pages).
+        page_entry_t entry = paging_entry(CURRENT_TASK.task->paging_ctx, aligned_vaddr);
+
+        if (PAGING_IS_SWAP_ENTRY(entry)) {
+            phys_addr_t physical_addr = pmm_alloc_user_page();
+
+            swap_read(PAGING_SWAP_SLOT(entry), physical_addr);
+            pmm_page(physical_addr)->flags |= PMM_PAGE_RECLAIMABLE;
+            // The page only exists in memory now, so it must be stored again if
+            // it's reclaimed.
+            paging_map_virtual_to_physical(CURRENT_TASK.task->paging_ctx, aligned_vaddr,
+                                           physical_addr, alloc.flags | PAGE_FLAG_DIRTY);
+            // Mapping the page might have copied the page table, which takes
+            // another reference to the slot.
+            swap_put(PAGING_SWAP_SLOT(entry));
+            printk_debug("swapped in %#x -> %#llx\n", aligned_vaddr, (uint64_t)physical_addr);
+            return;
+        }
+
+        // The pages of an allocation backed by physical memory are physically
+        // contiguous. Anonymous pages must not leak the previous contents of
+        // the frame, so they come from the pool of pre-zeroed pages.
+        phys_addr_t physical_addr;
+        uint32_t flags = alloc.flags;
+
+        if (alloc.physical_addr) {
+            physical_addr = alloc.physical_addr + (aligned_vaddr - alloc.virtual_addr);
+        } else if ((alloc.flags & PAGE_FLAG_USER) && !file_page_has_data(&alloc.file, aligned_vaddr)
+                   && !(err_code & PAGING_ERR_CODE_WR)) {
+            // Reading anonymous memory (e.g. the stack or the .bss) doesn't
+            // need a page of its own: the first write replaces the zero page
+            // with a private one (see paging_copy_on_write).
+            physical_addr = pmm_zero_page();
+            flags &= ~PAGE_FLAG_WRITE;
+        } else if (alloc.file.data && !(alloc.flags & PAGE_FLAG_WRITE)) {
+            physical_addr = shared_file_page(&alloc.file, aligned_vaddr);
+        } else {
+            physical_addr = alloc.flags & PAGE_FLAG_USER ? pmm_alloc_zeroed_user_page()
+                            : (uint32_t)pmm_alloc_zeroed_page();
+            pmm_page(physical_addr)->flags |= PMM_PAGE_RECLAIMABLE;
+
+            if (alloc.file.data) {
+                fill_file_page(&alloc.file, aligned_vaddr, physical_addr);
+            }
+        }
 
         paging_map_virtual_to_physical(CURRENT_TASK.task->paging_ctx, aligned_vaddr, physical_addr,
-                                       alloc.flags);
-        printk_debug("mapped %#x -> %#x (flags=%u)\n", aligned_vaddr, physical_addr, alloc.flags);
+                                       flags);
+        printk_debug("mapped %#x -> %#llx (flags=%u)\n", aligned_vaddr, (uint64_t)physical_addr,
+                     flags);
     }
 }
@@ -7,20 +7,23 @@
 
 void *
 alloc_kernel_stack(paging_context_t paging_ctx, vmm_context_t *vmm_context) {
-    uint32_t bottom_physical_addr = (uint32_t)pmm_alloc_page();
+    // Allocate all the stack pages in one go (any pages past
+    // KERNEL_STACK_PAGE_COUNT are returned to the PMM).
+    uint8_t order = pmm_page_count_to_order(KERNEL_STACK_PAGE_COUNT);
+    void *stack_pages = pmm_alloc_pages(order);
+    pmm_trim_pages(stack_pages, order, KERNEL_STACK_PAGE_COUNT);
+
+    uint32_t bottom_physical_addr = (uint32_t)stack_pages;
     uint32_t kernel_stack_bottom = (uint32_t)vmm_map_pages(vmm_context, 0, bottom_physical_addr,
                                    KERNEL_STACK_PAGE_COUNT,
-                                   PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
+                                   PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL);
     // Make sure the stack top is within the allocated region and 16-bytes
     // aligned (the call instruction has this alignment requirement).
     uint32_t kernel_stack_top = kernel_stack_bottom + KERNEL_STACK_SIZE - 16;
 
     // If the kernel stack is not mapped, you're going to have a bad time.
-    for (size_t i = 1; i < KERNEL_STACK_PAGE_COUNT; ++i) {
-        uint32_t physical_addr = (uint32_t)pmm_alloc_page();
-        paging_map_virtual_to_physical(paging_ctx, kernel_stack_bottom + i * PAGE_SIZE, physical_addr,
-                                       PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
-    }
+    paging_map_range(paging_ctx, kernel_stack_bottom, bottom_physical_addr, KERNEL_STACK_PAGE_COUNT,
+                     PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL);
 
     return (void *)kernel_stack_top;
 }
@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mm/bitmap.h>
+
+// Return the index of the least significant set bit of `word` (which must not
+// be 0).
+static inline uint32_t
+bsf(uint32_t word) {
+    uint32_t index;
+    asm("bsf %1, %0" : "=r"(index) : "rm"(word));
+    return index;
+}
+
+// Set the specified bit of `level`, updating the levels above it if its word
+// becomes full.
+static void
+set_bit_at(bitmap_t *bitmap, uint32_t level, uint32_t bit) {
+    for (; level < bitmap->level_count; ++level) {
+        uint32_t *word = &bitmap->levels[level][bit / 32];
+
+        *word |= 1u << (bit % 32);
+        if (*word != UINT32_MAX) {
+            break;
+        }
+        // The index of a word is the index of its bit in the next level.
+        bit /= 32;
+    }
+}
+
+// Clear the specified bit of `level`, updating the levels above it if its word
+// used to be full.
+static void
+clear_bit_at(bitmap_t *bitmap, uint32_t level, uint32_t bit) {
+    for (; level < bitmap->level_count; ++level) {
+        uint32_t *word = &bitmap->levels[level][bit / 32];
+        bool was_full = *word == UINT32_MAX;
+
+        *word &= ~(1u << (bit % 32));
+        if (!was_full) {
+            break;
+        }
+        bit /= 32;
+    }
+}
+
+// Return the mask of the bits of the word containing `bit` that are part of
+// the range [bit, end).
+static uint32_t
+word_mask(uint32_t bit, uint32_t end, uint32_t *bits_in_word) {
+    uint32_t offset = bit % 32;
+    uint32_t n = 32 - offset < end - bit ? 32 - offset : end - bit;
+
+    *bits_in_word = n;
+    return n == 32 ? UINT32_MAX : ((1u << n) - 1) << offset;
+}
+
+void
+bitmap_init(bitmap_t *bitmap, uint32_t *storage, uint32_t bit_count) {
+    uint32_t bits = bit_count;
+    uint32_t words;
+
+    bitmap->level_count = 0;
+    bitmap->cursor = 0;
+
+    do {
+        words = BITMAP_WORDS(bits);
+        memset(storage, 0, words * sizeof(uint32_t));
+
+        bitmap->levels[bitmap->level_count] = storage;
+        bitmap->bit_count[bitmap->level_count] = bits;
+        bitmap->level_count++;
+
+        storage += words;
+        bits = words;
+    } while (words > 1 && bitmap->level_count < BITMAP_MAX_LEVELS);
+
+    // The bits past the end of each level don't correspond to anything: mark
+    // them as set so they are never returned by bitmap_find_clear.
+    for (uint32_t level = 0; level < bitmap->level_count; ++level) {
+        uint32_t level_bits = bitmap->bit_count[level];
+        uint32_t last_word = (level_bits - 1) / 32;
+
+        if (level_bits % 32) {
+            bitmap->levels[level][last_word] |= ~((1u << (level_bits % 32)) - 1);
+        }
+
+        if (bitmap->levels[level][last_word] == UINT32_MAX && level + 1 < bitmap->level_count) {
+            bitmap->levels[level + 1][last_word / 32] |= 1u << (last_word % 32);
+        }
+    }
+}
+
+bool
+bitmap_test(bitmap_t *bitmap, uint32_t bit) {
+    return bitmap->levels[0][bit / 32] & (1u << (bit % 32));
+}
+
+void
+bitmap_set(bitmap_t *bitmap, uint32_t bit) {
+    set_bit_at(bitmap, 0, bit);
+}
+
+void
+bitmap_clear(bitmap_t *bitmap, uint32_t bit) {
+    clear_bit_at(bitmap, 0, bit);
+}
+
+void
+bitmap_set_range(bitmap_t *bitmap, uint32_t start, uint32_t count) {
+    uint32_t end = start + count;
+
+    for (uint32_t bit = start, n = 0; bit < end; bit += n) {
+        uint32_t *word = &bitmap->levels[0][bit / 32];
+        uint32_t mask = word_mask(bit, end, &n);
+        bool was_full = *word == UINT32_MAX;
+
+        *word |= mask;
+        if (!was_full && *word == UINT32_MAX) {
+            set_bit_at(bitmap, 1, bit / 32);
+        }
+    }
+}
+
+void
+bitmap_clear_range(bitmap_t *bitmap, uint32_t start, uint32_t count) {
+    uint32_t end = start + count;
+
+    for (uint32_t bit = start, n = 0; bit < end; bit += n) {
+        uint32_t *word = &bitmap->levels[0][bit / 32];
+        uint32_t mask = word_mask(bit, end, &n);
+        bool was_full = *word == UINT32_MAX;
+
+        *word &= ~mask;
+        if (was_full && *word != UINT32_MAX) {
+            clear_bit_at(bitmap, 1, bit / 32);
+        }
+    }
+}
+
+bool
+bitmap_range_clear(bitmap_t *bitmap, uint32_t start, uint32_t count) {
+    uint32_t end = start + count;
+
+    for (uint32_t bit = start, n = 0; bit < end; bit += n) {
+        uint32_t mask = word_mask(bit, end, &n);
+
+        if (bitmap->levels[0][bit / 32] & mask) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Find the first clear bit at or after `start`.
+static uint32_t
+find_clear_from(bitmap_t *bitmap, uint32_t start) {
+    uint32_t level = 0;
+    uint32_t bit = start;
+
+    // Walk up the levels until we find a word with a clear bit at or after
+    // `bit`.
+    for (;;) {
+        if (bit >= bitmap->bit_count[level]) {
+            return BITMAP_NOT_FOUND;
+        }
+
+        // Ignore the bits before `bit`.
+        uint32_t word = bitmap->levels[level][bit / 32] | ((1u << (bit % 32)) - 1);
+
+        if (word != UINT32_MAX) {
+            bit = (bit & ~31u) + bsf(~word);
+            break;
+        }
+
+        if (level + 1 < bitmap->level_count) {
+            // The rest of this word is full, so continue the search from the
+            // next word, which is summarized by the level above.
+            bit = bit / 32 + 1;
+            level++;
+        } else {
+            bit = (bit & ~31u) + 32;
+        }
+    }
+
+    // Walk back down: a clear bit in level `n` means the corresponding word of
+    // level `n - 1` has a clear bit.
+    while (level > 0) {
+        level--;
+        bit = bit * 32 + bsf(~bitmap->levels[level][bit]);
+    }
+
+    return bit;
+}
+
+uint32_t
+bitmap_find_clear(bitmap_t *bitmap) {
+    uint32_t bit = find_clear_from(bitmap, bitmap->cursor);
+
+    if (bit == BITMAP_NOT_FOUND && bitmap->cursor) {
+        // Wrap around.
+        bit = find_clear_from(bitmap, 0);
+    }
+
+    if (bit != BITMAP_NOT_FOUND) {
+        bitmap->cursor = bit + 1 < bitmap->bit_count[0] ? bit + 1 : 0;
+    }
+
+    return bit;
+}
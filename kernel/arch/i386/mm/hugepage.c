@@ -0,0 +1,73 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <flags.h>
+#include <sched.h>
+#include <task.h>
+
+#include <mm/hugepage.h>
+#include <mm/meminfo.h>
+#include <mm/paging.h>
+
+extern kernel_meminfo_t KERNEL_MEMINFO;
+
+// The PID of the task that was scanned last.
+static uint32_t LAST_PID;
+
+// Pick the user task with the lowest PID above LAST_PID (see
+// sched_for_each_task).
+static void
+hugepage_next_task(task_control_block_t *task, void *data) {
+    task_control_block_t **next = data;
+
+    // Kernel tasks don't have a user address space of their own.
+    if (!task->virtual_addr_space || task->pid <= LAST_PID) {
+        return;
+    }
+
+    if (!*next || task->pid < (*next)->pid) {
+        *next = task;
+    }
+}
+
+void
+hugepage_scan() {
+    uint32_t budget = HUGEPAGE_COLLAPSES_PER_SCAN;
+    task_control_block_t *task = NULL;
+    bool enabled = interrupts_enabled();
+
+    // The tasks mustn't change while they are being looked at. The task
+    // control blocks are never freed, so the task can be scanned with
+    // interrupts enabled (which the copies in paging_collapse_large_page
+    // need).
+    asm volatile("cli" ::: "memory");
+    sched_for_each_task(hugepage_next_task, &task);
+
+    if (enabled) {
+        asm volatile("sti" ::: "memory");
+    }
+
+    // Start over from the first task next time.
+    if (!task) {
+        LAST_PID = 0;
+        return;
+    }
+
+    LAST_PID = task->pid;
+
+    for (uint32_t i = 0; i < PAGE_DIRECTORY_INDEX(KERNEL_MEMINFO.higher_half_base) && budget;
+            ++i) {
+        if (paging_collapse_large_page(task->paging_ctx, i << PAGE_DIRECTORY_START)) {
+            budget--;
+        }
+    }
+}
+
+void
+hugepage_task() {
+    for (;;) {
+        hugepage_scan();
+        // Give the other tasks a chance to run.
+        asm volatile("hlt");
+    }
+}
@@ -0,0 +1,304 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <flags.h>
+#include <panic.h>
+#include <slab.h>
+
+#include <mm/ksm.h>
+#include <mm/paging.h>
+#include <mm/pmm.h>
+
+// A page recorded in the table, under the checksum of its contents.
+typedef struct ksm_node {
+    uint32_t checksum;
+    phys_addr_t physical_addr;
+    // The page table entry that mapped the page when it was recorded, if the
+    // page is a candidate, or 0 if the page is merged (in which case the table
+    // holds a reference to it).
+    uint32_t pte;
+    struct ksm_node *next;
+} ksm_node_t;
+
+static ksm_node_t *BUCKETS[KSM_BUCKET_COUNT];
+static kmem_cache_t *NODE_CACHE;
+
+// The frame ksm_scan looks at next.
+static uint32_t CLOCK_HAND;
+
+// The page being scanned, and the page it is compared to.
+static uint32_t PAGE_BUFFER[PAGE_SIZE / sizeof(uint32_t)];
+static uint32_t OTHER_BUFFER[PAGE_SIZE / sizeof(uint32_t)];
+
+static uint32_t SHARED_FRAMES;
+static uint32_t MERGES;
+static uint32_t UNMERGES;
+static uint32_t SCANNED_PAGES;
+static uint32_t FULL_SCANS;
+
+// Disable interrupts, returning whether they were enabled.
+//
+// NOTE: this keeps the tasks from writing to a page between the time it is
+// compared to another page and the time it is write-protected.
+static bool
+ksm_lock() {
+    bool enabled = interrupts_enabled();
+
+    asm volatile("cli" ::: "memory");
+
+    return enabled;
+}
+
+static void
+ksm_unlock(bool enabled) {
+    if (enabled) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+// The FNV-1a hash of the page, one word at a time.
+static uint32_t
+ksm_checksum(const uint32_t *data) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); ++i) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static bool
+ksm_is_zero(const uint32_t *data) {
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); ++i) {
+        if (data[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Check whether the page at physical_addr holds the same data as the page
+// being scanned.
+static bool
+ksm_same_data(phys_addr_t physical_addr) {
+    paging_copy_from_physical_page(physical_addr, OTHER_BUFFER);
+
+    return !memcmp(PAGE_BUFFER, OTHER_BUFFER, PAGE_SIZE);
+}
+
+// Check whether the frame is a private user page mapped by a single page
+// table entry, which can be merged with another page.
+static bool
+ksm_is_candidate(pmm_page_t *page) {
+    return page && page->flags == PMM_PAGE_RECLAIMABLE && !page->shares && page->rmap;
+}
+
+// Map the page at target (which holds the same data) read-only in place of
+// the page at physical_addr, which is only mapped by the page table entry pte.
+static void
+ksm_merge(phys_addr_t physical_addr, uint32_t pte, phys_addr_t target) {
+    page_entry_t entry = paging_rmap_entry(pte);
+
+    paging_rmap_set_entry(pte, target | (entry & (PAGE_SIZE - 1) & ~PAGE_FLAG_WRITE));
+    pmm_rmap_remove(physical_addr, pte);
+    pmm_page_put(physical_addr);
+    // This does nothing for the zero page, which isn't tracked.
+    pmm_page_get(target);
+    pmm_rmap_add(target, pte);
+    MERGES++;
+}
+
+// Turn the candidate page into a merged page, which the table holds a
+// reference to.
+static void
+ksm_promote(ksm_node_t *node) {
+    page_entry_t entry = paging_rmap_entry(node->pte);
+
+    paging_rmap_set_entry(node->pte, entry & ~PAGE_FLAG_WRITE);
+    pmm_page(node->physical_addr)->flags = PMM_PAGE_MERGED;
+    pmm_page_get(node->physical_addr);
+    node->pte = 0;
+    SHARED_FRAMES++;
+}
+
+// Drop the merged page at physical_addr, which is no longer mapped anywhere.
+static void
+ksm_release(phys_addr_t physical_addr) {
+    // The page is read-only, so its checksum hasn't changed.
+    paging_copy_from_physical_page(physical_addr, PAGE_BUFFER);
+
+    ksm_node_t **link = &BUCKETS[ksm_checksum(PAGE_BUFFER) % KSM_BUCKET_COUNT];
+
+    while (*link && ((*link)->physical_addr != physical_addr || (*link)->pte)) {
+        link = &(*link)->next;
+    }
+
+    ASSERT(*link, "merged page %#llx not found", (uint64_t)physical_addr);
+
+    ksm_node_t *node = *link;
+
+    *link = node->next;
+    kmem_cache_free(NODE_CACHE, node);
+    SHARED_FRAMES--;
+    pmm_page_put(physical_addr);
+}
+
+// Forget the candidates recorded during the last full scan.
+static void
+ksm_forget_candidates() {
+    for (size_t i = 0; i < KSM_BUCKET_COUNT; ++i) {
+        ksm_node_t **link = &BUCKETS[i];
+
+        while (*link) {
+            ksm_node_t *node = *link;
+
+            if (node->pte) {
+                *link = node->next;
+                kmem_cache_free(NODE_CACHE, node);
+            } else {
+                link = &node->next;
+            }
+        }
+    }
+}
+
+static void
+ksm_scan_frame(phys_addr_t physical_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (page && (page->flags & PMM_PAGE_MERGED)) {
+        // Only the table still holds a reference to the page.
+        if (!page->shares) {
+            ksm_release(physical_addr);
+        }
+
+        return;
+    }
+
+    if (!ksm_is_candidate(page)) {
+        return;
+    }
+
+    uint32_t pte = page->rmap;
+
+    paging_copy_from_physical_page(physical_addr, PAGE_BUFFER);
+
+    // There already is a page that is all zeroes.
+    if (ksm_is_zero(PAGE_BUFFER)) {
+        ksm_merge(physical_addr, pte, pmm_zero_page());
+        return;
+    }
+
+    uint32_t checksum = ksm_checksum(PAGE_BUFFER);
+    ksm_node_t **bucket = &BUCKETS[checksum % KSM_BUCKET_COUNT];
+
+    for (ksm_node_t *node = *bucket; node; node = node->next) {
+        if (node->checksum != checksum || node->physical_addr == physical_addr) {
+            continue;
+        }
+
+        if (node->pte) {
+            // The candidate might have been written to, unmapped or even
+            // freed since it was recorded.
+            pmm_page_t *other = pmm_page(node->physical_addr);
+
+            if (!ksm_is_candidate(other) || other->rmap != node->pte
+                    || !ksm_same_data(node->physical_addr)) {
+                continue;
+            }
+
+            ksm_promote(node);
+        } else if (pmm_page_refcount(node->physical_addr) >= UINT16_MAX
+                   || !ksm_same_data(node->physical_addr)) {
+            continue;
+        }
+
+        ksm_merge(physical_addr, pte, node->physical_addr);
+        return;
+    }
+
+    // NOTE: this might reclaim the page, in which case the node is ignored
+    // (like any other stale candidate).
+    ksm_node_t *node = kmem_cache_alloc(NODE_CACHE);
+
+    *node = (ksm_node_t) {
+        .checksum = checksum,
+        .physical_addr = physical_addr,
+        .pte = pte,
+        .next = *bucket,
+    };
+    *bucket = node;
+}
+
+void
+ksm_init() {
+    // There is a node per merge candidate, so don't pad them to a cache line.
+    NODE_CACHE = kmem_cache_create("ksm_node", sizeof(ksm_node_t), sizeof(void *), NULL);
+}
+
+void
+ksm_scan(uint32_t count) {
+    uint32_t frame_count = pmm_frame_count();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        bool enabled = ksm_lock();
+
+        ksm_scan_frame((phys_addr_t)CLOCK_HAND * PAGE_SIZE);
+        SCANNED_PAGES++;
+
+        if (++CLOCK_HAND == frame_count) {
+            CLOCK_HAND = 0;
+            FULL_SCANS++;
+            ksm_forget_candidates();
+        }
+
+        ksm_unlock(enabled);
+    }
+}
+
+void
+ksm_task() {
+    for (;;) {
+        ksm_scan(KSM_PAGES_PER_SCAN);
+        // Give the other tasks a chance to run.
+        asm volatile("hlt");
+    }
+}
+
+void
+ksm_unmerge(phys_addr_t physical_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (page && (page->flags & PMM_PAGE_MERGED)) {
+        UNMERGES++;
+    }
+}
+
+void
+ksm_memstat(memstat_t *stat) {
+    bool enabled = ksm_lock();
+    uint32_t sharing_pages = 0;
+
+    for (size_t i = 0; i < KSM_BUCKET_COUNT; ++i) {
+        for (ksm_node_t *node = BUCKETS[i]; node; node = node->next) {
+            if (!node->pte) {
+                // Not counting the reference held by the table.
+                sharing_pages += pmm_page_refcount(node->physical_addr) - 1;
+            }
+        }
+    }
+
+    ksm_unlock(enabled);
+
+    stat->ksm_shared_frames = SHARED_FRAMES;
+    stat->ksm_sharing_pages = sharing_pages;
+    stat->ksm_merges = MERGES;
+    stat->ksm_unmerges = UNMERGES;
+    stat->ksm_scanned_pages = SCANNED_PAGES;
+    stat->ksm_full_scans = FULL_SCANS;
+    stat->ksm_pages_per_scan = KSM_PAGES_PER_SCAN;
+}
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include <panic.h>
+#include <multiboot2.h>
+
+#include <mm/memblock.h>
+#include <mm/meminfo.h>
+#include <mm/paging.h>
+
+#ifdef CONFIG_PAE
+// PAE can map 36-bit physical addresses (at least).
+#define MEMBLOCK_ADDR_LIMIT ((uint64_t)1 << 36)
+#else
+// Only the 32-bit physical address space is usable.
+#define MEMBLOCK_ADDR_LIMIT ((uint64_t)1 << 32)
+#endif
+// The memory handed out by memblock_alloc is accessed by the kernel through
+// 32-bit physical addresses, so it must be below 4 GB.
+#define MEMBLOCK_ALLOC_LIMIT ((uint64_t)1 << 32)
+
+extern kernel_meminfo_t KERNEL_MEMINFO;
+
+static memblock_type_t MEMBLOCK_MEMORY;
+static memblock_type_t MEMBLOCK_RESERVED;
+
+static void
+memblock_add_region(memblock_type_t *type, uint64_t base, uint64_t size) {
+    ASSERT(type->count < MEMBLOCK_MAX_REGIONS, "too many memblock regions");
+
+    type->regions[type->count++] = (memblock_region_t) {
+        .base = base,
+        .size = size,
+    };
+}
+
+static void
+memblock_add_memory(uint64_t base, uint64_t size) {
+    uint64_t end = base + size;
+
+    if (base >= MEMBLOCK_ADDR_LIMIT) {
+        return;
+    }
+
+    if (end > MEMBLOCK_ADDR_LIMIT) {
+        end = MEMBLOCK_ADDR_LIMIT;
+    }
+
+    // Only whole pages are usable.
+    base = (base + PAGE_SIZE - 1) & ~((uint64_t)PAGE_SIZE - 1);
+    end &= ~((uint64_t)PAGE_SIZE - 1);
+
+    if (base < end) {
+        memblock_add_region(&MEMBLOCK_MEMORY, base, end - base);
+    }
+}
+
+void
+memblock_init(multiboot_info_t multiboot_info) {
+    MEMBLOCK_MEMORY.count = 0;
+    MEMBLOCK_RESERVED.count = 0;
+
+    struct multiboot_tag *tag = (struct multiboot_tag *)(multiboot_info.addr + 8);
+    while (tag->type != MULTIBOOT_TAG_TYPE_END && tag->type != MULTIBOOT_TAG_TYPE_MMAP) {
+        tag = (struct multiboot_tag *)((multiboot_uint8_t *)tag + ((tag->size + 7) & ~7));
+    }
+
+    ASSERT(tag-> type != MULTIBOOT_TAG_TYPE_END, "failed to read memory map");
+
+    multiboot_memory_map_t *mmap = ((struct multiboot_tag_mmap *)tag)->entries;
+    while ((multiboot_uint8_t *) mmap < (multiboot_uint8_t *)tag + tag->size) {
+        if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
+            memblock_add_memory(mmap->addr, mmap->len);
+        }
+        mmap = (multiboot_memory_map_t *)((unsigned long) mmap + ((struct multiboot_tag_mmap *)
+                                          tag)->entry_size);
+    }
+
+    // Physical address 0 is used by the VMM to mean "no physical address", so
+    // the first frame must never be handed out.
+    memblock_reserve(0, PAGE_SIZE);
+    // The kernel image
+    memblock_reserve(KERNEL_MEMINFO.physical_start,
+                     KERNEL_MEMINFO.physical_end - KERNEL_MEMINFO.physical_start);
+    // The multiboot information structure (the first field of the structure
+    // is its total size).
+    uint32_t multiboot_info_size = *(uint32_t *)multiboot_info.addr;
+    memblock_reserve(multiboot_info.addr - KERNEL_MEMINFO.higher_half_base, multiboot_info_size);
+
+    // The boot modules
+    tag = (struct multiboot_tag *)(multiboot_info.addr + 8);
+    struct multiboot_tag_module *module;
+    while ((module = multiboot_get_next_module(&tag))) {
+        memblock_reserve(module->mod_start, module->mod_end - module->mod_start);
+    }
+
+    // The framebuffer
+    struct multiboot_tag_framebuffer_common *framebuffer_info = multiboot_framebuffer_info(
+                multiboot_info.addr);
+    uint32_t framebuffer_size = framebuffer_info->framebuffer_width *
+                                framebuffer_info->framebuffer_height * 2;
+    memblock_reserve(framebuffer_info->framebuffer_addr, framebuffer_size);
+}
+
+void
+memblock_reserve(uint64_t base, uint64_t size) {
+    if (size) {
+        memblock_add_region(&MEMBLOCK_RESERVED, base, size);
+    }
+}
+
+// Return the end of the reserved region that overlaps [base, base + size), or 0
+// if the range doesn't overlap any reserved regions.
+static uint64_t
+memblock_overlaps_reserved(uint64_t base, uint64_t size) {
+    for (uint32_t i = 0; i < MEMBLOCK_RESERVED.count; ++i) {
+        memblock_region_t *reserved = &MEMBLOCK_RESERVED.regions[i];
+
+        if (base < reserved->base + reserved->size && reserved->base < base + size) {
+            return reserved->base + reserved->size;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t
+memblock_find_in_range(uint64_t size, uint64_t align, uint64_t min_addr) {
+    for (uint32_t i = 0; i < MEMBLOCK_MEMORY.count; ++i) {
+        memblock_region_t *region = &MEMBLOCK_MEMORY.regions[i];
+        uint64_t region_end = region->base + region->size;
+        uint64_t base = region->base > min_addr ? region->base : min_addr;
+
+        if (region_end > MEMBLOCK_ALLOC_LIMIT) {
+            region_end = MEMBLOCK_ALLOC_LIMIT;
+        }
+
+        base = (base + align - 1) & ~(align - 1);
+        while (base + size <= region_end) {
+            uint64_t reserved_end = memblock_overlaps_reserved(base, size);
+
+            if (!reserved_end) {
+                return base;
+            }
+
+            // Try again right after the reserved region.
+            base = (reserved_end + align - 1) & ~(align - 1);
+        }
+    }
+
+    return 0;
+}
+
+uint64_t
+memblock_alloc(uint64_t size, uint64_t align, uint64_t min_addr) {
+    uint64_t base = memblock_find_in_range(size, align, min_addr);
+
+    // Fall back to any suitable range if there is no free memory above
+    // min_addr.
+    if (!base && min_addr) {
+        base = memblock_find_in_range(size, align, 0);
+    }
+
+    ASSERT(base, "memblock: failed to allocate %u bytes", (uint32_t)size);
+
+    memblock_reserve(base, size);
+
+    return base;
+}
+
+uint64_t
+memblock_end_of_ram(void) {
+    uint64_t end = 0;
+
+    for (uint32_t i = 0; i < MEMBLOCK_MEMORY.count; ++i) {
+        uint64_t region_end = MEMBLOCK_MEMORY.regions[i].base + MEMBLOCK_MEMORY.regions[i].size;
+
+        if (region_end > end) {
+            end = region_end;
+        }
+    }
+
+    return end;
+}
+
+memblock_type_t *
+memblock_memory(void) {
+    return &MEMBLOCK_MEMORY;
+}
+
+memblock_type_t *
+memblock_reserved(void) {
+    return &MEMBLOCK_RESERVED;
+}
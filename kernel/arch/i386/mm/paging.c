@@ -3,113 +3,1062 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <flags.h>
 #include <panic.h>
 #include <kmalloc.h>
+#include <slab.h>
 
 #include <mm/paging.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
+#include <mm/swap.h>
+#include <mm/ksm.h>
 
 extern kernel_meminfo_t KERNEL_MEMINFO;
 
-page_table_t INIT_KERNEL_PAGE_TABLES[PAGE_TABLE_SIZE];
-page_table_t INIT_ACTIVE_PAGE_DIRECTORY;
+page_directory_t INIT_ACTIVE_PAGE_DIRECTORY;
 paging_context_t ACTIVE_PAGING_CTX;
 
-static paging_context_t
-paging_create_page_directory(page_table_t *page_directory, page_table_t *page_tables) {
-    ASSERT(page_directory, "page_directory should not be NULL");
-    ASSERT(page_tables, "page_tables should not be NULL");
+#ifdef CONFIG_PAE
+// The page directory pointer table of the kernel context.
+static paging_pdpt_t INIT_PDPT;
+// The cache the page directory pointer tables of the other contexts are
+// allocated from (created along with the first of them).
+static kmem_cache_t *PDPT_CACHE;
+#endif
 
-    paging_context_t paging_ctx = (paging_context_t) {
-        .page_directory = page_directory,
-        .page_tables = page_tables,
-    };
+// The page table that maps the scratch pages. It is part of the kernel image,
+// so the scratch pages can be used before any page tables are allocated.
+static page_table_t SCRATCH_PAGE_TABLE;
+// Set once the CPU is using a page directory built by init_paging (which
+// means the recursive mapping can be used).
+static bool PAGING_READY;
+// A page being copied from one physical page to another.
+static uint8_t COPY_BUFFER[PAGE_SIZE];
 
-    memset(page_directory->entries, 0, sizeof(page_directory->entries));
-    for (size_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
-        memset(page_tables[i].entries, 0, sizeof(page_tables[i].entries));
+// The 4 MB user pages mapped, and the number of times 4 MB pages were split
+// into 4 KB pages or assembled from them.
+static uint32_t LARGE_PAGES;
+static uint32_t LARGE_PAGE_SPLITS;
+static uint32_t LARGE_PAGE_COLLAPSES;
+
+// The TLB entries that need to be invalidated after changing some mappings.
+typedef struct paging_flush {
+    uint32_t addrs[PAGING_INVLPG_MAX];
+    // The number of pages to invalidate (which may exceed PAGING_INVLPG_MAX,
+    // in which case the whole TLB is flushed).
+    uint32_t count;
+    // Whether any of the pages were global.
+    bool global;
+} paging_flush_t;
+
+// Flush the TLB entries of all the non-global pages.
+static void
+paging_flush_tlb() {
+    asm volatile("mov %%cr3, %%eax\n\t"
+                 "mov %%eax, %%cr3" ::: "eax", "memory");
+}
+
+// Record that the page table entry of virtual_addr used to be old_entry.
+static void
+paging_flush_add(paging_flush_t *flush, uint32_t virtual_addr, page_entry_t old_entry) {
+    // Non-present entries aren't cached by the TLB.
+    if (!(old_entry & PAGE_FLAG_PRESENT)) {
+        return;
     }
 
-    uint32_t higher_half_base = KERNEL_MEMINFO.higher_half_base;
-    uint32_t virtual_end = KERNEL_MEMINFO.virtual_end;
-    for (uint64_t i = 0; higher_half_base + i * PAGE_SIZE < virtual_end; ++i) {
-        uint32_t virtual_addr = higher_half_base + i * PAGE_SIZE;
-        uint32_t physical_addr = i * PAGE_SIZE;
-
-        paging_map_virtual_to_physical(paging_ctx, virtual_addr, physical_addr,
-                                       PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
-    }
-
-    // Map the heap pages to ensure we don't page fault during vmm_init
-    // (vmm_init uses kmalloc, and vmm_init should _not_ page fault).
-    for (uint64_t i = 0; i * PAGE_SIZE < KERNEL_HEAP_SIZE; ++i) {
-        uint32_t virtual_addr = KERNEL_HEAP_VIRT_START + i * PAGE_SIZE;
-        uint32_t physical_addr = KERNEL_HEAP_PHYS_START + i * PAGE_SIZE;
-        paging_map_virtual_to_physical(paging_ctx, virtual_addr, physical_addr,
-                                       PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
-    }
-
-    uint32_t cr3 = vmm_virtual_to_physical((uint32_t)&page_directory);
-    // The last 4MB of virtual address space is reserved for bookkeeping: we map
-    // the last page directory entry to the page directory itself (rather than
-    // some other physical address), which makes it easy to access and modify
-    // all the paging structures can (this is achieved by writing to a virtual
-    // address which has all the 'directory' bits set to 1). This solves the
-    // "chicken or the egg" problem that happens whenever the VMM creates a new
-    // page to handle a mapping request, but the new page frame returned by the
-    // PMM does not yet have a virtual mapping (so it can't be written to).
-    page_directory->entries[PAGE_TABLE_SIZE - 1] = cr3 | PAGE_FLAG_PRESENT |
-            PAGE_FLAG_WRITE;
+    if (flush->count < PAGING_INVLPG_MAX) {
+        flush->addrs[flush->count] = virtual_addr;
+    }
 
-    return paging_ctx;
+    flush->count++;
+    flush->global |= old_entry & PAGE_FLAG_GLOBAL;
+}
+
+static void
+paging_flush_finish(paging_flush_t *flush) {
+    if (flush->count <= PAGING_INVLPG_MAX) {
+        for (uint32_t i = 0; i < flush->count; ++i) {
+            paging_invlpg(flush->addrs[i]);
+        }
+    } else if (flush->global) {
+        // Reloading CR3 doesn't flush the global entries, but toggling
+        // CR4.PGE flushes everything.
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4\n\t"
+                     "mov %1, %%cr4" :: "r"(cr4 & ~CR4_PGE), "r"(cr4) : "memory");
+    } else {
+        paging_flush_tlb();
+    }
+}
+
+// Disable interrupts, returning whether they were enabled.
+//
+// NOTE: this keeps the page table scratch page from being reused (e.g. by the
+// page fault handler of another task) while it is in use.
+static bool
+paging_lock() {
+    bool enabled = interrupts_enabled();
+
+    asm volatile("cli");
+
+    return enabled;
+}
+
+static void
+paging_unlock(bool enabled) {
+    if (enabled) {
+        asm volatile("sti");
+    }
+}
+
+static bool
+paging_is_active(paging_context_t paging_ctx) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+
+    return cr3 == paging_ctx.cr3;
+}
+
+// Return the page directory the CPU is currently using, through the higher
+// half mapping.
+//
+// NOTE: this is only meant to be used before init_paging (the bootstrap page
+// directory is part of the kernel image, so it is mapped in the higher half).
+static page_directory_t *
+paging_boot_page_directory() {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+
+#ifdef CONFIG_PAE
+    // CR3 points to the page directory pointer table, whose first entry
+    // points to the first page of the page directory.
+    paging_pdpt_t *pdpt = (paging_pdpt_t *)vmm_physical_to_virtual(cr3);
+
+    cr3 = PAGING_ENTRY_ADDR(pdpt->entries[0]);
+#endif
+
+    return (page_directory_t *)vmm_physical_to_virtual(cr3 & ~(PAGE_SIZE - 1));
+}
+
+// Point the last PAGING_DIRECTORY_PAGES entries of the page directory at the
+// page directory itself (see init_paging), and return the value of CR3 that
+// loads it.
+static uint32_t
+paging_init_directory(page_directory_t *page_directory, uint32_t physical_addr) {
+    for (uint32_t i = 0; i < PAGING_DIRECTORY_PAGES; ++i) {
+        page_directory->entries[PAGING_RECURSIVE_PDE + i] = (physical_addr + i * PAGE_SIZE)
+                | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+    }
+
+#ifdef CONFIG_PAE
+    paging_pdpt_t *pdpt = &INIT_PDPT;
+
+    if (PAGING_READY) {
+        if (!PDPT_CACHE) {
+            PDPT_CACHE = kmem_cache_create("paging_pdpt", sizeof(paging_pdpt_t),
+                                           sizeof(paging_pdpt_t), NULL);
+        }
+
+        pdpt = kmem_cache_alloc(PDPT_CACHE);
+    }
+
+    // The other flags of the page directory pointer table entries are
+    // reserved.
+    for (uint32_t i = 0; i < PAGING_DIRECTORY_PAGES; ++i) {
+        pdpt->entries[i] = (physical_addr + i * PAGE_SIZE) | PAGE_FLAG_PRESENT;
+    }
+
+    // The heap is below 4 GB, so the table is too.
+    return PAGING_READY ? paging_physical_addr(ACTIVE_PAGING_CTX, (uint32_t)pdpt)
+           : vmm_virtual_to_physical((uint32_t)pdpt);
+#else
+    return physical_addr;
+#endif
+}
+
+// Map the page table at the specified physical address at
+// PAGING_TABLE_SCRATCH_VIRT_ADDR (until the next call), and return a pointer
+// to it.
+static page_table_t *
+paging_map_table_scratch(uint32_t table_addr) {
+    page_entry_t entry = table_addr | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+    page_entry_t *scratch =
+        &SCRATCH_PAGE_TABLE.entries[PAGE_TABLE_INDEX(PAGING_TABLE_SCRATCH_VIRT_ADDR)];
+
+    if (*scratch != entry) {
+        *scratch = entry;
+        paging_invlpg(PAGING_TABLE_SCRATCH_VIRT_ADDR);
+    }
+
+    return (page_table_t *)PAGING_TABLE_SCRATCH_VIRT_ADDR;
+}
+
+// Return a pointer the (present) page table at the specified page directory
+// index of the context can be accessed through.
+//
+// The page tables of the active context are accessed through the recursive
+// mapping. The page tables of any other context are temporarily mapped at
+// PAGING_TABLE_SCRATCH_VIRT_ADDR (which is only valid until the next call).
+static page_table_t *
+paging_table_window(paging_context_t paging_ctx, uint32_t pde_index) {
+    if (PAGING_READY && paging_is_active(paging_ctx)) {
+        return (page_table_t *)PAGING_RECURSIVE_PAGE_TABLES + pde_index;
+    }
+
+    page_entry_t pde = paging_ctx.page_directory->entries[pde_index];
+
+    return paging_map_table_scratch(PAGING_ENTRY_ADDR(pde));
+}
+
+// Map the specified physical page at PAGING_SCRATCH_VIRT_ADDR (until the next
+// call), and return a pointer to it.
+static void *
+paging_map_scratch(phys_addr_t physical_addr) {
+    // The scratch page table is shared by all contexts, so updating the
+    // mapping here updates it everywhere.
+    SCRATCH_PAGE_TABLE.entries[PAGE_TABLE_INDEX(PAGING_SCRATCH_VIRT_ADDR)] =
+        physical_addr | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL;
+    paging_invlpg(PAGING_SCRATCH_VIRT_ADDR);
+
+    return (void *)PAGING_SCRATCH_VIRT_ADDR;
+}
+
+// Return the physical address of the (present) user page table that maps
+// virtual_addr.
+//
+// NOTE: the page tables are always allocated below 4 GB (see PMM_RMAP_PTE).
+static uint32_t
+paging_user_table_addr(paging_context_t paging_ctx, uint32_t virtual_addr) {
+    page_entry_t pde = paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr)];
+
+    return PAGING_ENTRY_ADDR(pde);
+}
+
+// Keep the reverse mappings (see pmm_rmap_add) up to date after the entry at
+// `index` of the user page table at table_addr changed from old_entry to
+// new_entry.
+//
+// NOTE: this might allocate memory, which might reuse the scratch pages, so the
+// page table must be looked up again afterwards (see paging_table_window).
+static void
+paging_update_rmap(uint32_t table_addr, uint32_t index, page_entry_t old_entry,
+                   page_entry_t new_entry) {
+    uint32_t pte = PMM_RMAP_PTE(table_addr, index);
+
+    if ((old_entry & PAGE_FLAG_PRESENT) && (new_entry & PAGE_FLAG_PRESENT)
+            && PAGING_ENTRY_ADDR(old_entry) == PAGING_ENTRY_ADDR(new_entry)) {
+        return;
+    }
+
+    if (old_entry & PAGE_FLAG_PRESENT) {
+        pmm_rmap_remove(old_entry, pte);
+    }
+
+    if (new_entry & PAGE_FLAG_PRESENT) {
+        pmm_rmap_add(new_entry, pte);
+    }
+}
+
+// Make sure the (present) user page table at the specified page directory
+// index isn't shared with other contexts, and make its page directory entry
+// writable again.
+//
+// paging_fork_context shares the user page tables between the two contexts,
+// and write-protects their page directory entries. The first change to such a
+// page table (or write to one of its pages) replaces it with a private copy,
+// which takes a reference to each of the pages it maps. Any entry that maps a
+// page that is still mapped by another context is then write-protected, so
+// the first write to the page copies it (see paging_copy_on_write).
+static void
+paging_unshare_table(paging_context_t paging_ctx, uint32_t pde_index) {
+    page_entry_t *pde = &paging_ctx.page_directory->entries[pde_index];
+
+    if (*pde & PAGE_FLAG_WRITE) {
+        return;
+    }
+
+    uint32_t table_addr = PAGING_ENTRY_ADDR(*pde);
+    bool shared = pmm_page_refcount(table_addr) > 1;
+    // NOTE: the page is allocated before the page table is mapped, as the
+    // allocation might need the page table scratch page.
+    uint32_t copy_addr = shared ? (uint32_t)pmm_alloc_page() : table_addr;
+    page_table_t *page_table = paging_table_window(paging_ctx, pde_index);
+    page_table_t *copy = shared ? paging_map_scratch(copy_addr) : page_table;
+
+    if (shared) {
+        // The other contexts still use the old page table.
+        pmm_page_put(table_addr);
+    }
+
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        page_entry_t entry = page_table->entries[i];
+
+        if (entry & PAGE_FLAG_PRESENT) {
+            if (shared) {
+                pmm_page_get(entry);
+            }
+
+            if (pmm_page_refcount(entry) > 1) {
+                entry &= ~PAGE_FLAG_WRITE;
+            }
+        } else if (shared && PAGING_IS_SWAP_ENTRY(entry)) {
+            swap_dup(PAGING_SWAP_SLOT(entry));
+        }
+
+        copy->entries[i] = entry;
+    }
+
+    *pde = copy_addr | (*pde & (PAGE_SIZE - 1)) | PAGE_FLAG_WRITE;
+
+    // The TLB might still have the translations of the old page table (and,
+    // if the context is active, of its recursive mapping).
+    if (paging_is_active(paging_ctx)) {
+        paging_flush_tlb();
+    }
+
+    if (shared) {
+        // The pages are now mapped by the entries of the copy too.
+        pmm_page_set_table(copy_addr, pde_index << PAGE_DIRECTORY_START);
+
+        for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+            page_entry_t entry = paging_table_window(paging_ctx, pde_index)->entries[i];
+
+            paging_update_rmap(copy_addr, i, 0, entry);
+        }
+    }
+}
+
+// Replace the 4 MB user page at the specified page directory index with a page
+// table that maps each of its 4 KB pages, which become separate pages (that
+// can be shared, reclaimed and freed on their own).
+//
+// NOTE: this might allocate memory, which might reuse the scratch pages.
+static void
+paging_split_large_page(paging_context_t paging_ctx, uint32_t pde_index) {
+    page_entry_t *pde = &paging_ctx.page_directory->entries[pde_index];
+    uint32_t block = *pde & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t flags = *pde & (PAGE_SIZE - 1) & ~PAGE_FLAG_PAGE_SIZE;
+    uint32_t table_addr = (uint32_t)pmm_alloc_page();
+    page_table_t *page_table = paging_map_scratch(table_addr);
+
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        page_table->entries[i] = (block + i * PAGE_SIZE) | flags;
+        // Each page now holds its own reference.
+        pmm_page(block + i * PAGE_SIZE)->flags = PMM_PAGE_RECLAIMABLE;
+    }
+
+    *pde = table_addr | (flags & (PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER));
+    pmm_page_set_table(table_addr, pde_index << PAGE_DIRECTORY_START);
+
+    // NOTE: this doesn't allocate anything, as each page has a single mapping.
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        paging_update_rmap(table_addr, i, 0, (block + i * PAGE_SIZE) | PAGE_FLAG_PRESENT);
+    }
+
+    // The TLB might still have the translation of the 4 MB page (and, if the
+    // context is active, the recursive mapping of the page directory entry).
+    if (paging_is_active(paging_ctx)) {
+        paging_flush_tlb();
+    }
+
+    LARGE_PAGES--;
+    LARGE_PAGE_SPLITS++;
+}
+
+// Return the page table that maps virtual_addr, making sure the page directory
+// entry that points to it is present and allows the accesses allowed by
+// `flags`.
+//
+// The page tables are allocated on demand. The page tables of the kernel's
+// part of the address space are shared by all contexts: they are created in
+// the kernel's page directory, and only copied to the other page directories
+// when they are needed there (see paging_sync_kernel_pdes).
+//
+// NOTE: the flags of a present page directory entry are only ever extended,
+// as the other pages of the page table might need them. The kernel's entries
+// are always writable, so their copies never go stale. A user page table
+// shared with another context is copied first (see paging_unshare_table).
+static page_table_t *
+paging_page_table(paging_context_t paging_ctx, uint32_t virtual_addr, uint32_t flags) {
+    uint32_t pde_index = PAGE_DIRECTORY_INDEX(virtual_addr);
+    page_entry_t *pde = &paging_ctx.page_directory->entries[pde_index];
+
+    if (virtual_addr >= KERNEL_MEMINFO.higher_half_base) {
+        page_entry_t *kernel_pde = &ACTIVE_PAGING_CTX.page_directory->entries[pde_index];
+
+        ASSERT(!(*kernel_pde & PAGE_FLAG_PAGE_SIZE), "%#x is mapped by a 4 MB page",
+               virtual_addr);
+
+        if (!(*kernel_pde & PAGE_FLAG_PRESENT)) {
+            *kernel_pde = (uint32_t)pmm_alloc_zeroed_page() | PAGE_FLAG_PRESENT
+                          | PAGE_FLAG_WRITE;
+        }
+
+        // The page table is accessed through this context's page directory.
+        *pde = *kernel_pde;
+    } else {
+        if (*pde & PAGE_FLAG_PAGE_SIZE) {
+            paging_split_large_page(paging_ctx, pde_index);
+        }
+
+        if (!(*pde & PAGE_FLAG_PRESENT)) {
+            // The page table is 4096 bytes aligned, so no need to clear the
+            // lower 12 bits where the flags go
+            *pde = (uint32_t)pmm_alloc_zeroed_page() | PAGE_FLAG_PRESENT;
+            pmm_page_set_table(*pde, pde_index << PAGE_DIRECTORY_START);
+        } else {
+            // The page table might be shared with a forked context.
+            paging_unshare_table(paging_ctx, pde_index);
+        }
+
+        *pde |= flags & (PAGE_FLAG_WRITE | PAGE_FLAG_USER);
+    }
+
+    return paging_table_window(paging_ctx, pde_index);
+}
+
+// Map [physical_addr, physical_addr + size) at virtual_addr.
+//
+// The parts of the range where both addresses are 4 MB aligned are mapped
+// using 4 MB pages, which saves a page table (and a lot of TLB entries) each.
+// The rest of the range is mapped using 4 KB pages.
+static void
+paging_map_large_range(paging_context_t paging_ctx, uint32_t virtual_addr, uint32_t physical_addr,
+                       uint32_t size, uint32_t flags) {
+    uint32_t offset = 0;
+
+    while (offset < size) {
+        uint32_t page_virtual_addr = virtual_addr + offset;
+        uint32_t page_physical_addr = physical_addr + offset;
+
+        if (!(page_virtual_addr & (LARGE_PAGE_SIZE - 1))
+                && !(page_physical_addr & (LARGE_PAGE_SIZE - 1))
+                && size - offset >= LARGE_PAGE_SIZE) {
+            paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(page_virtual_addr)] =
+                page_physical_addr | flags | PAGE_FLAG_PAGE_SIZE;
+            offset += LARGE_PAGE_SIZE;
+        } else {
+            // Map the rest of the 4 MB region (or of the range) using a page
+            // table.
+            uint32_t chunk = LARGE_PAGE_SIZE - (page_virtual_addr & (LARGE_PAGE_SIZE - 1));
+            if (chunk > size - offset) {
+                chunk = size - offset;
+            }
+
+            paging_map_range(paging_ctx, page_virtual_addr, page_physical_addr, chunk / PAGE_SIZE,
+                             flags);
+            offset += chunk;
+        }
+    }
 }
 
 paging_context_t
 init_paging() {
-    paging_context_t paging_ctx = paging_create_page_directory(&INIT_ACTIVE_PAGE_DIRECTORY,
-                                  INIT_KERNEL_PAGE_TABLES);
+    page_directory_t *page_directory = &INIT_ACTIVE_PAGE_DIRECTORY;
+    uint32_t page_directory_physical = vmm_virtual_to_physical((uint32_t)page_directory);
+    page_entry_t scratch_pde = vmm_virtual_to_physical((uint32_t)&SCRATCH_PAGE_TABLE)
+                               | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
 
-    uint32_t cr3 = vmm_virtual_to_physical((uint32_t)paging_ctx.page_directory);
-    paging_set_page_directory(cr3);
+    // The page tables are allocated (and filled in) before the new page
+    // directory is loaded, so the scratch pages must be usable with the
+    // bootstrap page directory too.
+    paging_boot_page_directory()->entries[PAGE_DIRECTORY_INDEX(PAGING_SCRATCH_VIRT_ADDR)] =
+        scratch_pde;
 
+    memset(page_directory->entries, 0, sizeof(page_directory->entries));
+    page_directory->entries[PAGE_DIRECTORY_INDEX(PAGING_SCRATCH_VIRT_ADDR)] = scratch_pde;
+
+    // The last 4MB of virtual address space (8 MB with PAE) is reserved for
+    // bookkeeping: we map the last page directory entry to the page directory
+    // itself (rather than some other physical address), which makes it easy to
+    // access and modify all the paging structures can (this is achieved by
+    // writing to a virtual address which has all the 'directory' bits set to
+    // 1). This solves the "chicken or the egg" problem that happens whenever
+    // the VMM creates a new page to handle a mapping request, but the new page
+    // frame returned by the PMM does not yet have a virtual mapping (so it
+    // can't be written to).
+    paging_context_t paging_ctx = (paging_context_t) {
+        .page_directory = page_directory,
+        .cr3 = paging_init_directory(page_directory, page_directory_physical),
+    };
     ACTIVE_PAGING_CTX = paging_ctx;
 
+    // The kernel image (and everything below it) is mapped using 4 MB pages,
+    // except for its last few pages.
+    uint32_t higher_half_base = KERNEL_MEMINFO.higher_half_base;
+    uint32_t kernel_size = paging_page_count(KERNEL_MEMINFO.virtual_end - higher_half_base)
+                           * PAGE_SIZE;
+    paging_map_large_range(paging_ctx, higher_half_base, 0, kernel_size,
+                           PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL);
+
+    // The PMM metadata is accessed from every context.
+    addr_space_entry_t pmm_metadata = pmm_metadata_addr_space();
+    paging_map_large_range(paging_ctx, pmm_metadata.virtual_start, pmm_metadata.physical_start,
+                           pmm_metadata.page_count * PAGE_SIZE, pmm_metadata.flags);
+
+    paging_set_page_directory(paging_ctx.cr3);
+    PAGING_READY = true;
+
+    // Make the read-only pages read-only for the kernel too, so that its
+    // writes to copy-on-write user pages (e.g. from system calls) fault just
+    // like the user's.
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+    // The kernel mappings are the same in every address space, so there is no
+    // need to flush them from the TLB on every CR3 reload.
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_PGE) : "memory");
+
     return paging_ctx;
 }
 
-// Load CR3 with the **physical** address of the page directory.
+paging_context_t
+paging_clone_kernel_context(page_directory_t *page_directory, uint32_t physical_addr) {
+    page_directory_t *kernel_page_directory = ACTIVE_PAGING_CTX.page_directory;
+    uint32_t first_kernel_pde = PAGE_DIRECTORY_INDEX(KERNEL_MEMINFO.higher_half_base);
+
+    // The user's part of the address space starts out empty, and the page
+    // tables of the kernel's part are shared.
+    memset(page_directory->entries, 0, first_kernel_pde * sizeof(page_entry_t));
+    memcpy(&page_directory->entries[first_kernel_pde],
+           &kernel_page_directory->entries[first_kernel_pde],
+           (PAGING_RECURSIVE_PDE - first_kernel_pde) * sizeof(page_entry_t));
+
+    return (paging_context_t) {
+        .page_directory = page_directory,
+        .cr3 = paging_init_directory(page_directory, physical_addr),
+    };
+}
+
+paging_context_t
+paging_fork_context(paging_context_t paging_ctx, page_directory_t *page_directory,
+                    uint32_t physical_addr) {
+    paging_context_t fork = paging_clone_kernel_context(page_directory, physical_addr);
+    uint32_t first_kernel_pde = PAGE_DIRECTORY_INDEX(KERNEL_MEMINFO.higher_half_base);
+    bool enabled = paging_lock();
+
+    // Share the user page tables (rather than the pages they map), so this
+    // only takes O(1) per page table. Write-protecting the page directory
+    // entries makes every page they map read-only, until the page table is
+    // unshared (see paging_unshare_table).
+    for (uint32_t i = 0; i < first_kernel_pde; ++i) {
+        page_entry_t *pde = &paging_ctx.page_directory->entries[i];
+
+        if (!(*pde & PAGE_FLAG_PRESENT)) {
+            continue;
+        }
+
+        // The 4 MB pages are never shared (see paging_map_large_page): they
+        // are split into 4 KB pages, which are shared like any others.
+        if (*pde & PAGE_FLAG_PAGE_SIZE) {
+            paging_split_large_page(paging_ctx, i);
+        }
+
+        pmm_page_get(*pde);
+        *pde &= ~PAGE_FLAG_WRITE;
+        page_directory->entries[i] = *pde;
+    }
+
+    if (paging_is_active(paging_ctx)) {
+        paging_flush_tlb();
+    }
+
+    paging_unlock(enabled);
+
+    return fork;
+}
+
 void
-paging_set_page_directory(uint32_t addr) {
+paging_copy_on_write(paging_context_t paging_ctx, uint32_t virtual_addr) {
+    ASSERT(paging_is_active(paging_ctx), "copy-on-write in an inactive context");
+
+    bool enabled = paging_lock();
+    uint32_t aligned_addr = paging_align_addr(virtual_addr);
+    page_table_t *page_table = paging_page_table(paging_ctx, aligned_addr, PAGE_FLAG_WRITE);
+    page_entry_t *entry = &page_table->entries[PAGE_TABLE_INDEX(aligned_addr)];
+    phys_addr_t physical_addr = PAGING_ENTRY_ADDR(*entry);
+
+    ASSERT(*entry & PAGE_FLAG_PRESENT, "copy-on-write of non-present page %#x", aligned_addr);
+
+    if (physical_addr == pmm_zero_page()) {
+        // The zero page is shared by every untouched page, so it is never
+        // made writable. There is nothing to copy either.
+        physical_addr = pmm_alloc_zeroed_user_page();
+        pmm_page(physical_addr)->flags |= PMM_PAGE_RECLAIMABLE;
+    } else if (pmm_page_refcount(physical_addr) > 1) {
+        phys_addr_t copy_addr = pmm_alloc_user_page();
+
+        // The context is active, so the page can be copied from its own
+        // (read-only) mapping.
+        memcpy(paging_map_scratch(copy_addr), (void *)aligned_addr, PAGE_SIZE);
+        ksm_unmerge(physical_addr);
+        pmm_page_put(physical_addr);
+        pmm_page(copy_addr)->flags |= PMM_PAGE_RECLAIMABLE;
+        physical_addr = copy_addr;
+    }
+
+    // Otherwise, this is the last reference to the page, so it can simply be
+    // made writable again.
+
+    // The allocation might have reclaimed some pages, which reuses the page
+    // table scratch page.
+    page_table = paging_table_window(paging_ctx, PAGE_DIRECTORY_INDEX(aligned_addr));
+    entry = &page_table->entries[PAGE_TABLE_INDEX(aligned_addr)];
+
+    page_entry_t old_entry = *entry;
+
+    *entry = physical_addr | (*entry & (PAGE_SIZE - 1)) | PAGE_FLAG_WRITE;
+    paging_invlpg(aligned_addr);
+    paging_update_rmap(paging_user_table_addr(paging_ctx, aligned_addr),
+                       PAGE_TABLE_INDEX(aligned_addr), old_entry, *entry);
+    paging_unlock(enabled);
+}
+
+void
+paging_map_large_page(paging_context_t paging_ctx, uint32_t virtual_addr, uint32_t physical_addr,
+                      uint32_t flags) {
+    ASSERT(!(virtual_addr & (LARGE_PAGE_SIZE - 1)) && !(physical_addr & (LARGE_PAGE_SIZE - 1))
+           && virtual_addr < KERNEL_MEMINFO.higher_half_base,
+           "cannot map 4 MB user page: %#x -> %#x", virtual_addr, physical_addr);
+
+    bool enabled = paging_lock();
+    page_entry_t *pde = &paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr)];
+
+    ASSERT(!(*pde & PAGE_FLAG_PRESENT), "%#x is already mapped", virtual_addr);
+
+    *pde = physical_addr | flags | PAGE_FLAG_PAGE_SIZE;
+    LARGE_PAGES++;
+    paging_unlock(enabled);
+}
+
+// Check whether all the entries of the page table map private pages (which
+// aren't shared, merged or backed by a file) with the same access flags.
+static bool
+paging_is_collapsible(page_table_t *page_table) {
+    uint32_t access = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER;
+
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        page_entry_t entry = page_table->entries[i];
+        pmm_page_t *page = pmm_page(entry);
+
+        if ((entry & access) != access || !page || page->flags != PMM_PAGE_RECLAIMABLE
+                || page->shares) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Set or clear PMM_PAGE_RECLAIMABLE on the frames mapped by the page table, so
+// they can't be reclaimed or merged (which would change their entries) while
+// they are being copied.
+static void
+paging_pin_table(uint32_t table_addr, bool pin) {
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        pmm_page_t *page = pmm_page(paging_map_table_scratch(table_addr)->entries[i]);
+
+        if (pin) {
+            page->flags &= ~PMM_PAGE_RECLAIMABLE;
+        } else {
+            page->flags |= PMM_PAGE_RECLAIMABLE;
+        }
+    }
+}
+
+bool
+paging_collapse_large_page(paging_context_t paging_ctx, uint32_t virtual_addr) {
+    uint32_t pde_index = PAGE_DIRECTORY_INDEX(virtual_addr);
+    page_entry_t *pde = &paging_ctx.page_directory->entries[pde_index];
+
+    ASSERT(virtual_addr < KERNEL_MEMINFO.higher_half_base, "cannot collapse kernel page %#x",
+           virtual_addr);
+
+    // A write-protected page table is shared with another context (see
+    // paging_fork_context).
+    if ((*pde & (PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_PAGE_SIZE))
+            != (PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE)) {
+        return false;
+    }
+
+    bool enabled = paging_lock();
+
+    if (!paging_is_collapsible(paging_table_window(paging_ctx, pde_index))) {
+        paging_unlock(enabled);
+        return false;
+    }
+
+    // Collapsing is only worth it if there is a free 4 MB block already.
+    uint32_t block = (uint32_t)pmm_try_alloc_pages(LARGE_PAGE_ORDER);
+
+    if (!block) {
+        paging_unlock(enabled);
+        return false;
+    }
+
+    page_entry_t old_pde = *pde;
+    uint32_t table_addr = PAGING_ENTRY_ADDR(old_pde);
+    uint32_t flags = old_pde & (PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER);
+    // The entries that were dirty before the copy.
+    uint32_t dirty[PAGE_TABLE_SIZE / 32] = { 0 };
+
+    // The pages are copied with interrupts enabled, so the task might write
+    // to them in the meantime: clear the dirty bits to find out whether it
+    // did.
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        page_entry_t *entry = &paging_map_table_scratch(table_addr)->entries[i];
+
+        if (*entry & PAGE_FLAG_DIRTY) {
+            dirty[i / 32] |= 1u << (i % 32);
+            *entry &= ~PAGE_FLAG_DIRTY;
+        }
+    }
+
+    paging_pin_table(table_addr, true);
+
+    if (paging_is_active(paging_ctx)) {
+        paging_flush_tlb();
+    }
+
+    paging_unlock(enabled);
+
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        enabled = paging_lock();
+
+        page_entry_t entry = paging_map_table_scratch(table_addr)->entries[i];
+
+        memcpy(COPY_BUFFER, paging_map_scratch(PAGING_ENTRY_ADDR(entry)), PAGE_SIZE);
+        memcpy(paging_map_scratch(block + i * PAGE_SIZE), COPY_BUFFER, PAGE_SIZE);
+        paging_unlock(enabled);
+    }
+
+    enabled = paging_lock();
+
+    // The copy is stale if the table was shared (see paging_fork_context) or
+    // any of the pages were written to since.
+    bool stale = *pde != old_pde;
+
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        page_entry_t *entry = &paging_map_table_scratch(table_addr)->entries[i];
+
+        stale |= *entry & PAGE_FLAG_DIRTY;
+        flags |= *entry & PAGE_FLAG_ACCESSED;
+
+        // Put the dirty bits back (reclaim relies on them), whether or not
+        // the table is replaced.
+        if (dirty[i / 32] & (1u << (i % 32))) {
+            *entry |= PAGE_FLAG_DIRTY;
+            flags |= PAGE_FLAG_DIRTY;
+        }
+    }
+
+    if (stale) {
+        paging_pin_table(table_addr, false);
+        pmm_free_pages((void *)block, LARGE_PAGE_ORDER);
+        paging_unlock(enabled);
+
+        return false;
+    }
+
+    *pde = block | flags | PAGE_FLAG_PAGE_SIZE;
+
+    if (paging_is_active(paging_ctx)) {
+        paging_flush_tlb();
+    }
+
+    // The 4 KB pages (and their page table) can go now.
+    for (uint32_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+        page_entry_t entry = paging_map_table_scratch(table_addr)->entries[i];
+
+        paging_update_rmap(table_addr, i, entry, 0);
+        pmm_page_put(entry);
+    }
+
+    pmm_free_table(table_addr);
+    LARGE_PAGES++;
+    LARGE_PAGE_COLLAPSES++;
+    paging_unlock(enabled);
+
+    return true;
+}
+
+void
+paging_memstat(memstat_t *stat) {
+    stat->paging_large_pages = LARGE_PAGES;
+    stat->paging_large_page_splits = LARGE_PAGE_SPLITS;
+    stat->paging_large_page_collapses = LARGE_PAGE_COLLAPSES;
+}
+
+void
+paging_set_page_directory(uint32_t cr3) {
     asm volatile("mov %0, %%eax\n\t"
-                 "mov %%eax, %%cr3" ::"r" (addr) : "memory");
+                 "mov %%eax, %%cr3" ::"r" (cr3) : "memory");
 }
 
 void
 paging_map_virtual_to_physical(paging_context_t paging_ctx, uint32_t virtual_addr,
-                               uint32_t physical_addr, uint32_t flags) {
-    page_table_t *page_table = paging_ctx.page_tables + PAGE_DIRECTORY_INDEX(virtual_addr);
-    // page_table_addr is 4096 bytes aligned, so no need to clear the
-    // lower 12 bits where the flags go
-    uint32_t page_table_addr = vmm_virtual_to_physical((uint32_t)page_table);
-    uint32_t page_start_addr = (physical_addr >> 12) << 12;
+                               phys_addr_t physical_addr, uint32_t flags) {
+    bool enabled = paging_lock();
+    page_table_t *page_table = paging_page_table(paging_ctx, virtual_addr, flags);
+    uint32_t index = PAGE_TABLE_INDEX(virtual_addr);
+    page_entry_t old_entry = page_table->entries[index];
+
+    page_table->entries[index] = (physical_addr & ~(PAGE_SIZE - 1)) | flags;
+
+    if (virtual_addr < KERNEL_MEMINFO.higher_half_base) {
+        paging_update_rmap(paging_user_table_addr(paging_ctx, virtual_addr), index, old_entry,
+                           page_table->entries[index]);
+    }
+
+    paging_unlock(enabled);
+}
 
-    paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr)] =
-        page_table_addr | flags;
-    page_table->entries[PAGE_TABLE_INDEX(virtual_addr)] =
-        page_start_addr | flags;
+void
+paging_map_range(paging_context_t paging_ctx, uint32_t virtual_addr, uint32_t physical_addr,
+                 uint32_t page_count, uint32_t flags) {
+    ASSERT(paging_is_aligned(virtual_addr) && paging_is_aligned(physical_addr),
+           "cannot map unaligned range: %#x -> %#x", virtual_addr, physical_addr);
+
+    bool enabled = paging_lock();
+    paging_flush_t flush = { .count = 0, .global = false };
+    uint32_t i = 0;
+
+    while (i < page_count) {
+        // Fill in the page table one entry at a time, until the end of the
+        // range or of the page table.
+        page_table_t *page_table = paging_page_table(paging_ctx, virtual_addr + i * PAGE_SIZE,
+                                   flags);
+
+        uint32_t page_addr = virtual_addr + i * PAGE_SIZE;
+        bool is_user = page_addr < KERNEL_MEMINFO.higher_half_base;
+
+        for (uint32_t entry = PAGE_TABLE_INDEX(page_addr);
+                entry < PAGE_TABLE_SIZE && i < page_count; ++entry, ++i) {
+            page_entry_t old_entry = page_table->entries[entry];
+
+            page_table->entries[entry] = (physical_addr + i * PAGE_SIZE) | flags;
+            paging_flush_add(&flush, virtual_addr + i * PAGE_SIZE, old_entry);
+
+            if (is_user) {
+                paging_update_rmap(paging_user_table_addr(paging_ctx, page_addr), entry, old_entry,
+                                   page_table->entries[entry]);
+                page_table = paging_table_window(paging_ctx, PAGE_DIRECTORY_INDEX(page_addr));
+            }
+        }
+    }
+
+    paging_flush_finish(&flush);
+    paging_unlock(enabled);
+}
+
+void
+paging_unmap_range(paging_context_t paging_ctx, uint32_t virtual_addr, uint32_t page_count) {
+    ASSERT(paging_is_aligned(virtual_addr), "cannot unmap unaligned address: %#x", virtual_addr);
+
+    bool enabled = paging_lock();
+    paging_flush_t flush = { .count = 0, .global = false };
+    uint32_t i = 0;
+
+    while (i < page_count) {
+        uint32_t page_addr = virtual_addr + i * PAGE_SIZE;
+        page_entry_t pde = paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(page_addr)];
+        uint32_t entry = PAGE_TABLE_INDEX(page_addr);
+
+        if (pde & PAGE_FLAG_PAGE_SIZE) {
+            ASSERT(page_addr < KERNEL_MEMINFO.higher_half_base, "%#x is mapped by a 4 MB page",
+                   page_addr);
+
+            if (!entry && page_count - i >= PAGE_TABLE_SIZE) {
+                // The whole 4 MB page is unmapped, along with its block.
+                paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(page_addr)] = 0;
+                paging_flush_add(&flush, page_addr, pde);
+                // The recursive mapping of the entry mapped the first page of
+                // the block too.
+                paging_flush_add(&flush, (uint32_t)((page_table_t *)PAGING_RECURSIVE_PAGE_TABLES
+                                                    + PAGE_DIRECTORY_INDEX(page_addr)), pde);
+                pmm_free_pages((void *)(uint32_t)(pde & ~(LARGE_PAGE_SIZE - 1)), LARGE_PAGE_ORDER);
+                LARGE_PAGES--;
+                i += PAGE_TABLE_SIZE;
+                continue;
+            }
+
+            paging_split_large_page(paging_ctx, PAGE_DIRECTORY_INDEX(page_addr));
+            pde = paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(page_addr)];
+        }
+
+        if (!(pde & PAGE_FLAG_PRESENT)) {
+            // Nothing to unmap in this page table.
+            i += PAGE_TABLE_SIZE - entry;
+            continue;
+        }
+
+        if (page_addr < KERNEL_MEMINFO.higher_half_base) {
+            paging_unshare_table(paging_ctx, PAGE_DIRECTORY_INDEX(page_addr));
+        }
+
+        // NOTE: the page directory entry is left alone: the other pages of
+        // the page table might still be mapped.
+        page_table_t *page_table = paging_table_window(paging_ctx, PAGE_DIRECTORY_INDEX(page_addr));
+        for (; entry < PAGE_TABLE_SIZE && i < page_count; ++entry, ++i) {
+            page_entry_t old_entry = page_table->entries[entry];
+
+            page_table->entries[entry] = 0;
+            paging_flush_add(&flush, virtual_addr + i * PAGE_SIZE, old_entry);
+
+            // Each user mapping holds a reference to its frame (or swap
+            // slot), so the frame is freed along with its last mapping.
+            if (page_addr < KERNEL_MEMINFO.higher_half_base && (old_entry & PAGE_FLAG_PRESENT)) {
+                paging_update_rmap(paging_user_table_addr(paging_ctx, page_addr), entry, old_entry,
+                                   0);
+                pmm_page_put(old_entry);
+                page_table = paging_table_window(paging_ctx, PAGE_DIRECTORY_INDEX(page_addr));
+            } else if (page_addr < KERNEL_MEMINFO.higher_half_base
+                       && PAGING_IS_SWAP_ENTRY(old_entry)) {
+                swap_put(PAGING_SWAP_SLOT(old_entry));
+            }
+        }
+    }
+
+    paging_flush_finish(&flush);
+    paging_unlock(enabled);
+}
+
+void
+paging_early_map(uint32_t virtual_addr, uint32_t physical_addr, uint32_t size) {
+    ASSERT(!(virtual_addr & (LARGE_PAGE_SIZE - 1)) && !(physical_addr & (LARGE_PAGE_SIZE - 1)),
+           "misaligned early mapping: %#x -> %#x", virtual_addr, physical_addr);
+
+    page_directory_t *page_directory = paging_boot_page_directory();
+
+    for (uint32_t offset = 0; offset < size; offset += LARGE_PAGE_SIZE) {
+        page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr + offset)] =
+            (physical_addr + offset) | PAGE_FLAG_PAGE_SIZE | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+        paging_invlpg(virtual_addr + offset);
+    }
+}
+
+bool
+paging_sync_kernel_pdes(uint32_t virtual_start, uint32_t virtual_end) {
+    page_directory_t *page_directory = (page_directory_t *)PAGING_RECURSIVE_PAGE_DIRECTORY;
+    bool synced = false;
+
+    for (uint32_t i = PAGE_DIRECTORY_INDEX(virtual_start);
+            i <= PAGE_DIRECTORY_INDEX(virtual_end - 1); ++i) {
+        page_entry_t kernel_pde = ACTIVE_PAGING_CTX.page_directory->entries[i];
+
+        if (!(page_directory->entries[i] & PAGE_FLAG_PRESENT)
+                && (kernel_pde & PAGE_FLAG_PRESENT)) {
+            page_directory->entries[i] = kernel_pde;
+            synced = true;
+        }
+    }
+
+    return synced;
+}
+
+void
+paging_zero_physical_page(phys_addr_t physical_addr) {
+    bool enabled = paging_lock();
+    uint32_t *page = paging_map_scratch(physical_addr);
+    uint32_t count = PAGE_SIZE / sizeof(uint32_t);
+
+    asm volatile("rep stosl"
+                 : "+D"(page), "+c"(count)
+                 : "a"(0)
+                 : "memory");
+    paging_unlock(enabled);
+}
+
+void
+paging_copy_to_physical_page(phys_addr_t physical_addr, uint32_t offset, const void *src,
+                             uint32_t size) {
+    ASSERT(offset <= PAGE_SIZE && size <= PAGE_SIZE - offset,
+           "cannot copy %u bytes at offset %u of a page", size, offset);
+
+    bool enabled = paging_lock();
+    memcpy((char *)paging_map_scratch(physical_addr) + offset, src, size);
+    paging_unlock(enabled);
+}
+
+void
+paging_copy_from_physical_page(phys_addr_t physical_addr, void *dst) {
+    bool enabled = paging_lock();
+    memcpy(dst, paging_map_scratch(physical_addr), PAGE_SIZE);
+    paging_unlock(enabled);
+}
+
+page_entry_t
+paging_entry(paging_context_t paging_ctx, uint32_t virtual_addr) {
+    page_entry_t pde = paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr)];
+
+    ASSERT(!(pde & PAGE_FLAG_PAGE_SIZE), "%#x is mapped by a 4 MB page", virtual_addr);
+
+    if (!(pde & PAGE_FLAG_PRESENT)) {
+        return 0;
+    }
+
+    bool enabled = paging_lock();
+    page_table_t *page_table = paging_table_window(paging_ctx, PAGE_DIRECTORY_INDEX(virtual_addr));
+    page_entry_t entry = page_table->entries[PAGE_TABLE_INDEX(virtual_addr)];
+    paging_unlock(enabled);
+
+    return entry;
+}
+
+page_entry_t
+paging_rmap_entry(uint32_t pte) {
+    bool enabled = paging_lock();
+    page_entry_t entry =
+        paging_map_table_scratch(PMM_RMAP_TABLE(pte))->entries[PMM_RMAP_INDEX(pte)];
+    paging_unlock(enabled);
+
+    return entry;
+}
+
+void
+paging_rmap_set_entry(uint32_t pte, page_entry_t entry) {
+    bool enabled = paging_lock();
+
+    paging_map_table_scratch(PMM_RMAP_TABLE(pte))->entries[PMM_RMAP_INDEX(pte)] = entry;
+    // The page table might belong to another context, in which case this
+    // invalidates an unrelated translation (which is harmless).
+    paging_invlpg(pmm_rmap_virtual_addr(pte));
+    paging_unlock(enabled);
 }
 
 void
 paging_unmap_addr(paging_context_t paging_ctx, uint32_t virtual_addr) {
-    page_table_t *page_table = paging_ctx.page_tables + PAGE_DIRECTORY_INDEX(virtual_addr);
-    // page_table_addr is 4096 bytes aligned, so no need to clear the
-    // lower 12 bits where the flags go
-    uint32_t page_table_addr = vmm_virtual_to_physical((uint32_t)page_table);
-
-    paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr)] =
-        page_table_addr;
-    page_table->entries[PAGE_TABLE_INDEX(virtual_addr)] = 0;
+    paging_unmap_range(paging_ctx, virtual_addr, 1);
+}
+
+phys_addr_t
+paging_physical_addr(paging_context_t paging_ctx, uint32_t virtual_addr) {
+    page_entry_t pde = paging_ctx.page_directory->entries[PAGE_DIRECTORY_INDEX(virtual_addr)];
+
+    if (pde & PAGE_FLAG_PAGE_SIZE) {
+        return (PAGING_ENTRY_ADDR(pde) & ~(LARGE_PAGE_SIZE - 1))
+               | (virtual_addr & (LARGE_PAGE_SIZE - 1));
+    }
+
+    if (!(pde & PAGE_FLAG_PRESENT)) {
+        return 0;
+    }
+
+    bool enabled = paging_lock();
+    page_table_t *page_table = paging_table_window(paging_ctx, PAGE_DIRECTORY_INDEX(virtual_addr));
+    page_entry_t entry = page_table->entries[PAGE_TABLE_INDEX(virtual_addr)];
+    paging_unlock(enabled);
+
+    if (!(entry & PAGE_FLAG_PRESENT)) {
+        return 0;
+    }
+
+    return PAGING_ENTRY_ADDR(entry) | (virtual_addr & (PAGE_SIZE - 1));
 }
 
 inline uint32_t
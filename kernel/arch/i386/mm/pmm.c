@@ -1,103 +1,862 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
+#include <flags.h>
 #include <panic.h>
+#include <printk.h>
 #include <kmalloc.h>
+#include <slab.h>
 #include <multiboot2.h>
 
+#include <mm/bitmap.h>
+#include <mm/memblock.h>
 #include <mm/meminfo.h>
+#include <mm/paging.h>
 #include <mm/pmm.h>
+#include <mm/reclaim.h>
 #include <mm/vmm.h>
 
-// ((1 << 32) / (1 << 12))
-// NOTE: each bit represents one 4KB page.
-#define MEM_BITMAP_SIZE (1 << 20)
-#define BITMAP_ENTRY_MASK UINT8_MAX
+// The size of the largest buddy block, in frames. Zones are sized in multiples
+// of this, so every block has a buddy.
+#define MAX_ORDER_FRAMES (1 << PMM_MAX_ORDER)
+// The maximum number of pre-zeroed pages kept around.
+#define ZERO_POOL_SIZE 64
+
+typedef struct pmm_zone {
+    const char *name;
+    uint32_t start_frame;
+    uint32_t end_frame;
+    // The number of usable frames in the zone, according to the memory map.
+    uint32_t present_frames;
+    // The buddy allocator keeps one bitmap per order: bit `i` of the order `k`
+    // bitmap is *clear* if the block of 2^k frames starting at frame
+    // `start_frame + (i << k)` is free (and not part of a larger free block).
+    // The bits are inverted so free blocks can be found using the "fully used"
+    // summaries of bitmap_t.
+    //
+    // NOTE: the free frames aren't mapped anywhere in the kernel's address
+    // space, so the free "lists" can't be threaded through the frames
+    // themselves.
+    bitmap_t buddy_bitmaps[PMM_MAX_ORDER + 1];
+    // The number of free blocks of each order.
+    uint32_t free_count[PMM_MAX_ORDER + 1];
+} pmm_zone_t;
 
 extern kernel_meminfo_t KERNEL_MEMINFO;
 
-static uint8_t MEM_BITMAP[MEM_BITMAP_SIZE];
+// The number of frames tracked by the PMM (all the frames up to the highest
+// usable physical address).
+static uint32_t FRAME_COUNT;
+
+// NOTE: each bit represents one 4KB page (set if the page is in use).
+static bitmap_t MEM_BITMAP;
+
+static pmm_zone_t ZONES[PMM_ZONE_COUNT];
+
+// The first frame of each zone (each zone ends where the next one starts).
+static const uint32_t ZONE_START_FRAMES[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA] = 0,
+    [PMM_ZONE_NORMAL] = PMM_ZONE_DMA_END / PAGE_SIZE,
+#ifdef CONFIG_PAE
+    [PMM_ZONE_HIGH] = PMM_ZONE_HIGH_FRAME,
+#endif
+};
+
+static const char *ZONE_NAMES[PMM_ZONE_COUNT] = {
+    [PMM_ZONE_DMA] = "DMA",
+    [PMM_ZONE_NORMAL] = "normal",
+#ifdef CONFIG_PAE
+    [PMM_ZONE_HIGH] = "high",
+#endif
+};
+
+// The descriptor of each frame (indexed by frame number).
+static pmm_page_t *PAGES;
+
+// The cache the reverse mapping chains are allocated from (see
+// pmm_rmap_init).
+static kmem_cache_t *RMAP_CACHE;
+
+// Where the bitmaps live. This is allocated from memblock, and is sized
+// according to the amount of physical memory.
+static addr_space_entry_t PMM_METADATA;
+
+// The physical addresses of the pages that have already been zeroed (and are
+// ready to be handed out by pmm_alloc_zeroed_page).
+static uint32_t ZERO_POOL[ZERO_POOL_SIZE];
+static uint32_t ZERO_POOL_COUNT;
+
+// The page returned by pmm_zero_page (0 until it is first needed).
+static uint32_t ZERO_PAGE;
+
+// Disable interrupts, returning whether they were enabled.
+//
+// NOTE: this serializes the changes to the buddy allocator, the zero pool and
+// the frame descriptors, which are made by the page fault handler as well as
+// the kernel tasks it might preempt (e.g. the idle task).
+static bool
+pmm_lock() {
+    bool enabled = interrupts_enabled();
+
+    asm volatile("cli" ::: "memory");
+
+    return enabled;
+}
+
+static void
+pmm_unlock(bool enabled) {
+    if (enabled) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+static pmm_zone_t *
+pmm_frame_zone(uint32_t frame) {
+    size_t zone = PMM_ZONE_COUNT - 1;
+
+    while (frame < ZONES[zone].start_frame) {
+        zone--;
+    }
+
+    return &ZONES[zone];
+}
+
+static void
+pmm_mark_range_used(uint64_t start_addr, uint64_t end_addr) {
+    if (start_addr >= (uint64_t)FRAME_COUNT * PAGE_SIZE) {
+        return;
+    }
+
+    if (end_addr > (uint64_t)FRAME_COUNT * PAGE_SIZE) {
+        end_addr = (uint64_t)FRAME_COUNT * PAGE_SIZE;
+    }
+
+    // Any frame that overlaps the range is unusable.
+    uint32_t start_frame = start_addr / PAGE_SIZE;
+    uint32_t end_frame = (end_addr + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    bitmap_set_range(&MEM_BITMAP, start_frame, end_frame - start_frame);
+}
+
+static bool
+pmm_is_frame_used(uint32_t frame) {
+    return bitmap_test(&MEM_BITMAP, frame);
+}
+
+static bool
+buddy_is_free(pmm_zone_t *zone, uint8_t order, uint32_t block) {
+    return !bitmap_test(&zone->buddy_bitmaps[order], block);
+}
+
+static void
+buddy_insert(pmm_zone_t *zone, uint8_t order, uint32_t block) {
+    bitmap_clear(&zone->buddy_bitmaps[order], block);
+    zone->free_count[order]++;
+}
 
 static void
-pmm_mark_addr_used(uint32_t addr) {
-    size_t bitmap_bit = addr / PAGE_SIZE;
-    size_t bitmap_index = bitmap_bit / 8;
-    MEM_BITMAP[bitmap_index] |= (1 << (bitmap_bit % 8));
+buddy_remove(pmm_zone_t *zone, uint8_t order, uint32_t block) {
+    bitmap_set(&zone->buddy_bitmaps[order], block);
+    zone->free_count[order]--;
+}
+
+// Find (but don't remove) a free block of the specified order.
+static uint32_t
+buddy_find_free(pmm_zone_t *zone, uint8_t order) {
+    uint32_t block = bitmap_find_clear(&zone->buddy_bitmaps[order]);
+
+    ASSERT(block != BITMAP_NOT_FOUND,
+           "buddy allocator: no free blocks of order %u in zone %s (free count=%u)",
+           order, zone->name, zone->free_count[order]);
+
+    return block;
 }
 
+// Return the block of 2^order frames starting at `frame` to the allocator,
+// merging it with its buddy for as long as the buddy is also free.
 static void
-pmm_mark_range_used(uint32_t start_addr, uint32_t end_addr) {
-    for (uint32_t i = start_addr; i < end_addr; i += PAGE_SIZE) {
-        pmm_mark_addr_used(i);
+buddy_free_block(uint32_t frame, uint8_t order) {
+    pmm_zone_t *zone = pmm_frame_zone(frame);
+    uint32_t block = (frame - zone->start_frame) >> order;
+
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = block ^ 1;
+
+        if (!buddy_is_free(zone, order, buddy)) {
+            break;
+        }
+
+        buddy_remove(zone, order, buddy);
+        block >>= 1;
+        order++;
     }
+
+    buddy_insert(zone, order, block);
 }
 
+// Return the largest order of a block that starts at `frame` and doesn't
+// extend past `end_frame`.
+static uint8_t
+buddy_max_order(uint32_t frame, uint32_t end_frame) {
+    uint8_t order = 0;
+
+    while (order < PMM_MAX_ORDER
+            && !(frame & ((1 << (order + 1)) - 1))
+            && frame + (1 << (order + 1)) <= end_frame) {
+        order++;
+    }
+
+    return order;
+}
+
+// Hand all the unused frames in [start_addr, end_addr) to the buddy allocator.
+//
+// NOTE: the zone boundaries are aligned to the largest block size, so the
+// blocks never cross them.
 static void
-pmm_mark_addr_free(uint32_t addr) {
-    size_t bitmap_bit = addr / PAGE_SIZE;
-    size_t bitmap_index = bitmap_bit / 8;
-    MEM_BITMAP[bitmap_index] &= ~(1 << bitmap_bit);
+pmm_add_free_range(uint64_t start_addr, uint64_t end_addr) {
+    // Only whole frames can be handed out.
+    uint32_t frame = (start_addr + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t end_frame = end_addr / PAGE_SIZE;
+
+    while (frame < end_frame) {
+        if (pmm_is_frame_used(frame)) {
+            frame++;
+            continue;
+        }
+
+        uint32_t free_end = frame;
+        while (free_end < end_frame && !pmm_is_frame_used(free_end)) {
+            free_end++;
+        }
+
+        // Split [frame, free_end) into the largest possible aligned blocks.
+        while (frame < free_end) {
+            uint8_t order = buddy_max_order(frame, free_end);
+
+            buddy_free_block(frame, order);
+            frame += 1 << order;
+        }
+    }
+}
+
+static uint32_t
+buddy_storage_words(uint32_t frame_count) {
+    uint32_t words = 0;
+
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; ++order) {
+        words += BITMAP_STORAGE_WORDS(frame_count >> order);
+    }
+
+    return words;
+}
+
+// Set up the buddy bitmaps of the zone, using the specified storage. Returns
+// the first word past the storage used by the zone.
+static uint32_t *
+buddy_init(pmm_zone_t *zone, const char *name, uint32_t start_frame, uint32_t end_frame,
+           uint32_t *storage) {
+    *zone = (pmm_zone_t) {
+        .name = name,
+        .start_frame = start_frame,
+        .end_frame = end_frame,
+        .present_frames = 0,
+    };
+
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; ++order) {
+        uint32_t block_count = (end_frame - start_frame) >> order;
+
+        zone->free_count[order] = 0;
+        if (!block_count) {
+            continue;
+        }
+
+        bitmap_init(&zone->buddy_bitmaps[order], storage, block_count);
+        // There are no free blocks until pmm_add_free_range is called.
+        bitmap_set_range(&zone->buddy_bitmaps[order], 0, block_count);
+        storage += BITMAP_STORAGE_WORDS(block_count);
+    }
+
+    return storage;
+}
+
+// Allocate the PMM metadata from memblock and map it at
+// PMM_METADATA_VIRT_START. zone_frames is the number of frames of each zone.
+static uint32_t *
+pmm_alloc_metadata(const uint32_t *zone_frames) {
+    uint32_t words = BITMAP_STORAGE_WORDS(FRAME_COUNT)
+                     + FRAME_COUNT * sizeof(pmm_page_t) / sizeof(uint32_t);
+
+    for (size_t i = 0; i < PMM_ZONE_COUNT; ++i) {
+        words += buddy_storage_words(zone_frames[i]);
+    }
+
+    uint32_t size = words * sizeof(uint32_t);
+    // Keep the metadata out of the DMA zone if possible.
+    uint32_t physical_addr = memblock_alloc(size, PAGE_SIZE, PMM_ZONE_DMA_END);
+    uint32_t page_offset = physical_addr & (LARGE_PAGE_SIZE - 1);
+
+    PMM_METADATA = (addr_space_entry_t) {
+        .virtual_start = PMM_METADATA_VIRT_START + page_offset,
+        .physical_start = physical_addr,
+        .page_count = paging_page_count(size),
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL,
+    };
+
+    // The permanent page tables don't exist yet, so use 4 MB pages to map the
+    // metadata into the bootstrap page directory.
+    paging_early_map(PMM_METADATA_VIRT_START, physical_addr - page_offset, page_offset + size);
+
+    return (uint32_t *)PMM_METADATA.virtual_start;
 }
 
 void
-pmm_init(multiboot_info_t multiboot_info) {
-    // Mark the kernel physical address range as used:
-    pmm_mark_range_used(KERNEL_MEMINFO.physical_start, KERNEL_MEMINFO.physical_end);
-    // Mark the kernel heap address range as used:
-    uint32_t heap_start = KERNEL_HEAP_PHYS_START;
-    uint32_t heap_end = heap_start + KERNEL_HEAP_SIZE - 1;
-    pmm_mark_range_used(heap_start, heap_end);
-
-    // Mark any unavailable memory regions as used:
-    struct multiboot_tag *tag = (struct multiboot_tag *)(multiboot_info.addr + 8);
-    while (tag->type != MULTIBOOT_TAG_TYPE_END && tag->type != MULTIBOOT_TAG_TYPE_MMAP) {
-        tag = (struct multiboot_tag *)((multiboot_uint8_t *)tag + ((tag->size + 7) & ~7));
-    }
-
-    ASSERT(tag-> type != MULTIBOOT_TAG_TYPE_END, "failed to read memory map");
-
-    multiboot_memory_map_t *mmap = ((struct multiboot_tag_mmap *)tag)->entries;
-    while ((multiboot_uint8_t *) mmap < (multiboot_uint8_t *)tag + tag->size) {
-        switch (mmap->type) {
-            case MULTIBOOT_MEMORY_AVAILABLE:
-                break;
-            case MULTIBOOT_MEMORY_RESERVED:
-            case MULTIBOOT_MEMORY_ACPI_RECLAIMABLE:
-            case MULTIBOOT_MEMORY_NVS:
-            case MULTIBOOT_MEMORY_BADRAM:
-                pmm_mark_range_used(mmap->addr, mmap->addr + mmap->len);
-                break;
+pmm_init() {
+    memblock_type_t *memory = memblock_memory();
+    memblock_type_t *reserved = memblock_reserved();
+
+    // Only track the frames up to the end of the highest usable region (zones
+    // are sized in multiples of the largest block).
+    uint32_t end_frame = memblock_end_of_ram() / PAGE_SIZE;
+    FRAME_COUNT = (end_frame + MAX_ORDER_FRAMES - 1) & ~(MAX_ORDER_FRAMES - 1);
+
+    // The zones past the end of RAM are empty.
+    uint32_t zone_starts[PMM_ZONE_COUNT + 1];
+    uint32_t zone_frames[PMM_ZONE_COUNT];
+
+    for (size_t i = 0; i < PMM_ZONE_COUNT; ++i) {
+        zone_starts[i] = ZONE_START_FRAMES[i] < FRAME_COUNT ? ZONE_START_FRAMES[i] : FRAME_COUNT;
+    }
+
+    zone_starts[PMM_ZONE_COUNT] = FRAME_COUNT;
+
+    for (size_t i = 0; i < PMM_ZONE_COUNT; ++i) {
+        zone_frames[i] = zone_starts[i + 1] - zone_starts[i];
+    }
+
+    uint32_t *storage = pmm_alloc_metadata(zone_frames);
+
+    bitmap_init(&MEM_BITMAP, storage, FRAME_COUNT);
+    storage += BITMAP_STORAGE_WORDS(FRAME_COUNT);
+
+    for (size_t i = 0; i < PMM_ZONE_COUNT; ++i) {
+        storage = buddy_init(&ZONES[i], ZONE_NAMES[i], zone_starts[i], zone_starts[i + 1],
+                             storage);
+    }
+
+    PAGES = (pmm_page_t *)storage;
+    memset(PAGES, 0, FRAME_COUNT * sizeof(pmm_page_t));
+
+    // Only the frames in the usable regions of the memory map can be
+    // allocated...
+    bitmap_set_range(&MEM_BITMAP, 0, FRAME_COUNT);
+    for (uint32_t i = 0; i < memory->count; ++i) {
+        uint32_t start_frame = memory->regions[i].base / PAGE_SIZE;
+        uint32_t frame_count = memory->regions[i].size / PAGE_SIZE;
+
+        bitmap_clear_range(&MEM_BITMAP, start_frame, frame_count);
+
+        for (size_t z = 0; z < PMM_ZONE_COUNT; ++z) {
+            uint32_t start = start_frame > ZONES[z].start_frame ? start_frame : ZONES[z].start_frame;
+            uint32_t end = start_frame + frame_count < ZONES[z].end_frame ?
+                           start_frame + frame_count : ZONES[z].end_frame;
+
+            if (start < end) {
+                ZONES[z].present_frames += end - start;
+            }
         }
-        mmap = (multiboot_memory_map_t *)((unsigned long) mmap + ((struct multiboot_tag_mmap *)
-                                          tag)->entry_size);
     }
 
-    // The framebuffer address is also unavailable
-    struct multiboot_tag_framebuffer_common *framebuffer_info = multiboot_framebuffer_info(
-                multiboot_info.addr);
-    uint32_t framebuffer_size = framebuffer_info->framebuffer_width *
-                                framebuffer_info->framebuffer_height * 2;
-    pmm_mark_range_used(framebuffer_info->framebuffer_addr,
-                        framebuffer_info->framebuffer_addr + framebuffer_size - 1);
+    // ...and only if they're not already in use.
+    for (uint32_t i = 0; i < reserved->count; ++i) {
+        pmm_mark_range_used(reserved->regions[i].base,
+                            reserved->regions[i].base + reserved->regions[i].size);
+    }
+
+    // Now that all the reserved frames are known, seed the buddy allocator
+    // with the usable regions of the memory map.
+    for (uint32_t i = 0; i < memory->count; ++i) {
+        pmm_add_free_range(memory->regions[i].base,
+                           memory->regions[i].base + memory->regions[i].size);
+    }
+
+    for (size_t i = 0; i < PMM_ZONE_COUNT; ++i) {
+        printk_debug("PMM: zone %s: frames %#x-%#x (%u present)\n", ZONES[i].name,
+                     ZONES[i].start_frame, ZONES[i].end_frame, ZONES[i].present_frames);
+    }
+}
+
+addr_space_entry_t
+pmm_metadata_addr_space() {
+    return PMM_METADATA;
+}
+
+// Allocate 2^order contiguous frames from the specified zone, returning the
+// first one (or 0 if the zone has no free blocks that large, as frame 0 is never
+// handed out).
+static uint32_t
+pmm_alloc_frames(pmm_zone_type_t zone_type, uint8_t order) {
+    ASSERT(order <= PMM_MAX_ORDER, "invalid order: %u", order);
+
+    bool enabled = pmm_lock();
+    pmm_zone_t *zone = &ZONES[zone_type];
+    uint8_t current_order = order;
+    while (current_order <= PMM_MAX_ORDER && !zone->free_count[current_order]) {
+        current_order++;
+    }
+
+    if (current_order > PMM_MAX_ORDER) {
+        pmm_unlock(enabled);
+        return 0;
+    }
+
+    uint32_t block = buddy_find_free(zone, current_order);
+    buddy_remove(zone, current_order, block);
+
+    // Split the block until it has the requested size, returning the upper
+    // half of each split to the allocator.
+    while (current_order > order) {
+        current_order--;
+        block <<= 1;
+        buddy_insert(zone, current_order, block + 1);
+    }
+
+    uint32_t frame = zone->start_frame + (block << order);
+    bitmap_set_range(&MEM_BITMAP, frame, 1 << order);
+    pmm_unlock(enabled);
+
+    return frame;
 }
 
 void *
-pmm_alloc_page() {
-    for (size_t i = 0; i < MEM_BITMAP_SIZE; ++i) {
-        if (MEM_BITMAP[i] != BITMAP_ENTRY_MASK) {
-            // This entry has at least one free slot
-            size_t alloc_bit = 0;
-            // Keep shifting until the first zeroed bit is found.
-            for (uint8_t entry = MEM_BITMAP[i]; entry & 1; entry >>= 1, alloc_bit += 1);
-            MEM_BITMAP[i] |= (1 << alloc_bit);
-            return (void *)((i * 8 + alloc_bit) * PAGE_SIZE);
+pmm_alloc_pages_zone(pmm_zone_type_t zone_type, uint8_t order) {
+#ifdef CONFIG_PAE
+    ASSERT(zone_type != PMM_ZONE_HIGH, "cannot allocate high memory by pointer");
+#endif
+
+    return (void *)(pmm_alloc_frames(zone_type, order) * PAGE_SIZE);
+}
+
+void *
+pmm_try_alloc_pages(uint8_t order) {
+    // Only dip into the DMA zone if there is nothing left in the normal one.
+    void *addr = pmm_alloc_pages_zone(PMM_ZONE_NORMAL, order);
+    if (!addr) {
+        addr = pmm_alloc_pages_zone(PMM_ZONE_DMA, order);
+    }
+
+    return addr;
+}
+
+void *
+pmm_try_alloc_zeroed_pages(uint8_t order) {
+    uint32_t physical_addr = (uint32_t)pmm_try_alloc_pages(order);
+
+    if (!physical_addr) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < (uint32_t)(1 << order); ++i) {
+        paging_zero_physical_page(physical_addr + i * PAGE_SIZE);
+    }
+
+    return (void *)physical_addr;
+}
+
+void *
+pmm_alloc_pages(uint8_t order) {
+    void *addr = pmm_try_alloc_pages(order);
+
+    // The pages in the zero pool are free too.
+    if (!addr && !order) {
+        bool enabled = pmm_lock();
+
+        if (ZERO_POOL_COUNT) {
+            addr = (void *)ZERO_POOL[--ZERO_POOL_COUNT];
         }
+
+        pmm_unlock(enabled);
+    }
+
+    // As a last resort, take back the pages that only back free heap memory,
+    // and then the pages of the user address spaces.
+    if (!addr && (kmalloc_release_free_pages() || reclaim_pages(RECLAIM_BATCH))) {
+        return pmm_alloc_pages(order);
+    }
+
+    if (!addr) {
+        // XXX handle this more gracefully
+        PANIC("out of memory");
     }
-    // XXX handle this more gracefully
-    PANIC("out of memory");
+
+    return addr;
+}
+
+// Free the block of 2^order frames starting at `frame`.
+static void
+pmm_free_frames(uint32_t frame, uint8_t order) {
+    uint64_t addr = (uint64_t)frame * PAGE_SIZE;
+
+    ASSERT(order <= PMM_MAX_ORDER, "invalid order: %u", order);
+    ASSERT(!(frame & ((1 << order) - 1)), "misaligned order %u block: %#llx", order, addr);
+
+    bool enabled = pmm_lock();
+
+    ASSERT(frame < FRAME_COUNT && pmm_is_frame_used(frame), "double free of physical page %#llx",
+           addr);
+    ASSERT(!PAGES[frame].shares, "freeing shared physical page %#llx", addr);
+    ASSERT(!PAGES[frame].rmap, "freeing mapped physical page %#llx", addr);
+
+    // The block might have been used for a page table.
+    PAGES[frame].flags = 0;
+
+    bitmap_clear_range(&MEM_BITMAP, frame, 1 << order);
+    buddy_free_block(frame, order);
+    pmm_unlock(enabled);
+}
+
+void
+pmm_free_pages(void *addr, uint8_t order) {
+    pmm_free_frames((uint32_t)addr / PAGE_SIZE, order);
+}
+
+void
+pmm_trim_pages(void *addr, uint8_t order, uint32_t page_count) {
+    uint32_t frame = (uint32_t)addr / PAGE_SIZE;
+    uint32_t end_frame = frame + (1 << order);
+
+    ASSERT(page_count <= (uint32_t)(1 << order), "cannot trim %u pages to %u pages", 1 << order,
+           page_count);
+
+    for (uint32_t i = frame + page_count; i < end_frame;) {
+        uint8_t tail_order = buddy_max_order(i, end_frame);
+
+        pmm_free_pages((void *)(i * PAGE_SIZE), tail_order);
+        i += 1 << tail_order;
+    }
+}
+
+uint8_t
+pmm_page_count_to_order(uint32_t page_count) {
+    uint8_t order = 0;
+
+    while ((uint32_t)(1 << order) < page_count) {
+        order++;
+    }
+
+    ASSERT(order <= PMM_MAX_ORDER, "cannot allocate %u contiguous pages", page_count);
+
+    return order;
+}
+
+void *
+pmm_alloc_page() {
+    return pmm_alloc_pages(0);
 }
 
 void
 pmm_free_page(void *addr) {
-    pmm_mark_addr_free((uint32_t)addr);
+    pmm_free_pages(addr, 0);
+}
+
+uint32_t
+pmm_frame_count() {
+    return FRAME_COUNT;
+}
+
+pmm_page_t *
+pmm_page(phys_addr_t physical_addr) {
+    uint32_t frame = physical_addr / PAGE_SIZE;
+
+    // The frames that aren't RAM (e.g. memory-mapped devices) and the zero
+    // page aren't tracked.
+    if (frame >= FRAME_COUNT || (ZERO_PAGE && frame == ZERO_PAGE / PAGE_SIZE)) {
+        return NULL;
+    }
+
+    return &PAGES[frame];
+}
+
+void
+pmm_page_get(phys_addr_t physical_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (!page) {
+        return;
+    }
+
+    bool enabled = pmm_lock();
+
+    ASSERT(pmm_is_frame_used(physical_addr / PAGE_SIZE), "physical page %#llx is not allocated",
+           (uint64_t)physical_addr);
+    ASSERT(page->shares < UINT16_MAX, "too many references to physical page %#llx",
+           (uint64_t)physical_addr);
+
+    page->shares++;
+    pmm_unlock(enabled);
+}
+
+void
+pmm_page_put(phys_addr_t physical_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (!page) {
+        return;
+    }
+
+    bool enabled = pmm_lock();
+
+    if (page->shares) {
+        page->shares--;
+    } else {
+        pmm_free_frames(physical_addr / PAGE_SIZE, 0);
+    }
+
+    pmm_unlock(enabled);
+}
+
+uint32_t
+pmm_page_refcount(phys_addr_t physical_addr) {
+    if (ZERO_PAGE && physical_addr / PAGE_SIZE == ZERO_PAGE / PAGE_SIZE) {
+        return UINT32_MAX;
+    }
+
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    return page ? page->shares + 1u : 1;
+}
+
+void
+pmm_rmap_init() {
+    // The chain links are tiny and plentiful, so don't pad them to a cache
+    // line.
+    RMAP_CACHE = kmem_cache_create("pmm_rmap", sizeof(pmm_rmap_t), sizeof(void *), NULL);
+}
+
+void
+pmm_page_set_table(uint32_t physical_addr, uint32_t virtual_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    ASSERT(page && !page->rmap, "physical page %#x cannot be a page table", physical_addr);
+
+    page->flags |= PMM_PAGE_TABLE;
+    page->rmap = virtual_addr;
+}
+
+void
+pmm_free_table(uint32_t physical_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    ASSERT(page && (page->flags & PMM_PAGE_TABLE), "%#x is not a page table", physical_addr);
+
+    // The rmap of a page table is the address it maps, not a mapping.
+    page->rmap = 0;
+    pmm_page_put(physical_addr);
+}
+
+uint32_t
+pmm_rmap_virtual_addr(uint32_t pte) {
+    pmm_page_t *table = pmm_page(pte);
+
+    ASSERT(table && (table->flags & PMM_PAGE_TABLE), "%#x is not a page table entry", pte);
+
+    return table->rmap + PMM_RMAP_INDEX(pte) * PAGE_SIZE;
+}
+
+void
+pmm_rmap_add(phys_addr_t physical_addr, uint32_t pte) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (!page) {
+        return;
+    }
+
+    bool enabled = pmm_lock();
+
+    ASSERT(!(page->flags & PMM_PAGE_TABLE), "cannot map page table %#llx",
+           (uint64_t)physical_addr);
+
+    if (!page->rmap) {
+        // The common case: a single mapping, which is stored in the
+        // descriptor itself.
+        page->rmap = pte;
+        pmm_unlock(enabled);
+
+        return;
+    }
+
+    if (!(page->flags & PMM_PAGE_RMAP_CHAIN)) {
+        // The second mapping: move the first one into the chain.
+        pmm_rmap_t *first = kmem_cache_alloc(RMAP_CACHE);
+
+        first->pte = page->rmap;
+        first->next = NULL;
+        page->rmap = (uint32_t)first;
+        page->flags |= PMM_PAGE_RMAP_CHAIN;
+    }
+
+    pmm_rmap_t *node = kmem_cache_alloc(RMAP_CACHE);
+
+    node->pte = pte;
+    node->next = (pmm_rmap_t *)page->rmap;
+    page->rmap = (uint32_t)node;
+    pmm_unlock(enabled);
+}
+
+void
+pmm_rmap_remove(phys_addr_t physical_addr, uint32_t pte) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (!page) {
+        return;
+    }
+
+    bool enabled = pmm_lock();
+
+    if (!(page->flags & PMM_PAGE_RMAP_CHAIN)) {
+        ASSERT(page->rmap == pte, "%#llx is not mapped by %#x", (uint64_t)physical_addr, pte);
+        page->rmap = 0;
+    } else {
+        pmm_rmap_t **link = (pmm_rmap_t **)&page->rmap;
+
+        while (*link && (*link)->pte != pte) {
+            link = &(*link)->next;
+        }
+
+        ASSERT(*link, "%#llx is not mapped by %#x", (uint64_t)physical_addr, pte);
+
+        pmm_rmap_t *removed = *link;
+        *link = removed->next;
+
+        kmem_cache_free(RMAP_CACHE, removed);
+
+        // Go back to storing the last mapping in the descriptor.
+        pmm_rmap_t *last = (pmm_rmap_t *)page->rmap;
+        if (!last->next) {
+            page->rmap = last->pte;
+            page->flags &= ~PMM_PAGE_RMAP_CHAIN;
+            kmem_cache_free(RMAP_CACHE, last);
+        }
+    }
+
+    pmm_unlock(enabled);
+}
+
+void
+pmm_rmap_walk(phys_addr_t physical_addr, void (*fn)(uint32_t pte, void *data), void *data) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (!page || !page->rmap) {
+        return;
+    }
+
+    if (!(page->flags & PMM_PAGE_RMAP_CHAIN)) {
+        fn(page->rmap, data);
+
+        return;
+    }
+
+    for (pmm_rmap_t *node = (pmm_rmap_t *)page->rmap; node; node = node->next) {
+        fn(node->pte, data);
+    }
+}
+
+uint32_t
+pmm_zero_page() {
+    // NOTE: this can't be done in pmm_init, as zeroing a page needs paging.
+    if (!ZERO_PAGE) {
+        ZERO_PAGE = (uint32_t)pmm_alloc_zeroed_page();
+    }
+
+    return ZERO_PAGE;
+}
+
+void *
+pmm_alloc_zeroed_page() {
+    bool enabled = pmm_lock();
+    uint32_t physical_addr = ZERO_POOL_COUNT ? ZERO_POOL[--ZERO_POOL_COUNT] : 0;
+    pmm_unlock(enabled);
+
+    if (!physical_addr) {
+        // The pool is empty, so the page has to be zeroed right away.
+        physical_addr = (uint32_t)pmm_alloc_page();
+        paging_zero_physical_page(physical_addr);
+    }
+
+    return (void *)physical_addr;
+}
+
+phys_addr_t
+pmm_alloc_user_page() {
+#ifdef CONFIG_PAE
+    uint32_t frame = pmm_alloc_frames(PMM_ZONE_HIGH, 0);
+
+    if (frame) {
+        return (phys_addr_t)frame * PAGE_SIZE;
+    }
+#endif
+
+    return (uint32_t)pmm_alloc_page();
+}
+
+phys_addr_t
+pmm_alloc_zeroed_user_page() {
+#ifdef CONFIG_PAE
+    uint32_t frame = pmm_alloc_frames(PMM_ZONE_HIGH, 0);
+
+    if (frame) {
+        phys_addr_t physical_addr = (phys_addr_t)frame * PAGE_SIZE;
+
+        paging_zero_physical_page(physical_addr);
+
+        return physical_addr;
+    }
+#endif
+
+    return (uint32_t)pmm_alloc_zeroed_page();
+}
+
+void
+pmm_refill_zeroed_pages() {
+    // NOTE: the pool only shrinks while this runs (this is the only place
+    // that fills it), so a page that was zeroed always fits.
+    while (ZERO_POOL_COUNT < ZERO_POOL_SIZE) {
+        // Don't use up the DMA zone just to have some zeroed pages around.
+        void *addr = pmm_alloc_pages_zone(PMM_ZONE_NORMAL, 0);
+        if (!addr) {
+            break;
+        }
+
+        paging_zero_physical_page((uint32_t)addr);
+
+        bool enabled = pmm_lock();
+        ZERO_POOL[ZERO_POOL_COUNT++] = (uint32_t)addr;
+        pmm_unlock(enabled);
+    }
+}
+
+void
+pmm_memstat(memstat_t *stat) {
+    bool enabled = pmm_lock();
+
+    stat->pmm_frame_count = FRAME_COUNT;
+    // The pages in the zero pool are allocated as far as the buddy allocator
+    // is concerned, but they're really free.
+    stat->pmm_free_frames = ZERO_POOL_COUNT;
+    stat->pmm_zeroed_frames = ZERO_POOL_COUNT;
+
+    for (uint8_t order = 0; order <= PMM_MAX_ORDER; ++order) {
+        stat->pmm_free_blocks[order] = 0;
+
+        for (size_t i = 0; i < PMM_ZONE_COUNT; ++i) {
+            stat->pmm_free_blocks[order] += ZONES[i].free_count[order];
+            stat->pmm_free_frames += ZONES[i].free_count[order] << order;
+        }
+    }
+
+    stat->pmm_used_frames = FRAME_COUNT - stat->pmm_free_frames;
+
+    pmm_unlock(enabled);
 }
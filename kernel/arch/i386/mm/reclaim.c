@@ -0,0 +1,84 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mm/paging.h>
+#include <mm/pmm.h>
+#include <mm/reclaim.h>
+#include <mm/swap.h>
+
+// The frame the clock hand points to.
+static uint32_t CLOCK_HAND;
+// Set while reclaiming: storing a page allocates memory, which mustn't reclaim
+// more memory (and store more pages) in turn.
+static bool RECLAIMING;
+
+// Try to reclaim the frame at physical_addr, returning whether it was freed.
+static bool
+reclaim_page(phys_addr_t physical_addr) {
+    pmm_page_t *page = pmm_page(physical_addr);
+
+    if (!page || page->flags != PMM_PAGE_RECLAIMABLE || page->shares || !page->rmap) {
+        return false;
+    }
+
+    uint32_t pte = page->rmap;
+    page_entry_t entry = paging_rmap_entry(pte);
+
+    if (entry & PAGE_FLAG_ACCESSED) {
+        // The page has been used since the last sweep, so give it a second
+        // chance.
+        paging_rmap_set_entry(pte, entry & ~PAGE_FLAG_ACCESSED);
+
+        return false;
+    }
+
+    uint32_t slot = 0;
+
+    if (entry & PAGE_FLAG_DIRTY) {
+        slot = swap_compress(physical_addr);
+
+        if (!slot) {
+            return false;
+        }
+    }
+
+    // A clean page is filled in again by the page fault handler.
+    paging_rmap_set_entry(pte, slot ? PAGING_SWAP_ENTRY(slot) : 0);
+    pmm_rmap_remove(physical_addr, pte);
+    pmm_page_put(physical_addr);
+
+    // The frame is free now, so there's room for the compressed data.
+    if (slot) {
+        swap_commit(slot);
+    }
+
+    return true;
+}
+
+uint32_t
+reclaim_pages(uint32_t target) {
+    if (RECLAIMING) {
+        return 0;
+    }
+
+    RECLAIMING = true;
+
+    uint32_t frame_count = pmm_frame_count();
+    uint32_t reclaimed = 0;
+
+    // Two sweeps, as the first one might only clear the accessed flags.
+    for (uint32_t i = 0; i < 2 * frame_count && reclaimed < target; ++i) {
+        uint32_t frame = CLOCK_HAND;
+
+        CLOCK_HAND = (CLOCK_HAND + 1) % frame_count;
+
+        if (reclaim_page((phys_addr_t)frame * PAGE_SIZE)) {
+            reclaimed++;
+        }
+    }
+
+    RECLAIMING = false;
+
+    return reclaimed;
+}
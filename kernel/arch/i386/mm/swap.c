@@ -0,0 +1,177 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <flags.h>
+#include <kmalloc.h>
+#include <lz4.h>
+#include <panic.h>
+
+#include <mm/paging.h>
+#include <mm/swap.h>
+
+typedef struct swap_slot {
+    union {
+        // The compressed page, if the slot is in use (NULL until swap_commit
+        // is called).
+        void *data;
+        // The next free slot (or 0), if the slot is free.
+        uint32_t next_free;
+    };
+    // The size of the compressed page.
+    uint16_t size;
+    // The number of page table entries that refer to the slot (0 if the slot
+    // is free).
+    uint16_t refcount;
+} swap_slot_t;
+
+// Slot 0 is never used (it means "no slot").
+static swap_slot_t SLOTS[SWAP_SLOT_COUNT];
+// The slots freed by swap_put...
+static uint32_t FREE_SLOTS;
+// ...and the first slot that was never used.
+static uint32_t NEXT_UNUSED_SLOT = 1;
+
+// The number of slots in use, and the total size of their compressed data.
+static uint32_t USED_SLOTS;
+static uint32_t COMPRESSED_BYTES;
+
+// The page being compressed (or decompressed).
+static uint8_t PAGE_BUFFER[PAGE_SIZE];
+// The output of the last swap_compress call.
+static uint8_t PENDING_DATA[SWAP_MAX_COMPRESSED_SIZE];
+static uint32_t PENDING_SLOT;
+
+// Disable interrupts, returning whether they were enabled.
+//
+// NOTE: this keeps the page fault handler from running in the middle of a
+// change to the slots.
+static bool
+swap_lock() {
+    bool enabled = interrupts_enabled();
+
+    asm volatile("cli");
+
+    return enabled;
+}
+
+static void
+swap_unlock(bool enabled) {
+    if (enabled) {
+        asm volatile("sti");
+    }
+}
+
+static swap_slot_t *
+slot_at(uint32_t slot) {
+    ASSERT(slot && slot < SWAP_SLOT_COUNT && SLOTS[slot].refcount, "invalid swap slot %u", slot);
+
+    return &SLOTS[slot];
+}
+
+uint32_t
+swap_compress(phys_addr_t physical_addr) {
+    bool enabled = swap_lock();
+
+    ASSERT(!PENDING_SLOT, "swap slot %u was never committed", PENDING_SLOT);
+
+    uint32_t slot = FREE_SLOTS ? FREE_SLOTS : NEXT_UNUSED_SLOT;
+
+    if (slot == SWAP_SLOT_COUNT) {
+        swap_unlock(enabled);
+
+        return 0;
+    }
+
+    paging_copy_from_physical_page(physical_addr, PAGE_BUFFER);
+    size_t size = lz4_compress(PAGE_BUFFER, PAGE_SIZE, PENDING_DATA, sizeof(PENDING_DATA));
+
+    if (!size) {
+        swap_unlock(enabled);
+
+        return 0;
+    }
+
+    if (slot == FREE_SLOTS) {
+        FREE_SLOTS = SLOTS[slot].next_free;
+    } else {
+        NEXT_UNUSED_SLOT++;
+    }
+
+    SLOTS[slot] = (swap_slot_t) {
+        .data = NULL,
+        .size = size,
+        .refcount = 1,
+    };
+    PENDING_SLOT = slot;
+    USED_SLOTS++;
+    COMPRESSED_BYTES += size;
+    swap_unlock(enabled);
+
+    return slot;
+}
+
+void
+swap_commit(uint32_t slot) {
+    ASSERT(slot == PENDING_SLOT, "swap slot %u is not pending", slot);
+
+    // NOTE: the allocation might reclaim memory, but not by storing more pages
+    // (see reclaim_pages).
+    void *data = kmalloc(SLOTS[slot].size);
+
+    memcpy(data, PENDING_DATA, SLOTS[slot].size);
+    SLOTS[slot].data = data;
+    PENDING_SLOT = 0;
+}
+
+void
+swap_read(uint32_t slot, phys_addr_t physical_addr) {
+    bool enabled = swap_lock();
+    swap_slot_t *entry = slot_at(slot);
+    size_t size = lz4_decompress(entry->data, entry->size, PAGE_BUFFER, PAGE_SIZE);
+
+    ASSERT(size == PAGE_SIZE, "swap slot %u is corrupted", slot);
+
+    paging_copy_to_physical_page(physical_addr, 0, PAGE_BUFFER, PAGE_SIZE);
+    swap_unlock(enabled);
+}
+
+void
+swap_dup(uint32_t slot) {
+    bool enabled = swap_lock();
+    swap_slot_t *entry = slot_at(slot);
+
+    ASSERT(entry->refcount < UINT16_MAX, "too many references to swap slot %u", slot);
+
+    entry->refcount++;
+    swap_unlock(enabled);
+}
+
+void
+swap_put(uint32_t slot) {
+    bool enabled = swap_lock();
+    swap_slot_t *entry = slot_at(slot);
+
+    if (--entry->refcount) {
+        swap_unlock(enabled);
+
+        return;
+    }
+
+    void *data = entry->data;
+
+    USED_SLOTS--;
+    COMPRESSED_BYTES -= entry->size;
+    entry->next_free = FREE_SLOTS;
+    FREE_SLOTS = slot;
+    swap_unlock(enabled);
+
+    kfree(data);
+}
+
+void
+swap_memstat(memstat_t *stat) {
+    stat->swap_pages = USED_SLOTS;
+    stat->swap_compressed_bytes = COMPRESSED_BYTES;
+}
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <panic.h>
 #include <kmalloc.h>
+#include <slab.h>
+#include <multiboot2.h>
 #include <mm/vmm.h>
 #include <mm/pmm.h>
 #include <mm/paging.h>
@@ -11,32 +13,59 @@
 #include <mm/addr_space.h>
 #include <panic.h>
 
-#define ADDR_SPACE_ENTRIES 6
+#define ADDR_SPACE_ENTRIES 9
 
 extern kernel_meminfo_t KERNEL_MEMINFO;
 extern multiboot_info_t MULTIBOOT_INFO;
 
-static addr_space_entry_t ADDR_SPACE[ADDR_SPACE_ENTRIES];
+#define ALLOCATION(avl_node) AVL_ENTRY(avl_node, vmm_allocation_tree_t, node)
+#define FREE_BLOCK(avl_node) AVL_ENTRY(avl_node, vmm_free_blocks_t, node)
 
-static void add_allocation(vmm_context_t *vmm_context, uint32_t virtual_addr,
-                           uint32_t physical_addr, uint32_t page_count, uint32_t flags);
-static void remove_allocation(vmm_context_t *vmm_context,
-                              vmm_allocation_tree_t *allocation);
+static addr_space_entry_t ADDR_SPACE[ADDR_SPACE_ENTRIES];
+// The kernel's part of the address space is the same in every context, so its
+// allocations (and free blocks) are tracked once, here, rather than in every
+// context.
+static vmm_context_t KERNEL_VMM_CONTEXT;
+
+// The caches the nodes of the free block and allocation trees are allocated
+// from.
+static kmem_cache_t *FREE_BLOCKS_CACHE;
+static kmem_cache_t *ALLOCATION_TREE_CACHE;
+
+static void add_allocation(vmm_context_t *vmm_context, vmm_allocation_t alloc);
+static vmm_allocation_tree_t *find_allocation(avl_node_t *allocations, uint32_t virtual_addr);
+static vmm_allocation_tree_t *find_allocation_path(vmm_context_t *vmm_context,
+        uint32_t virtual_addr, avl_path_t *path);
 static void add_free_blocks(vmm_context_t *vmm_context, uint32_t virtual_addr,
                             uint32_t page_count);
 static uint32_t remove_free_blocks(vmm_context_t *vmm_context, uint32_t virtual_addr,
                                    uint32_t page_count, bool is_userspace);
+static uint64_t block_end(vmm_free_blocks_t *block);
+static vmm_free_blocks_t *first_fit(avl_node_t *free_blocks, uint32_t page_count,
+                                    uint32_t min_addr, uint64_t max_addr);
 static vmm_context_t create_empty_ctx();
 
 vmm_context_t
 vmm_init() {
+    FREE_BLOCKS_CACHE = kmem_cache_create("vmm_free_blocks", sizeof(vmm_free_blocks_t), 0, NULL);
+    ALLOCATION_TREE_CACHE = kmem_cache_create("vmm_allocation_tree", sizeof(vmm_allocation_tree_t),
+                            0, NULL);
+
+    // NOTE: the kernel mappings are global (see CR4_PGE): they are the same in
+    // every address space.
+    uint64_t kernel_page_count = (((uint64_t)1 << 32) - KERNEL_MEMINFO.higher_half_base)
+                                 / PAGE_SIZE;
+
+    KERNEL_VMM_CONTEXT = create_empty_ctx();
+    add_free_blocks(&KERNEL_VMM_CONTEXT, KERNEL_MEMINFO.higher_half_base, kernel_page_count);
+
     // Kernel text
     ADDR_SPACE[0] = (addr_space_entry_t) {
         .virtual_start = KERNEL_MEMINFO.text_virtual_start,
         .physical_start = KERNEL_MEMINFO.text_physical_start,
         .page_count = paging_page_count(KERNEL_MEMINFO.text_virtual_end -
                                         KERNEL_MEMINFO.text_virtual_start),
-        .flags = PAGE_FLAG_PRESENT
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_GLOBAL
     };
 
     // Kernel rodata
@@ -45,7 +74,7 @@ vmm_init() {
         .physical_start = KERNEL_MEMINFO.rodata_physical_start,
         .page_count = paging_page_count(KERNEL_MEMINFO.rodata_virtual_end -
                                         KERNEL_MEMINFO.rodata_virtual_start),
-        .flags = PAGE_FLAG_PRESENT
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_GLOBAL
     };
 
     // Kernel data
@@ -54,7 +83,7 @@ vmm_init() {
         .physical_start = KERNEL_MEMINFO.data_physical_start,
         .page_count = paging_page_count(KERNEL_MEMINFO.data_virtual_end -
                                         KERNEL_MEMINFO.data_virtual_start),
-        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL
     };
 
     // Kernel bss
@@ -64,15 +93,15 @@ vmm_init() {
         .virtual_start = KERNEL_MEMINFO.bss_virtual_start,
         .physical_start = KERNEL_MEMINFO.bss_physical_start,
         .page_count = paging_page_count(KERNEL_MEMINFO.bss_virtual_end - KERNEL_MEMINFO.bss_virtual_start),
-        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL
     };
 
-    // Kernel heap
+    // Kernel heap (backed on demand by kmalloc)
     ADDR_SPACE[4] = (addr_space_entry_t) {
         .virtual_start = KERNEL_HEAP_VIRT_START,
-        .physical_start = KERNEL_HEAP_PHYS_START,
+        .physical_start = 0,
         .page_count = paging_page_count(KERNEL_HEAP_SIZE),
-        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL
     };
 
     // Framebuffer
@@ -82,102 +111,98 @@ vmm_init() {
         .virtual_start = KERNEL_MEMINFO.higher_half_base,
         .physical_start = framebuffer_info->framebuffer_addr,
         .page_count = 1,
-        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL
     };
 
-    return vmm_new_context();
-}
+    // PMM bitmaps
+    ADDR_SPACE[6] = pmm_metadata_addr_space();
 
-vmm_context_t
-vmm_new_context() {
-    vmm_context_t vmm_context = create_empty_ctx();
+    // The scratch pages (see paging_zero_physical_page)
+    ADDR_SPACE[7] = (addr_space_entry_t) {
+        .virtual_start = PAGING_TABLE_SCRATCH_VIRT_ADDR,
+        .physical_start = 0,
+        .page_count = 2,
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL
+    };
 
-    uint64_t total_page_count = ((uint64_t)1 << 32) / PAGE_SIZE;
-    uint64_t user_page_count = KERNEL_MEMINFO.higher_half_base / PAGE_SIZE;
-    uint64_t kernel_page_count = total_page_count - user_page_count;
-    // Separate the userspace addresses from the kernel ones:
-    add_free_blocks(&vmm_context, 0, user_page_count);
-    add_free_blocks(&vmm_context, KERNEL_MEMINFO.higher_half_base, kernel_page_count);
+    // The page tables of the active context (see the recursive page directory
+    // entries in init_paging)
+    ADDR_SPACE[8] = (addr_space_entry_t) {
+        .virtual_start = PAGING_RECURSIVE_PAGE_TABLES,
+        .physical_start = 0,
+        .page_count = PAGE_DIRECTORY_SIZE,
+        .flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE
+    };
 
     for (size_t i = 0; i < (sizeof(ADDR_SPACE) / sizeof(addr_space_entry_t)); ++i) {
-        vmm_map_pages(&vmm_context,
+        vmm_map_pages(&KERNEL_VMM_CONTEXT,
                       ADDR_SPACE[i].virtual_start,
                       ADDR_SPACE[i].physical_start,
                       ADDR_SPACE[i].page_count,
                       ADDR_SPACE[i].flags);
     }
 
-    return vmm_context;
+    return vmm_new_context();
 }
 
-vmm_free_blocks_t *
-clone_free_blocks(vmm_free_blocks_t *orig_free_blocks) {
-    if (!orig_free_blocks) {
-        return NULL;
-    }
-
-    vmm_free_blocks_t *free_blocks = (vmm_free_blocks_t *)kmalloc(sizeof(vmm_free_blocks_t));
-    vmm_free_blocks_t *prev = NULL;
-
-    vmm_free_blocks_t *current = free_blocks;
-    while (orig_free_blocks) {
-        if (prev) {
-            prev->next = current;
-        }
+vmm_context_t
+vmm_new_context() {
+    vmm_context_t vmm_context = create_empty_ctx();
 
-        prev = current;
+    // The kernel addresses are tracked by KERNEL_VMM_CONTEXT.
+    add_free_blocks(&vmm_context, 0, KERNEL_MEMINFO.higher_half_base / PAGE_SIZE);
 
-        *current = (vmm_free_blocks_t) {
-            .virtual_addr = orig_free_blocks->virtual_addr,
-            .page_count = orig_free_blocks->page_count,
-            .next = NULL,
-        };
+    return vmm_context;
+}
 
-        current = (vmm_free_blocks_t *)kmalloc(sizeof(vmm_free_blocks_t));
-        orig_free_blocks = orig_free_blocks->next;
+// Return the context that tracks virtual_addr: the kernel's part of the
+// address space is tracked by KERNEL_VMM_CONTEXT.
+static vmm_context_t *
+context_for_addr(vmm_context_t *vmm_context, uint32_t virtual_addr) {
+    if (virtual_addr >= KERNEL_MEMINFO.higher_half_base) {
+        return &KERNEL_VMM_CONTEXT;
     }
 
-    return free_blocks;
+    return vmm_context;
 }
 
-void
-clone_allocation_tree(vmm_allocation_tree_t *orig_allocations, vmm_allocation_tree_t *allocations) {
-    if (orig_allocations) {
-        allocations->alloc = orig_allocations->alloc;
-
-        if (orig_allocations->left) {
-            allocations->left = (vmm_allocation_tree_t *)kmalloc(sizeof(vmm_allocation_tree_t));
-            allocations->left->parent = allocations;
-            clone_allocation_tree(orig_allocations->left, allocations->left);
-        }
+static avl_node_t *
+copy_free_block(avl_node_t *node) {
+    vmm_free_blocks_t *block = kmem_cache_alloc(FREE_BLOCKS_CACHE);
 
-        if (orig_allocations->right) {
-            allocations->right = (vmm_allocation_tree_t *)kmalloc(sizeof(vmm_allocation_tree_t));
-            allocations->right->parent = allocations;
-            clone_allocation_tree(orig_allocations->right, allocations->right);
-        }
-    }
-}
+    *block = *FREE_BLOCK(node);
 
-vmm_allocation_tree_t *
-clone_allocations(vmm_allocation_tree_t *orig_allocations) {
-    if (!orig_allocations) {
-        return NULL;
-    }
+    return &block->node;
+}
 
-    vmm_allocation_tree_t *allocations = (vmm_allocation_tree_t *)kmalloc(sizeof(
-            vmm_allocation_tree_t));
+static avl_node_t *
+copy_allocation(avl_node_t *node) {
+    vmm_allocation_tree_t *allocation = kmem_cache_alloc(ALLOCATION_TREE_CACHE);
 
-    clone_allocation_tree(orig_allocations, allocations);
+    *allocation = *ALLOCATION(node);
 
-    return allocations;
+    return &allocation->node;
 }
 
+static void update_free_block(avl_node_t *node);
+
+static const avl_ops_t FREE_BLOCKS_OPS = {
+    .copy = copy_free_block,
+    .update = update_free_block,
+};
+
+static const avl_ops_t ALLOCATION_TREE_OPS = {
+    .copy = copy_allocation,
+    .update = NULL,
+};
+
 vmm_context_t
 vmm_clone_context(vmm_context_t orig_vmm_context) {
+    // The trees are shared until one of the contexts changes them.
     return (vmm_context_t) {
-        .free_blocks = clone_free_blocks(orig_vmm_context.free_blocks),
-        .allocations = clone_allocations(orig_vmm_context.allocations)
+        .free_blocks = avl_share(orig_vmm_context.free_blocks),
+        .allocations = avl_share(orig_vmm_context.allocations),
+        .last_hit = { 0 },
     };
 }
 
@@ -190,86 +215,233 @@ vmm_map_pages(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t physic
     ASSERT(paging_is_aligned(virtual_addr), "cannot map unaligned address: %#x", virtual_addr);
     ASSERT(paging_is_aligned(physical_addr), "cannot map to unaligned address: %#x", physical_addr);
 
+    // The kernel addresses (and the kernel pages the caller doesn't care about
+    // the address of) are tracked by KERNEL_VMM_CONTEXT.
+    if (virtual_addr ? virtual_addr >= KERNEL_MEMINFO.higher_half_base : !is_userspace) {
+        vmm_context = &KERNEL_VMM_CONTEXT;
+    }
+
     if (!vmm_context->free_blocks) {
         // XXX handle this more gracefully
         PANIC("Out of memory");
     }
 
     uint32_t addr = remove_free_blocks(vmm_context, virtual_addr, page_count, is_userspace);
-    add_allocation(vmm_context, addr, physical_addr, page_count, flags);
+    add_allocation(vmm_context, (vmm_allocation_t) {
+        .virtual_addr = addr,
+        .physical_addr = physical_addr,
+        .page_count = page_count,
+        .flags = flags,
+        .file = { 0 },
+    });
 
     return (void *)addr;
 }
 
+uint32_t
+vmm_find_user_range(vmm_context_t *vmm_context, uint32_t page_count, uint32_t align) {
+    ASSERT(align >= PAGE_SIZE && !(align & (align - 1)), "invalid alignment: %#x", align);
+
+    uint64_t min_addr = USER_MIN_ADDR;
+    uint64_t max_addr = KERNEL_MEMINFO.higher_half_base;
+    uint64_t size = (uint64_t)page_count * PAGE_SIZE;
+
+    // first_fit doesn't know about the alignment, so skip the blocks that
+    // only fit the range unaligned.
+    while (page_count && min_addr < max_addr) {
+        vmm_free_blocks_t *block = first_fit(vmm_context->free_blocks, page_count, min_addr,
+                                             max_addr);
+
+        if (!block) {
+            break;
+        }
+
+        uint64_t start = block->virtual_addr > min_addr ? block->virtual_addr : min_addr;
+        uint64_t end = block_end(block) < max_addr ? block_end(block) : max_addr;
+
+        start = (start + align - 1) & ~((uint64_t)align - 1);
+
+        if (start + size <= end) {
+            return start;
+        }
+
+        min_addr = block_end(block);
+    }
+
+    return 0;
+}
+
+void
+vmm_map_file(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t page_count,
+             uint32_t flags, vmm_file_t file) {
+    ASSERT(paging_is_aligned(virtual_addr), "cannot map unaligned address: %#x", virtual_addr);
+    ASSERT(virtual_addr < KERNEL_MEMINFO.higher_half_base && (flags & PAGE_FLAG_USER),
+           "cannot map file at kernel address %#x", virtual_addr);
+    ASSERT(file.virtual_addr >= virtual_addr
+           && file.virtual_addr - virtual_addr + file.size <= page_count * PAGE_SIZE,
+           "file mapping %#x-%#x out of bounds", file.virtual_addr,
+           file.virtual_addr + file.size);
+
+    remove_free_blocks(vmm_context, virtual_addr, page_count, true);
+    add_allocation(vmm_context, (vmm_allocation_t) {
+        .virtual_addr = virtual_addr,
+        .physical_addr = 0,
+        .page_count = page_count,
+        .flags = flags,
+        .file = file,
+    });
+}
+
+vmm_allocation_t
+vmm_grow_down(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t new_virtual_addr) {
+    ASSERT(paging_is_aligned(new_virtual_addr) && new_virtual_addr < virtual_addr
+           && virtual_addr < KERNEL_MEMINFO.higher_half_base,
+           "cannot grow allocation at %#x down to %#x", virtual_addr, new_virtual_addr);
+
+    uint32_t page_count = (virtual_addr - new_virtual_addr) / PAGE_SIZE;
+
+    remove_free_blocks(vmm_context, new_virtual_addr, page_count, true);
+
+    avl_path_t path;
+    vmm_allocation_tree_t *allocation = find_allocation_path(vmm_context, virtual_addr, &path);
+
+    ASSERT(allocation && allocation->alloc.virtual_addr == virtual_addr
+           && !allocation->alloc.physical_addr && !allocation->alloc.file.data,
+           "no anonymous allocation at %#x", virtual_addr);
+
+    vmm_context->last_hit = (vmm_allocation_t) {
+        0
+    };
+
+    // The pages in between were free, so the order of the allocations doesn't
+    // change.
+    allocation->alloc.virtual_addr = new_virtual_addr;
+    allocation->alloc.page_count += page_count;
+
+    return allocation->alloc;
+}
+
 void
 vmm_unmap_pages(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t page_count) {
     ASSERT(paging_is_aligned(virtual_addr), "cannot unmap unaligned address: %#x", virtual_addr);
 
+    vmm_context = context_for_addr(vmm_context, virtual_addr);
+
     // Update vmm_context->free_blocks
     add_free_blocks(vmm_context, virtual_addr, page_count);
 
     // Update vmm_context->allocations
-    vmm_allocation_tree_t *allocations = vmm_context->allocations;
+    avl_path_t path;
+    vmm_allocation_tree_t *allocation = find_allocation_path(vmm_context, virtual_addr, &path);
 
-    while (allocations) {
-        if (virtual_addr == allocations->alloc.virtual_addr) {
-            if (page_count < allocations->alloc.virtual_addr) {
-                // Shift the allocation
-                allocations->alloc.virtual_addr += PAGE_SIZE * page_count;
-                allocations->alloc.page_count -= page_count;
-            } else if (page_count == allocations->alloc.virtual_addr) {
-                // Delete the node altogether
-                remove_allocation(vmm_context, allocations);
-            } else {
-                PANIC("cannot unamp more than has been mapped");
-            }
-
-            return;
-        } else if (virtual_addr < allocations->alloc.virtual_addr) {
-            allocations = allocations->left;
-        } else {
-            allocations = allocations->right;
-        }
+    if (!allocation || allocation->alloc.virtual_addr != virtual_addr) {
+        PANIC("allocation to unmap not found in allocation tree");
     }
 
-    PANIC("allocation to unmap not found in allocation tree");
+    // The allocation is about to change, so it mustn't be returned from the
+    // cache anymore.
+    vmm_context->last_hit = (vmm_allocation_t) {
+        0
+    };
+
+    if (page_count < allocation->alloc.page_count) {
+        // Shift the allocation
+        allocation->alloc.virtual_addr += PAGE_SIZE * page_count;
+        if (allocation->alloc.physical_addr) {
+            allocation->alloc.physical_addr += PAGE_SIZE * page_count;
+        }
+        allocation->alloc.page_count -= page_count;
+    } else if (page_count == allocation->alloc.page_count) {
+        // Delete the node altogether
+        avl_path_remove(&path, &ALLOCATION_TREE_OPS);
+        kmem_cache_free(ALLOCATION_TREE_CACHE, allocation);
+    } else {
+        PANIC("cannot unamp more than has been mapped");
+    }
 }
 
 vmm_allocation_t
 vmm_find_allocation(vmm_context_t *vmm_context, uint32_t virtual_addr) {
-    vmm_allocation_tree_t *allocations = vmm_context->allocations;
+    vmm_context = context_for_addr(vmm_context, virtual_addr);
+
+    // Page faults tend to come in runs (e.g. when a stack or a segment is
+    // first touched), so the allocation found last is likely the one needed.
+    vmm_allocation_t *last_hit = &vmm_context->last_hit;
+    if (virtual_addr >= last_hit->virtual_addr
+            && virtual_addr - last_hit->virtual_addr < last_hit->page_count * PAGE_SIZE) {
+        return *last_hit;
+    }
 
-    while (allocations) {
-        uint32_t current_block = allocations->alloc.virtual_addr;
-        uint32_t page_count = allocations->alloc.page_count;
-        if (virtual_addr >= current_block
-                && virtual_addr < current_block + page_count * PAGE_SIZE) {
-            return allocations->alloc;
-        } else if (virtual_addr < current_block) {
-            allocations = allocations->left;
-        } else {
-            allocations = allocations->right;
+    vmm_allocation_tree_t *allocation = find_allocation(vmm_context->allocations, virtual_addr);
+
+    if (!allocation) {
+        // Not in tree:
+        return (vmm_allocation_t) {
+            0
+        };
+    }
+
+    *last_hit = allocation->alloc;
+
+    return allocation->alloc;
+}
+
+bool
+vmm_is_user_range(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t size,
+                  uint32_t flags) {
+    uint64_t end = (uint64_t)virtual_addr + size;
+
+    if (end > KERNEL_MEMINFO.higher_half_base) {
+        return false;
+    }
+
+    flags |= PAGE_FLAG_PRESENT | PAGE_FLAG_USER;
+
+    // The range might span several (adjacent) allocations.
+    while (virtual_addr < end) {
+        vmm_allocation_t alloc = vmm_find_allocation(vmm_context, virtual_addr);
+
+        if (!alloc.page_count || (alloc.flags & flags) != flags) {
+            return false;
         }
+
+        virtual_addr = alloc.virtual_addr + alloc.page_count * PAGE_SIZE;
     }
-    // Not in tree:
-    return (vmm_allocation_t) {
-        0
-    };
+
+    return true;
+}
+
+// Allocate a page directory, and map it at a kernel address. Returns its
+// physical address.
+static uint32_t
+alloc_page_directory(vmm_context_t *vmm_ctx, paging_context_t paging_ctx,
+                     page_directory_t **page_directory) {
+    uint32_t physical_addr = (uint32_t)pmm_alloc_pages(PAGING_DIRECTORY_ORDER);
+    *page_directory = (page_directory_t *)vmm_map_pages(vmm_ctx, 0, physical_addr,
+                      PAGING_DIRECTORY_PAGES,
+                      PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL);
+
+    // The page directory must be accessible from every context.
+    paging_map_range(paging_ctx, (uint32_t)*page_directory, physical_addr, PAGING_DIRECTORY_PAGES,
+                     PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL);
+
+    return physical_addr;
 }
 
 paging_context_t
 vmm_clone_paging_context(vmm_context_t *vmm_ctx, paging_context_t paging_ctx) {
-    uint32_t physical_addr = (uint32_t)pmm_alloc_page();
-    page_table_t *page_directory = (page_table_t *)vmm_map_pages(vmm_ctx, 0, physical_addr, 1,
-                                   PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
-    memcpy(page_directory, paging_ctx.page_directory, sizeof(page_table_t));
+    page_directory_t *page_directory;
+    uint32_t physical_addr = alloc_page_directory(vmm_ctx, paging_ctx, &page_directory);
+
+    return paging_clone_kernel_context(page_directory, physical_addr);
+}
 
-    page_directory->entries[PAGE_TABLE_SIZE - 1] = physical_addr | PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE;
+paging_context_t
+vmm_fork_paging_context(vmm_context_t *vmm_ctx, paging_context_t paging_ctx) {
+    page_directory_t *page_directory;
+    uint32_t physical_addr = alloc_page_directory(vmm_ctx, paging_ctx, &page_directory);
 
-    return (paging_context_t) {
-        .page_directory = page_directory,
-        .page_tables = paging_ctx.page_tables,
-    };
+    return paging_fork_context(paging_ctx, page_directory, physical_addr);
 }
 
 inline uint32_t
@@ -284,294 +456,315 @@ vmm_physical_to_virtual(uint32_t addr) {
     return addr + KERNEL_MEMINFO.higher_half_base;
 }
 
-static void
-remove_allocation(vmm_context_t *vmm_context, vmm_allocation_tree_t *allocation) {
-    if (allocation->parent) {
-        if (allocation->parent->left == allocation) {
-            allocation->parent->left = allocation->left;
-        } else {
-            allocation->parent->right = allocation->left;
-        }
-    } else {
-        // Remove the root
-        vmm_context->allocations = allocation->left;
-    }
-
-    vmm_allocation_tree_t *node = allocation->left;
-    while (node->right) {
-        node = node->right;
-    }
-    node->right = allocation->right;
-
-    kfree(allocation);
-}
+void
+vmm_memstat(vmm_context_t *vmm_context, memstat_t *stat) {
+    vmm_context_t *contexts[] = { vmm_context, &KERNEL_VMM_CONTEXT };
 
-static void
-add_allocation(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t physical_addr,
-               uint32_t page_count, uint32_t flags) {
-    vmm_allocation_tree_t *allocations = vmm_context->allocations;
-
-    // Empty allocations tree
-    if (!allocations->alloc.page_count) {
-        allocations->alloc = (vmm_allocation_t) {
-            virtual_addr = virtual_addr,
-            physical_addr = physical_addr,
-            page_count = page_count,
-            flags = flags,
-        };
+    stat->vmm_allocations = 0;
+    stat->vmm_free_blocks = 0;
 
-        return;
+    for (size_t i = 0; i < sizeof(contexts) / sizeof(contexts[0]); ++i) {
+        stat->vmm_allocations += avl_count(contexts[i]->allocations);
+        stat->vmm_free_blocks += avl_count(contexts[i]->free_blocks);
     }
+}
 
-    vmm_allocation_tree_t *prev = NULL;
+// Return the node of the allocation that contains virtual_addr (or NULL if
+// there isn't one).
+static vmm_allocation_tree_t *
+find_allocation(avl_node_t *allocations, uint32_t virtual_addr) {
     while (allocations) {
-        prev = allocations;
-        if (virtual_addr < allocations->alloc.virtual_addr) {
+        vmm_allocation_t *alloc = &ALLOCATION(allocations)->alloc;
+
+        if (virtual_addr >= alloc->virtual_addr
+                && virtual_addr - alloc->virtual_addr < alloc->page_count * PAGE_SIZE) {
+            return ALLOCATION(allocations);
+        } else if (virtual_addr < alloc->virtual_addr) {
             allocations = allocations->left;
         } else {
             allocations = allocations->right;
         }
     }
 
-    if (!prev) {
-        PANIC("out of memory");
-    }
+    return NULL;
+}
 
-    vmm_allocation_tree_t *new_node = (vmm_allocation_tree_t *)kmalloc(sizeof(vmm_allocation_tree_t));
-    vmm_allocation_t alloc = (vmm_allocation_t) {
-        .virtual_addr = virtual_addr,
-        .physical_addr = physical_addr,
-        .page_count = page_count,
-        .flags = flags,
-    };
-    *new_node = (vmm_allocation_tree_t) {
-        .alloc = alloc,
-        .left = NULL,
-        .right = NULL,
-    };
+// Like find_allocation, but also return the path to the allocation, whose
+// nodes are made private to this context (so the allocation can be changed).
+static vmm_allocation_tree_t *
+find_allocation_path(vmm_context_t *vmm_context, uint32_t virtual_addr, avl_path_t *path) {
+    avl_node_t *node;
 
-    new_node->parent = prev;
-    if (virtual_addr < prev->alloc.virtual_addr) {
-        prev->left = new_node;
-    } else {
-        prev->right = new_node;
+    avl_path_init(path, &vmm_context->allocations);
+
+    while ((node = avl_path_node(path, &ALLOCATION_TREE_OPS))) {
+        vmm_allocation_t *alloc = &ALLOCATION(node)->alloc;
+
+        if (virtual_addr >= alloc->virtual_addr
+                && virtual_addr - alloc->virtual_addr < alloc->page_count * PAGE_SIZE) {
+            return ALLOCATION(node);
+        }
+
+        avl_path_push(path, virtual_addr < alloc->virtual_addr ? &node->left : &node->right);
     }
+
+    return NULL;
 }
 
-static bool
-is_addr_in_range(uint32_t virtual_addr, vmm_free_blocks_t *free_blocks) {
-    uint64_t range_end = free_blocks->virtual_addr + (uint64_t)free_blocks->page_count * PAGE_SIZE;
+static void
+add_allocation(vmm_context_t *vmm_context, vmm_allocation_t alloc) {
+    avl_path_t path;
+    avl_node_t *node;
 
-    return virtual_addr >= free_blocks->virtual_addr && virtual_addr < range_end;
-}
+    avl_path_init(&path, &vmm_context->allocations);
 
-static bool
-is_addr_in_user_range(uint32_t virtual_addr, uint32_t page_count) {
-    uint64_t range_end = virtual_addr + (uint64_t)page_count * PAGE_SIZE;
+    while ((node = avl_path_node(&path, &ALLOCATION_TREE_OPS))) {
+        bool left = alloc.virtual_addr < ALLOCATION(node)->alloc.virtual_addr;
+        avl_path_push(&path, left ? &node->left : &node->right);
+    }
 
-    return range_end < KERNEL_MEMINFO.higher_half_base;
+    vmm_allocation_tree_t *new_node = kmem_cache_alloc(ALLOCATION_TREE_CACHE);
+    new_node->alloc = alloc;
+
+    avl_path_insert(&path, &new_node->node, &ALLOCATION_TREE_OPS);
 }
 
-static bool
-is_addr_ok_for_mode(uint32_t virtual_addr, uint32_t page_count, bool is_userspace) {
-    if (is_userspace) {
-        return is_addr_in_user_range(virtual_addr, page_count);
-    } else {
-        return virtual_addr >= KERNEL_MEMINFO.virtual_start;
-    }
+// The end of the free block (which may be 2^32).
+static uint64_t
+block_end(vmm_free_blocks_t *block) {
+    return block->virtual_addr + (uint64_t)block->page_count * PAGE_SIZE;
 }
 
+// Keep max_page_count up to date (see avl_update_t).
 static void
-unlink_block(vmm_context_t *vmm_context, vmm_free_blocks_t *free_blocks, vmm_free_blocks_t *prev) {
-    if (prev) {
-        prev->next = free_blocks->next;
-    } else {
-        vmm_context->free_blocks = free_blocks->next;
+update_free_block(avl_node_t *node) {
+    vmm_free_blocks_t *block = FREE_BLOCK(node);
+    uint32_t max_page_count = block->page_count;
+
+    if (node->left && FREE_BLOCK(node->left)->max_page_count > max_page_count) {
+        max_page_count = FREE_BLOCK(node->left)->max_page_count;
     }
-    kfree(free_blocks);
+
+    if (node->right && FREE_BLOCK(node->right)->max_page_count > max_page_count) {
+        max_page_count = FREE_BLOCK(node->right)->max_page_count;
+    }
+
+    block->max_page_count = max_page_count;
 }
 
-static uint32_t
-remove_free_blocks(vmm_context_t *vmm_context, uint32_t virtual_addr,
-                   uint32_t page_count, bool is_userspace) {
-    ASSERT(vmm_context->free_blocks, "out of memory (no free blocks)");
+// Check whether the part of the free block that lies in [min_addr, max_addr)
+// is at least page_count pages long.
+static bool
+block_fits(vmm_free_blocks_t *block, uint32_t page_count, uint32_t min_addr, uint64_t max_addr) {
+    uint64_t start = block->virtual_addr > min_addr ? block->virtual_addr : min_addr;
+    uint64_t end = block_end(block) < max_addr ? block_end(block) : max_addr;
 
-    vmm_free_blocks_t *free_blocks = vmm_context->free_blocks;
-    vmm_free_blocks_t *prev = NULL;
+    return end > start && (end - start) / PAGE_SIZE >= page_count;
+}
 
-    while (free_blocks) {
-        // If the caller didn't request a specific address, check if the current
-        // address is acceptable given the current access ring.
-        bool select_current_addr = !virtual_addr
-                                   && is_addr_ok_for_mode(free_blocks->virtual_addr, page_count, is_userspace);
-
-        // Alternatively, if the caller requested a _specific_ virtual address, try to find it.
-        if (select_current_addr || is_addr_in_range(virtual_addr, free_blocks)) {
-            if (free_blocks->page_count >= page_count) {
-                break;
-            }
+// Return the lowest free block that has page_count free pages in
+// [min_addr, max_addr) (or NULL if there isn't one).
+//
+// The subtrees that don't have a large enough block (see max_page_count) or
+// that are outside the range are skipped, so this only visits O(log n) nodes.
+static vmm_free_blocks_t *
+first_fit(avl_node_t *free_blocks, uint32_t page_count, uint32_t min_addr, uint64_t max_addr) {
+    if (!free_blocks || FREE_BLOCK(free_blocks)->max_page_count < page_count) {
+        return NULL;
+    }
+
+    vmm_free_blocks_t *block = FREE_BLOCK(free_blocks);
+
+    if (block->virtual_addr > min_addr) {
+        vmm_free_blocks_t *left = first_fit(free_blocks->left, page_count, min_addr, max_addr);
+
+        if (left) {
+            return left;
         }
+    }
 
-        prev = free_blocks;
-        free_blocks = free_blocks->next;
+    if (block_fits(block, page_count, min_addr, max_addr)) {
+        return block;
     }
 
-    if (!free_blocks) {
-        PANIC("could not find %u consecutive free pages starting at %#x", page_count, virtual_addr);
+    if (block_end(block) < max_addr) {
+        return first_fit(free_blocks->right, page_count, min_addr, max_addr);
     }
 
-    // Maybe the requested allocation fits perfectly in `free_blocks`.
-    if (free_blocks->page_count == page_count) {
-        unlink_block(vmm_context, free_blocks, prev);
-    } else if (free_blocks->page_count > page_count) {
-        // The requested virtual address is `page_offset` pages into the free
-        // region.
-        uint32_t page_offset = virtual_addr ? (virtual_addr - free_blocks->virtual_addr) / PAGE_SIZE : 0;
-
-        // Are there enough free pages to satisfy the request?
-        if (page_count > free_blocks->page_count - page_offset) {
-            PANIC("out of memory");
-        }
+    return NULL;
+}
+
+// Return the free block that contains virtual_addr (or NULL if the address
+// isn't free), and the path to it. The nodes on the path are made private to
+// this context (so the block can be changed).
+static vmm_free_blocks_t *
+find_free_block_path(vmm_context_t *vmm_context, uint32_t virtual_addr, avl_path_t *path) {
+    avl_node_t *node;
 
-        if (!virtual_addr || virtual_addr == free_blocks->virtual_addr) {
-            uint32_t allocated_addr = free_blocks->virtual_addr;
-            // The allocation is at the very beginning of the free region.
-            free_blocks->virtual_addr += page_count * PAGE_SIZE;
-            free_blocks->page_count -= page_count;
+    avl_path_init(path, &vmm_context->free_blocks);
 
-            return allocated_addr;
+    while ((node = avl_path_node(path, &FREE_BLOCKS_OPS))) {
+        vmm_free_blocks_t *block = FREE_BLOCK(node);
+
+        if (virtual_addr < block->virtual_addr) {
+            avl_path_push(path, &node->left);
+        } else if (virtual_addr >= block_end(block)) {
+            avl_path_push(path, &node->right);
         } else {
-            uint32_t new_block_page_offset = page_offset + page_count;
-
-            // Is the requested virtual address somewhere in the middle of the
-            // free region rather than at its beginning/end?
-            if (new_block_page_offset < free_blocks->page_count) {
-                vmm_free_blocks_t *new_block = (vmm_free_blocks_t *)kmalloc(sizeof(vmm_free_blocks_t));
-                *new_block = (vmm_free_blocks_t) {
-                    // The remaining free region immediately follows the
-                    // one starting at `virtual_addr`.
-                    .virtual_addr = free_blocks->virtual_addr + new_block_page_offset * PAGE_SIZE,
-                    .page_count = free_blocks->page_count - new_block_page_offset,
-                    .next = free_blocks->next,
-                };
-                free_blocks->next = new_block;
-                free_blocks->page_count = page_offset;
-            } else {
-                // ..no, it's at the end of the region:
-                free_blocks->page_count -= page_count;
-            }
+            return block;
         }
     }
 
-    return virtual_addr;
+    return NULL;
 }
 
 static void
-merge_or_insert_free_blocks(vmm_free_blocks_t *free_blocks, uint32_t virtual_addr,
-                            uint32_t page_count) {
-    bool blocks_merged = false;
-    if (free_blocks) {
-        bool is_userspace_block = is_addr_in_user_range(free_blocks->virtual_addr, free_blocks->page_count);
-        bool is_userspace_addr = is_addr_in_user_range(virtual_addr, page_count);
-
-        // Don't merge the userspace ranges with the kernel ones.
-        if (!(is_userspace_block ^ is_userspace_addr)) {
-            goto done;
-        }
+insert_free_block(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t page_count) {
+    avl_path_t path;
+    avl_node_t *node;
 
-        // Merge the existing free blocks with the newly freed block if they
-        // form a contiguous block.
-        if (free_blocks->virtual_addr + page_count * PAGE_SIZE == virtual_addr) {
-            free_blocks->page_count += page_count;
-            blocks_merged = true;
-        }
+    avl_path_init(&path, &vmm_context->free_blocks);
+
+    while ((node = avl_path_node(&path, &FREE_BLOCKS_OPS))) {
+        bool left = virtual_addr < FREE_BLOCK(node)->virtual_addr;
+        avl_path_push(&path, left ? &node->left : &node->right);
+    }
+
+    vmm_free_blocks_t *block = kmem_cache_alloc(FREE_BLOCKS_CACHE);
+    block->virtual_addr = virtual_addr;
+    block->page_count = page_count;
+
+    avl_path_insert(&path, &block->node, &FREE_BLOCKS_OPS);
+}
+
+// Remove the block that contains virtual_addr.
+static void
+remove_free_block(vmm_context_t *vmm_context, uint32_t virtual_addr) {
+    avl_path_t path;
+    vmm_free_blocks_t *block = find_free_block_path(vmm_context, virtual_addr, &path);
+
+    avl_path_remove(&path, &FREE_BLOCKS_OPS);
+    kmem_cache_free(FREE_BLOCKS_CACHE, block);
+}
 
-        if (free_blocks->next) {
-            uint32_t next_free_addr = free_blocks->next->virtual_addr;
+static uint32_t
+remove_free_blocks(vmm_context_t *vmm_context, uint32_t virtual_addr,
+                   uint32_t page_count, bool is_userspace) {
+    ASSERT(vmm_context->free_blocks, "out of memory (no free blocks)");
+
+    if (!virtual_addr) {
+        // The caller didn't request a specific address, so pick the lowest
+        // one that is acceptable given the current access ring.
+        uint32_t min_addr = is_userspace ? 0 : KERNEL_MEMINFO.virtual_start;
+        uint64_t max_addr = is_userspace ? KERNEL_MEMINFO.higher_half_base : (uint64_t)1 << 32;
+        vmm_free_blocks_t *block = first_fit(vmm_context->free_blocks, page_count, min_addr,
+                                             max_addr);
 
-            if (free_blocks->virtual_addr + page_count * PAGE_SIZE == next_free_addr) {
-                free_blocks->page_count += free_blocks->next->page_count;
-                vmm_free_blocks_t *next = free_blocks->next;
-                free_blocks->next = free_blocks->next->next;
-                kfree(next);
-                blocks_merged = true;
-            }
+        if (!block) {
+            PANIC("could not find %u consecutive free pages", page_count);
         }
+
+        virtual_addr = block->virtual_addr > min_addr ? block->virtual_addr : min_addr;
     }
 
-done:
-    if (!blocks_merged) {
-        vmm_free_blocks_t *new_block = (vmm_free_blocks_t *)kmalloc(sizeof(vmm_free_blocks_t));
-        vmm_free_blocks_t *next = free_blocks ? free_blocks->next : NULL;
-        *new_block = (vmm_free_blocks_t) {
-            .virtual_addr = virtual_addr,
-            .page_count = page_count,
-            .next = next,
-        };
+    avl_path_t path;
+    vmm_free_blocks_t *block = find_free_block_path(vmm_context, virtual_addr, &path);
+    uint64_t end = virtual_addr + (uint64_t)page_count * PAGE_SIZE;
 
-        if (free_blocks) {
-            free_blocks->next = new_block;
-        } else {
-            free_blocks = new_block;
+    if (!block || end > block_end(block)) {
+        PANIC("could not find %u consecutive free pages starting at %#x", page_count,
+              virtual_addr);
+    }
+
+    uint64_t old_block_end = block_end(block);
+
+    if (virtual_addr == block->virtual_addr && end == old_block_end) {
+        // The allocation fits the free block perfectly.
+        avl_path_remove(&path, &FREE_BLOCKS_OPS);
+        kmem_cache_free(FREE_BLOCKS_CACHE, block);
+    } else if (virtual_addr == block->virtual_addr) {
+        // The allocation is at the very beginning of the free block (which
+        // doesn't change the order of the blocks).
+        block->virtual_addr = end;
+        block->page_count -= page_count;
+        avl_path_update(&path, &FREE_BLOCKS_OPS);
+    } else {
+        // The part of the block before the allocation stays where it is, and
+        // the part after it (if any) becomes a new block.
+        block->page_count = (virtual_addr - block->virtual_addr) / PAGE_SIZE;
+        avl_path_update(&path, &FREE_BLOCKS_OPS);
+
+        if (end < old_block_end) {
+            insert_free_block(vmm_context, end, (old_block_end - end) / PAGE_SIZE);
         }
     }
+
+    return virtual_addr;
+}
+
+// Check whether the two addresses are on the same side of the user/kernel
+// boundary (the free blocks of the two never get merged).
+static bool
+is_same_half(uint32_t addr1, uint32_t addr2) {
+    return (addr1 >= KERNEL_MEMINFO.higher_half_base) == (addr2 >= KERNEL_MEMINFO.higher_half_base);
 }
 
 static void
 add_free_blocks(vmm_context_t *vmm_context, uint32_t virtual_addr, uint32_t page_count) {
-    vmm_free_blocks_t *free_blocks = vmm_context->free_blocks;
+    // Find the free blocks right before and right after the freed range.
+    avl_node_t *free_blocks = vmm_context->free_blocks;
     vmm_free_blocks_t *prev = NULL;
+    vmm_free_blocks_t *next = NULL;
 
-    while (free_blocks && virtual_addr > free_blocks->virtual_addr) {
-        prev = free_blocks;
-        free_blocks = free_blocks->next;
-    }
+    while (free_blocks) {
+        vmm_free_blocks_t *block = FREE_BLOCK(free_blocks);
 
-    if (free_blocks) {
-        if (prev) {
-            merge_or_insert_free_blocks(prev, virtual_addr, page_count);
+        if (block->virtual_addr < virtual_addr) {
+            prev = block;
+            free_blocks = free_blocks->right;
         } else {
-            if (virtual_addr + page_count * PAGE_SIZE == free_blocks->virtual_addr) {
-                // Merge the existing free blocks with the newly freed block if they
-                // form a contiguous block.
-                free_blocks->page_count += page_count;
-            } else {
-                // The new block is the new head of the list
-                vmm_context->free_blocks = (vmm_free_blocks_t *)kmalloc(sizeof(vmm_free_blocks_t));
-                *vmm_context->free_blocks = (vmm_free_blocks_t) {
-                    .virtual_addr = virtual_addr,
-                    .page_count = page_count,
-                    .next = free_blocks,
-                };
-            }
+            next = block;
+            free_blocks = free_blocks->left;
         }
+    }
+
+    uint64_t end = virtual_addr + (uint64_t)page_count * PAGE_SIZE;
+
+    ASSERT((!prev || block_end(prev) <= virtual_addr) && (!next || end <= next->virtual_addr),
+           "%u pages starting at %#x are already free", page_count, virtual_addr);
+
+    // Merge the newly freed range with its neighbours if they form a
+    // contiguous block.
+    bool merge_prev = prev && block_end(prev) == virtual_addr
+                      && is_same_half(prev->virtual_addr, virtual_addr);
+    bool merge_next = next && end == next->virtual_addr
+                      && is_same_half(virtual_addr, next->virtual_addr);
+
+    // The blocks found above might be shared with other contexts, so they are
+    // looked up again (and copied if needed) before they are changed.
+    uint32_t prev_addr = prev ? prev->virtual_addr : 0;
+
+    if (merge_next) {
+        page_count += next->page_count;
+        remove_free_block(vmm_context, next->virtual_addr);
+    }
+
+    if (merge_prev) {
+        avl_path_t path;
+
+        prev = find_free_block_path(vmm_context, prev_addr, &path);
+        prev->page_count += page_count;
+        avl_path_update(&path, &FREE_BLOCKS_OPS);
     } else {
-        // virtual_addr is greater than any of the other free addresses.
-        if (prev) {
-            merge_or_insert_free_blocks(prev, virtual_addr, page_count);
-        } else {
-            // vmm_context->free_blocks must've been NULL to begin with
-            vmm_context->free_blocks = (vmm_free_blocks_t *)kmalloc(sizeof(vmm_free_blocks_t));
-            *vmm_context->free_blocks = (vmm_free_blocks_t) {
-                .virtual_addr = virtual_addr,
-                .page_count = page_count,
-                .next = NULL,
-            };
-        }
+        insert_free_block(vmm_context, virtual_addr, page_count);
     }
 }
 
 static vmm_context_t
 create_empty_ctx() {
-    vmm_context_t vmm_context;
-
-    vmm_context.allocations = (vmm_allocation_tree_t *)kmalloc(sizeof(vmm_allocation_tree_t));
-    *vmm_context.allocations = (vmm_allocation_tree_t) {
-        .alloc = { 0 },
-        .left = NULL,
-        .right = NULL,
+    return (vmm_context_t) {
+        .allocations = NULL,
+        .free_blocks = NULL,
+        .last_hit = { 0 },
     };
-    vmm_context.free_blocks = NULL;
-
-    return vmm_context;
 }
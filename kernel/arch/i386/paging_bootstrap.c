@@ -6,20 +6,27 @@
 #include <mm/vmm.h>
 #include <mm/meminfo.h>
 
-// 4 MB pages
-#define KERNEL_PAGE_SIZE (1 << 22)
+// 4 MB pages (2 MB with PAE)
+#define KERNEL_PAGE_SIZE LARGE_PAGE_SIZE
 
 // The page directory of the kernel.
 //
 // NOTE: The kernel initially uses 4 MB pages, so we only really need to use 256
 // out of the 1024 available entries (256 * 4MB = 1GB)
-static page_table_t __attribute__((section(".data.paging_bootstrap")))
+static page_directory_t __attribute__((section(".data.paging_bootstrap")))
 KERNEL_PAGE_DIRECTORY;
 
+#ifdef CONFIG_PAE
+// The page directory pointer table of the kernel (which is what CR3 points to
+// with PAE).
+static paging_pdpt_t __attribute__((section(".data.paging_bootstrap")))
+KERNEL_PDPT;
+#endif
+
 uint32_t
 __attribute__((section(".text.paging_bootstrap")))
 paging_bootstrap(kernel_meminfo_t meminfo) {
-    for (size_t i = 0; i < PAGE_TABLE_SIZE; ++i) {
+    for (size_t i = 0; i < PAGE_DIRECTORY_SIZE; ++i) {
         KERNEL_PAGE_DIRECTORY.entries[i] = 0;
     }
 
@@ -27,12 +34,23 @@ paging_bootstrap(kernel_meminfo_t meminfo) {
             ++i) {
         uint32_t virtual_address = meminfo.virtual_start + i * KERNEL_PAGE_SIZE;
         uint32_t physical_address = meminfo.physical_start + i * KERNEL_PAGE_SIZE;
-        uint32_t entry = PAGE_DIRECTORY_INDEX(physical_address) << 22;
+        uint32_t entry = PAGE_DIRECTORY_INDEX(physical_address) << PAGE_DIRECTORY_START;
 
         KERNEL_PAGE_DIRECTORY.entries[PAGE_DIRECTORY_INDEX(virtual_address)] =
             entry | PAGE_FLAG_PRESENT | PAGE_FLAG_PAGE_SIZE | PAGE_FLAG_WRITE;
     }
 
     uint32_t kernel_page_directory = (uint32_t)&KERNEL_PAGE_DIRECTORY;
+
+#ifdef CONFIG_PAE
+    // The other flags of the page directory pointer table entries are
+    // reserved.
+    for (size_t i = 0; i < PAGING_DIRECTORY_PAGES; ++i) {
+        KERNEL_PDPT.entries[i] = (kernel_page_directory + i * PAGE_SIZE) | PAGE_FLAG_PRESENT;
+    }
+
+    return (uint32_t)&KERNEL_PDPT;
+#else
     return kernel_page_directory;
+#endif
 }
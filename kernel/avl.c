@@ -0,0 +1,217 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <avl.h>
+#include <panic.h>
+
+static uint32_t
+node_height(avl_node_t *node) {
+    return node ? node->height : 0;
+}
+
+static int32_t
+balance_factor(avl_node_t *node) {
+    return (int32_t)node_height(node->left) - (int32_t)node_height(node->right);
+}
+
+// Recompute the height of the node (and whatever else ops->update maintains)
+// from its children.
+static void
+update_node(avl_node_t *node, const avl_ops_t *ops) {
+    uint32_t left_height = node_height(node->left);
+    uint32_t right_height = node_height(node->right);
+
+    node->height = 1 + (left_height > right_height ? left_height : right_height);
+
+    if (ops->update) {
+        ops->update(node);
+    }
+}
+
+// Make sure the node `link` points to isn't shared with other trees (by
+// pointing `link` to a copy of it), and return it.
+static avl_node_t *
+unshare(avl_node_t **link, const avl_ops_t *ops) {
+    avl_node_t *node = *link;
+
+    if (!node || node->refcount == 1) {
+        return node;
+    }
+
+    avl_node_t *copy = ops->copy(node);
+    *copy = (avl_node_t) {
+        .left = node->left,
+        .right = node->right,
+        .height = node->height,
+        .refcount = 1,
+    };
+
+    // The children are now shared by the node and its copy.
+    if (copy->left) {
+        copy->left->refcount++;
+    }
+
+    if (copy->right) {
+        copy->right->refcount++;
+    }
+
+    node->refcount--;
+    *link = copy;
+
+    return copy;
+}
+
+// Rotate the subtree `link` points to to the left.
+static void
+rotate_left(avl_node_t **link, const avl_ops_t *ops) {
+    avl_node_t *node = unshare(link, ops);
+    avl_node_t *right = unshare(&node->right, ops);
+
+    node->right = right->left;
+    right->left = node;
+    *link = right;
+
+    update_node(node, ops);
+    update_node(right, ops);
+}
+
+// Rotate the subtree `link` points to to the right.
+static void
+rotate_right(avl_node_t **link, const avl_ops_t *ops) {
+    avl_node_t *node = unshare(link, ops);
+    avl_node_t *left = unshare(&node->left, ops);
+
+    node->left = left->right;
+    left->right = node;
+    *link = left;
+
+    update_node(node, ops);
+    update_node(left, ops);
+}
+
+// Restore the AVL invariant of the subtree `link` points to (whose subtrees
+// are balanced).
+static void
+rebalance_node(avl_node_t **link, const avl_ops_t *ops) {
+    avl_node_t *node = *link;
+
+    update_node(node, ops);
+
+    int32_t balance = balance_factor(node);
+
+    if (balance > 1) {
+        if (balance_factor(node->left) < 0) {
+            rotate_left(&node->left, ops);
+        }
+        rotate_right(link, ops);
+    } else if (balance < -1) {
+        if (balance_factor(node->right) > 0) {
+            rotate_right(&node->right, ops);
+        }
+        rotate_left(link, ops);
+    }
+}
+
+// Rebalance the nodes links[count - 1], ..., links[0] point to.
+static void
+rebalance_path(avl_path_t *path, uint32_t count, const avl_ops_t *ops) {
+    while (count--) {
+        rebalance_node(path->links[count], ops);
+    }
+}
+
+void
+avl_path_init(avl_path_t *path, avl_node_t **root) {
+    path->links[0] = root;
+    path->length = 1;
+}
+
+avl_node_t *
+avl_path_node(avl_path_t *path, const avl_ops_t *ops) {
+    return unshare(path->links[path->length - 1], ops);
+}
+
+void
+avl_path_push(avl_path_t *path, avl_node_t **link) {
+    ASSERT(path->length <= AVL_MAX_HEIGHT, "AVL tree too high");
+
+    path->links[path->length++] = link;
+}
+
+void
+avl_path_insert(avl_path_t *path, avl_node_t *node, const avl_ops_t *ops) {
+    avl_node_t **link = path->links[path->length - 1];
+
+    ASSERT(!*link, "AVL tree link already in use");
+
+    *node = (avl_node_t) {
+        .left = NULL,
+        .right = NULL,
+        .height = 1,
+        .refcount = 1,
+    };
+    *link = node;
+
+    update_node(node, ops);
+    rebalance_path(path, path->length - 1, ops);
+}
+
+void
+avl_path_remove(avl_path_t *path, const avl_ops_t *ops) {
+    uint32_t index = path->length - 1;
+    avl_node_t **link = path->links[index];
+    avl_node_t *node = *link;
+
+    if (!node->left || !node->right) {
+        *link = node->left ? node->left : node->right;
+        rebalance_path(path, index, ops);
+        return;
+    }
+
+    // The next node (the leftmost node of the right subtree, which has no left
+    // child) takes the place of the removed one.
+    avl_path_push(path, &node->right);
+    avl_node_t *next = avl_path_node(path, ops);
+
+    while (next->left) {
+        avl_path_push(path, &next->left);
+        next = avl_path_node(path, ops);
+    }
+
+    *path->links[path->length - 1] = next->right;
+    next->left = node->left;
+    next->right = node->right;
+    *link = next;
+
+    // The path now goes through the next node instead of the removed one.
+    path->links[index + 1] = &next->right;
+    rebalance_path(path, path->length - 1, ops);
+}
+
+void
+avl_path_update(avl_path_t *path, const avl_ops_t *ops) {
+    for (uint32_t i = path->length; i > 0; --i) {
+        if (*path->links[i - 1]) {
+            update_node(*path->links[i - 1], ops);
+        }
+    }
+}
+
+avl_node_t *
+avl_share(avl_node_t *root) {
+    if (root) {
+        root->refcount++;
+    }
+
+    return root;
+}
+
+uint32_t
+avl_count(avl_node_t *root) {
+    if (!root) {
+        return 0;
+    }
+
+    return 1 + avl_count(root->left) + avl_count(root->right);
+}
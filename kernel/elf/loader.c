@@ -1,10 +1,10 @@
+#include <string.h>
 #include <elf/elf.h>
 #include <elf/loader.h>
 #include <mm/vmm.h>
-#include <mm/pmm.h>
 #include <mm/paging.h>
+#include <kmalloc.h>
 #include <panic.h>
-#include <string.h>
 
 static uint32_t
 elf_flags_to_paging_flags(uint32_t flags) {
@@ -18,58 +18,99 @@ elf_flags_to_paging_flags(uint32_t flags) {
     return pt_flags;
 }
 
-static void
-handle_loadable_segment(paging_context_t kern_paging_ctx, vmm_context_t *kern_vmm_ctx,
-                        vmm_context_t *vmm_ctx,
-                        elf32_prog_hdr_t *prog_hdr, void *raw_elf) {
+static elf32_prog_hdr_t *
+elf_prog_hdr(elf_image_t *image, size_t i) {
+    size_t prog_header_offset = image->header.phoff + i * image->header.phentsize;
+
+    return (elf32_prog_hdr_t *)((char *)image->data + prog_header_offset);
+}
+
+// The number of pages the segment spans (it doesn't necessarily start at the
+// beginning of a page).
+static uint32_t
+segment_page_count(elf32_prog_hdr_t *prog_hdr) {
     size_t size = prog_hdr->filesz > prog_hdr->memsz ? prog_hdr->filesz : prog_hdr->memsz;
-    size_t file_size = prog_hdr->filesz;
-    size_t page_count = paging_page_count(size);
-
-    for (size_t i = 0; i < page_count; ++i) {
-        uint32_t virtual_addr = prog_hdr->vaddr + i * PAGE_SIZE;
-        uint32_t aligned_vaddr = paging_align_addr(virtual_addr);
-        uint32_t physical_addr = (uint32_t)pmm_alloc_page();
-
-        uint32_t flags = PAGE_FLAG_PRESENT | PAGE_FLAG_USER | elf_flags_to_paging_flags(prog_hdr->flags);
-        // Map the virtual address so we can memcpy the data from the ELF file
-        // into the newly allocated page.
-        vmm_map_pages(kern_vmm_ctx, aligned_vaddr, physical_addr, 1, flags);
-        memcpy((void *)virtual_addr, (char *)raw_elf + prog_hdr->offset + i * PAGE_SIZE, file_size);
-
-        // Add the same virtual address mapping into the context of the new
-        // task.
-        vmm_map_pages(vmm_ctx, aligned_vaddr, physical_addr, 1, flags);
-
-        if (file_size < PAGE_SIZE) {
-            // If the memory size is greater than the file size of the segment, the
-            // extra bytes need to be set to 0.
-            if (prog_hdr->memsz > prog_hdr->filesz) {
-                memset((void *)(virtual_addr + file_size), 0, prog_hdr->memsz - prog_hdr->filesz);
-            }
-        } else {
-            file_size -= PAGE_SIZE;
+
+    return paging_page_count(prog_hdr->vaddr - paging_align_addr(prog_hdr->vaddr) + size);
+}
+
+int
+elf_image_init(elf_image_t *image, void *data, uint32_t physical_addr, size_t size) {
+    int res = elf_parse_header(data, size, &image->header);
+
+    if (res) {
+        return res;
+    }
+
+    image->data = data;
+    image->physical_addr = physical_addr;
+    image->size = size;
+    image->text_frames = kmalloc(image->header.phnum * sizeof(uint32_t *));
+
+    for (size_t i = 0; i < image->header.phnum; ++i) {
+        elf32_prog_hdr_t *prog_hdr = elf_prog_hdr(image, i);
+
+        image->text_frames[i] = NULL;
+
+        if (prog_hdr->type == ELF_PROG_HDR_TYPE_LOAD && !(prog_hdr->flags & ELF_PROG_HDR_FLAG_W)) {
+            size_t frames_size = segment_page_count(prog_hdr) * sizeof(uint32_t);
+
+            image->text_frames[i] = kmalloc(frames_size);
+            memset(image->text_frames[i], 0, frames_size);
         }
+    }
 
-        vmm_unmap_pages(kern_vmm_ctx, aligned_vaddr, 1);
-        paging_unmap_addr(kern_paging_ctx, aligned_vaddr);
-        paging_invlpg(virtual_addr);
+    return 0;
+}
+
+static void
+handle_loadable_segment(vmm_context_t *vmm_ctx, elf_image_t *image, size_t i) {
+    elf32_prog_hdr_t *prog_hdr = elf_prog_hdr(image, i);
+    uint32_t aligned_vaddr = paging_align_addr(prog_hdr->vaddr);
+    uint32_t flags = PAGE_FLAG_PRESENT | PAGE_FLAG_USER | elf_flags_to_paging_flags(prog_hdr->flags);
+
+    if (prog_hdr->offset > image->size || prog_hdr->filesz > image->size - prog_hdr->offset) {
+        PANIC("segment at offset %#x (%u bytes) is out of bounds", prog_hdr->offset,
+              prog_hdr->filesz);
+    }
+
+    vmm_file_t file = {
+        .data = (const char *)image->data + prog_hdr->offset,
+        .virtual_addr = prog_hdr->vaddr,
+        .size = prog_hdr->filesz,
+        .physical_addr = 0,
+        .frames = image->text_frames[i],
+    };
+
+    // A read-only segment whose file offset is at the same offset into a page
+    // as its virtual address can be mapped straight from the file, as long as
+    // its first page doesn't start before the file does (the memory before the
+    // boot module mustn't be readable from user space). Otherwise, its pages
+    // are copied into the text_frames cache.
+    uint32_t physical_addr = image->physical_addr + prog_hdr->offset;
+
+    if (file.frames && !((physical_addr - prog_hdr->vaddr) & (PAGE_SIZE - 1))
+            && physical_addr - (prog_hdr->vaddr - aligned_vaddr) >= image->physical_addr) {
+        file.physical_addr = physical_addr;
     }
+
+    // Nothing is allocated yet: the page fault handler fills in each page
+    // from the ELF file (or with zeroes, past the end of the file-backed
+    // part of the segment) when it is first accessed.
+    vmm_map_file(vmm_ctx, aligned_vaddr, segment_page_count(prog_hdr), flags, file);
 }
 
 void
-elf_load(paging_context_t kern_paging_ctx, vmm_context_t *kern_vmm_ctx, vmm_context_t *vmm_ctx,
-         elf32_hdr_t header, void *raw_elf) {
-    for (size_t i = 0; i < header.phnum; ++i) {
-        size_t prog_header_offset = header.phoff + i * header.phentsize;
-        elf32_prog_hdr_t *prog_hdr = (elf32_prog_hdr_t *)((char *)raw_elf + prog_header_offset);
+elf_load(vmm_context_t *vmm_ctx, elf_image_t *image) {
+    for (size_t i = 0; i < image->header.phnum; ++i) {
+        elf32_prog_hdr_t *prog_hdr = elf_prog_hdr(image, i);
 
         switch (prog_hdr->type) {
             case ELF_PROG_HDR_TYPE_NULL:
                 // Nothing to do.
                 return;
             case ELF_PROG_HDR_TYPE_LOAD:
-                handle_loadable_segment(kern_paging_ctx, kern_vmm_ctx, vmm_ctx, prog_hdr, raw_elf);
+                handle_loadable_segment(vmm_ctx, image, i);
 
                 break;
             default:
@@ -0,0 +1,87 @@
+#ifndef __AVL_H__
+#define __AVL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The maximum height of a tree (an AVL tree of this height has more than 2^32
+// nodes).
+#define AVL_MAX_HEIGHT 48
+
+// A node of an AVL tree (a binary search tree in which the heights of the two
+// subtrees of any node differ by at most 1, which keeps lookups O(log n)).
+//
+// The node is embedded in the structure it links into the tree (see
+// AVL_ENTRY). The tree doesn't know anything about the keys: the caller walks
+// the tree (see avl_path_t) to find where a new node goes, and avl_path_insert
+// links it there and rebalances the tree.
+//
+// The trees are persistent: the nodes can be shared by several trees (see
+// avl_share). Before a node is modified, it is replaced by a private copy (see
+// avl_path_node), so changing a tree only copies the shared nodes on the path
+// from the root to the nodes that change.
+typedef struct avl_node {
+    struct avl_node *left;
+    struct avl_node *right;
+    // The height of the subtree rooted at this node (1 for a leaf).
+    uint32_t height;
+    // The number of pointers to this node (from the roots of trees or from
+    // other nodes).
+    uint32_t refcount;
+} avl_node_t;
+
+// How to handle the nodes of a particular kind of tree.
+typedef struct avl_ops {
+    // Allocate a copy of the structure that embeds the node (the fields of
+    // its avl_node_t don't need to be copied).
+    avl_node_t *(*copy)(avl_node_t *);
+    // Called whenever the subtree rooted at a node changes (children before
+    // their parents), for trees that keep some information about each subtree
+    // in its root (e.g. the largest free range in the subtree). May be NULL.
+    void (*update)(avl_node_t *);
+} avl_ops_t;
+
+// The links followed from the root of a tree to some node.
+//
+// links[0] is the root pointer, and links[i] is the left or right pointer of
+// the node links[i - 1] points to. Every node on the path can be modified (it
+// isn't shared with other trees).
+typedef struct avl_path {
+    avl_node_t **links[AVL_MAX_HEIGHT + 1];
+    uint32_t length;
+} avl_path_t;
+
+// Return the structure of type `type` whose `member` field is `node`.
+#define AVL_ENTRY(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+// Start a path at the root of a tree.
+void avl_path_init(avl_path_t *path, avl_node_t **root);
+
+// Return the node the last link of the path points to (or NULL if the link is
+// empty), replacing it with a private copy first if it is shared.
+avl_node_t *avl_path_node(avl_path_t *path, const avl_ops_t *ops);
+
+// Extend the path with `link` (the left or right pointer of its last node).
+void avl_path_push(avl_path_t *path, avl_node_t **link);
+
+// Link `node` into the tree at the (empty) last link of the path, and rebalance
+// the tree.
+void avl_path_insert(avl_path_t *path, avl_node_t *node, const avl_ops_t *ops);
+
+// Unlink the last node of the path from the tree, and rebalance the tree. The
+// node can be freed afterwards.
+void avl_path_remove(avl_path_t *path, const avl_ops_t *ops);
+
+// Call ops->update on the last node of the path and on all its ancestors (e.g.
+// after changing some data the update function depends on).
+void avl_path_update(avl_path_t *path, const avl_ops_t *ops);
+
+// Return another reference to the tree (in O(1): the nodes are only copied
+// when one of the trees is changed).
+avl_node_t *avl_share(avl_node_t *root);
+
+// Return the number of nodes of the tree.
+uint32_t avl_count(avl_node_t *root);
+
+#endif /* __AVL_H__ */
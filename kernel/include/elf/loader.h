@@ -1,11 +1,38 @@
 #ifndef __ELF_LOADER_H__
 #define __ELF_LOADER_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <elf/elf.h>
 #include <mm/vmm.h>
-#include <mm/paging.h>
 
-void elf_load(paging_context_t kern_paging_ctx, vmm_context_t *kern_vmm_ctx, vmm_context_t *vmm_ctx,
-              elf32_hdr_t header, void *raw_elf);
+// An ELF file (e.g. a boot module) that any number of tasks can run.
+//
+// The read-only segments are shared by all the tasks: their pages are either
+// mapped straight from the file, or filled in once and then cached in
+// `text_frames` (see vmm_file_t).
+typedef struct elf_image {
+    // The file (mapped in the kernel's part of the address space).
+    void *data;
+    // The physical address of the file.
+    uint32_t physical_addr;
+    size_t size;
+    elf32_hdr_t header;
+    // The frames of the pages of each read-only segment (indexed by program
+    // header, NULL for the other segments).
+    uint32_t **text_frames;
+} elf_image_t;
+
+// Parse the ELF file (size bytes at data, which is at physical_addr) and set up
+// the cache of its read-only pages. Returns 0 on success, or one of the
+// ELF_PARSE_ERR_* errors.
+int elf_image_init(elf_image_t *image, void *data, uint32_t physical_addr, size_t size);
+
+// Add the segments of the ELF file to the address space of a new task.
+//
+// The segments are demand-paged, so the file must stay mapped at the same
+// kernel address for as long as the task exists.
+void elf_load(vmm_context_t *vmm_ctx, elf_image_t *image);
 
 #endif /* __ELF_LOADER_H__ */
@@ -1,15 +1,21 @@
 #ifndef __INIT_H__
 #define __INIT_H__
 
+#include <stddef.h>
+
 #include <task.h>
 #include <mm/vmm.h>
 
 #define INIT_PID 1
 
 task_control_block_t *init_create_task0(paging_context_t paging_ctx, vmm_context_t vmm_ctx,
-                                        void *text_physical_addr);
+                                        void *text_physical_addr, size_t text_size);
 
+// Create a user task that runs the ELF file at text_physical_addr (a boot
+// module, which must stay where it is for as long as the task exists).
+//
+// The tasks created from the same module share its read-only pages.
 task_control_block_t *init_create_user_task(paging_context_t paging_ctx, vmm_context_t vmm_ctx,
-        void *text_physical_addr, task_control_block_t *parent);
+        void *text_physical_addr, size_t text_size, task_control_block_t *parent);
 
 #endif /* __INIT_H__ */
@@ -2,24 +2,69 @@
 #define __KMALLOC_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <mm/vmm.h>
+#include <syscall/memstat.h>
 
+// The heap only reserves virtual addresses: its pages are backed by physical
+// memory on demand.
 #define KERNEL_HEAP_VIRT_START 0xE0000000
-#define KERNEL_HEAP_PHYS_START 0x00800000
-// 16M
-#define KERNEL_HEAP_SIZE  0x03000000
+// 256M
+#define KERNEL_HEAP_SIZE  0x10000000
+#define KERNEL_HEAP_PAGE_COUNT (KERNEL_HEAP_SIZE / PAGE_SIZE)
 
+// The alignment of the addresses returned by kmalloc (and of the block sizes).
+#define KMALLOC_ALIGN          8
+// Requests smaller than this are served from exact-fit size classes (one class
+// every KMALLOC_ALIGN bytes). Larger requests are served from classes that
+// split each power of two into KMALLOC_SUBCLASS_COUNT ranges.
+#define KMALLOC_SMALL_LIMIT    256
+#define KMALLOC_SUBCLASS_LOG2  2
+#define KMALLOC_SUBCLASS_COUNT (1 << KMALLOC_SUBCLASS_LOG2)
+#define KMALLOC_CLASS_COUNT    128
+// The number of call sites the allocation profiler can tell apart (the
+// allocations of any other call sites are lumped together).
+#define KMALLOC_CALLSITE_COUNT 64
+
+// The header of a heap block.
+//
+// The heap is a sequence of physically adjacent blocks. Each block starts with
+// a header that records its size and whether it (and the block before it) is
+// in use. The size of the previous block is only valid if the previous block is
+// free, which lets kfree merge a block with both of its neighbours in constant
+// time (boundary tags).
 typedef struct kmalloc_header {
-    // The size of this free region
+    // The size of the previous block (only valid if the previous block is
+    // free).
+    size_t prev_size;
+    // The size of this block (including the header). The low bits are used for
+    // the KMALLOC_BLOCK_* flags.
     size_t size;
-    // The next free region
+    // The return address of the kmalloc call that allocated the block (only
+    // valid if the block is in use).
+    uintptr_t caller;
+    // Keeps the data of the block aligned to KMALLOC_ALIGN.
+    uint32_t reserved;
+    // The next/previous free blocks of the same size class. These overlap the
+    // data of an allocated block, so they are only valid if the block is free.
     struct kmalloc_header *next;
+    struct kmalloc_header *prev;
 } kmalloc_header_t;
 
-// Map all the heap pages. This should be called before any calls to kmalloc or
-// kfree.
+// Set up the heap. This should be called before any calls to kmalloc or kfree
+// (and after init_paging).
 void kmalloc_init();
 void *kmalloc(size_t);
+// Allocate `size` bytes aligned to `align` bytes (which must be a power of 2).
+// The memory is freed using kfree.
+void *kmalloc_aligned(size_t size, size_t align);
+// Resize the specified allocation, moving it if it can't be resized in place.
+void *krealloc(void *, size_t);
 void kfree(void *);
+// Return the physical pages that only back free heap memory to the PMM.
+// Returns the number of pages released.
+uint32_t kmalloc_release_free_pages();
+// Fill in the heap section of the specified memstat_t.
+void kmalloc_memstat(memstat_t *);
 
 #endif /* __KMALLOC_H__ */
@@ -0,0 +1,23 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#include <stddef.h>
+
+// The largest input lz4_compress accepts (the offsets of the matches are 16
+// bits long).
+#define LZ4_MAX_INPUT_SIZE 0xFFFF
+
+// Compress src_size bytes from src into dst, using the LZ4 block format.
+// Returns the size of the compressed data, or 0 if it doesn't fit in
+// dst_capacity bytes (e.g. because the input doesn't compress well).
+//
+// NOTE: src_size must not exceed LZ4_MAX_INPUT_SIZE. This uses a static hash
+// table, so the calls must not overlap.
+size_t lz4_compress(const void *src, size_t src_size, void *dst, size_t dst_capacity);
+
+// Decompress the LZ4 block of src_size bytes at src into dst. Returns the size
+// of the decompressed data, or 0 if the block is malformed or doesn't fit in
+// dst_capacity bytes.
+size_t lz4_decompress(const void *src, size_t src_size, void *dst, size_t dst_capacity);
+
+#endif /* __LZ4_H__ */
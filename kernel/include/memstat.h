@@ -0,0 +1,16 @@
+#ifndef __MEMSTAT_H__
+#define __MEMSTAT_H__
+
+#include <syscall/memstat.h>
+
+// Take a snapshot of the memory usage of the system.
+void memstat_collect(memstat_t *);
+// Print a snapshot of the memory usage of the system.
+void memstat_dump();
+// Ask for memstat_dump to be called the next time the kernel is idle (this is
+// safe to call from interrupt handlers).
+void memstat_request_dump();
+// Call memstat_dump if memstat_request_dump was called since the last dump.
+void memstat_dump_if_requested();
+
+#endif /* __MEMSTAT_H__ */
@@ -10,5 +10,7 @@ void sched_add(task_control_block_t *, task_priority_t);
 void sched_remove(uint32_t pid);
 void sched_context_switch();
 void sched_halt_or_crash();
+// Call fn on each task (which mustn't add or remove any tasks).
+void sched_for_each_task(void (*fn)(task_control_block_t *, void *), void *data);
 
 #endif /* __SCHED_H__ */
@@ -0,0 +1,61 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The alignment of the objects allocated from a cache, unless a larger
+// alignment is requested.
+#define KMEM_CACHE_LINE_SIZE 64
+// The size of the memory chunks the objects are carved out of.
+#define KMEM_SLAB_SIZE       4096
+
+// A chunk of memory that holds `object_count` objects.
+typedef struct kmem_slab {
+    struct kmem_slab *next;
+    uint32_t object_count;
+} kmem_slab_t;
+
+// A free object. The free objects of a cache are chained through a pointer
+// stored `free_offset` bytes into each free object.
+typedef struct kmem_free_object {
+    struct kmem_free_object *next;
+} kmem_free_object_t;
+
+// A cache of objects of the same size.
+//
+// Allocating and freeing objects is a constant time operation, as long as
+// there are free objects in the cache (otherwise a new slab is allocated using
+// kmalloc).
+typedef struct kmem_cache {
+    const char *name;
+    // The size of an object, rounded up to the alignment of the cache.
+    size_t object_size;
+    size_t align;
+    // Where the free list pointer is stored in a free object. Caches with a
+    // constructor keep it past the end of the object, so the constructed state
+    // survives a trip through the free list.
+    size_t free_offset;
+    // Called when an object is first carved out of a slab. Objects must be
+    // returned to the cache in their constructed state.
+    void (*ctor)(void *);
+    kmem_free_object_t *free_objects;
+    kmem_slab_t *slabs;
+    // The number of objects currently allocated from the cache.
+    uint32_t in_use;
+    // The total number of objects in the cache.
+    uint32_t total;
+} kmem_cache_t;
+
+// Create a cache of objects of the specified size.
+//
+// If `align` is 0, the objects are aligned to KMEM_CACHE_LINE_SIZE. `ctor` is
+// optional.
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *));
+// Allocate an object from the specified cache.
+void *kmem_cache_alloc(kmem_cache_t *);
+// Return an object to the cache it was allocated from.
+void kmem_cache_free(kmem_cache_t *, void *);
+
+#endif /* __SLAB_H__ */
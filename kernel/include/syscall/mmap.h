@@ -0,0 +1,21 @@
+#ifndef __SYSCALL_MMAP_H__
+#define __SYSCALL_MMAP_H__
+
+#include <registers.h>
+
+// Back the mapping with 4 MB pages: the length is rounded up to a multiple of
+// 4 MB, and the mapping is 4 MB aligned.
+//
+// NOTE: the flags are part of the syscall ABI (see SYS_MMAP).
+#define MAP_LARGE 1
+
+// Map ECX bytes of anonymous (zero-filled) memory, which is readable and
+// writable, in the user's part of the address space, with the MAP_* flags in
+// EDX. Returns the address of the mapping in EAX (or -1 if the arguments are
+// invalid or there is no free range large enough). The mapping never starts
+// at address 0.
+//
+// The pages are only backed by physical memory when they are first accessed.
+void mmap(registers_t *);
+
+#endif /* __SYSCALL_MMAP_H__ */
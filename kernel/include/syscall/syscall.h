@@ -6,6 +6,8 @@
 
 #define SYS_EXIT 1
 #define SYS_FORK 2
+#define SYS_MEMSTAT 3
+#define SYS_MMAP 4
 
 void syscall_handler(interrupt_state_t *, registers_t *);
 
@@ -5,10 +5,13 @@
 #include <stdint.h>
 #include <mm/vmm.h>
 #include <mm/paging.h>
+#include <registers.h>
 
 typedef struct task_control_block {
     uint32_t pid;
     uint32_t kernel_stack_top;
+    // The physical address of the page directory of the task (0 for kernel
+    // tasks, which borrow the address space of the previous task).
     uint32_t virtual_addr_space;
     uint32_t esp0;
     vmm_context_t vmm_context;
@@ -26,8 +29,17 @@ struct task_list {
     struct task_list *next;
 };
 
+// Create the cache task control blocks are allocated from. This must be called
+// before task_create.
+void task_init_cache();
 task_control_block_t *task_create(paging_context_t, vmm_context_t, void (*)(void), void *, bool);
 void task_init(task_control_block_t *);
+// Create a copy of the (user) task `parent`, which is in the middle of the
+// system call whose registers are `regs`: the new task starts out returning to
+// user mode from the same system call, with EAX set to 0.
+//
+// The address space of the new task is a copy-on-write copy of the parent's.
+task_control_block_t *task_fork(task_control_block_t *parent, registers_t *regs);
 #endif
 
 #endif /* __TASK_H__ */
@@ -5,6 +5,7 @@
 #include <mm/vmm.h>
 #include <mm/addr_space.h>
 #include <mm/paging.h>
+#include <kmalloc.h>
 #include <stddef.h>
 #include <elf/elf.h>
 #include <elf/loader.h>
@@ -13,44 +14,83 @@ void init_goto_user_mode();
 
 task_control_block_t *
 init_create_task0(paging_context_t kern_paging_ctx, vmm_context_t kern_vmm_ctx,
-                  void *user_elf_physical_addr) {
+                  void *user_elf_physical_addr, size_t user_elf_size) {
     task_control_block_t *task = init_create_user_task(kern_paging_ctx, kern_vmm_ctx,
-                                 user_elf_physical_addr, NULL);
+                                 user_elf_physical_addr, user_elf_size, NULL);
 
     ASSERT(task->pid == INIT_PID, "invalid PID for init task: %u", task->pid);
 
     return task;
 }
 
-task_control_block_t *
-init_create_user_task(paging_context_t kern_paging_ctx, vmm_context_t kern_vmm_ctx,
-                      void *user_elf_physical_addr, task_control_block_t *parent) {
-    void *user_elf = vmm_map_pages(&kern_vmm_ctx, 0, (uint32_t)user_elf_physical_addr, 1,
-                                   PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE);
+// A boot module that has been mapped (and parsed) already.
+typedef struct init_module {
+    elf_image_t image;
+    struct init_module *next;
+} init_module_t;
+
+// The modules tasks have been created from. A module is only mapped once,
+// however many tasks run it, so they can all share its read-only pages.
+static init_module_t *MODULES;
 
-    elf32_hdr_t header;
-    // TODO use the real "file" length.
-    size_t file_len = 1024;
+// Return the image of the module at user_elf_physical_addr, mapping the
+// module the first time it is used.
+static elf_image_t *
+init_module_image(paging_context_t kern_paging_ctx, vmm_context_t kern_vmm_ctx,
+                  void *user_elf_physical_addr, size_t user_elf_size) {
+    for (init_module_t *module = MODULES; module; module = module->next) {
+        if (module->image.physical_addr == (uint32_t)user_elf_physical_addr) {
+            return &module->image;
+        }
+    }
+
+    // The segments of the ELF file are paged in from the module as they are
+    // accessed, so the whole module stays mapped (and present, as it is read
+    // by the page fault handler).
+    uint32_t module_offset = (uint32_t)user_elf_physical_addr & (PAGE_SIZE - 1);
+    uint32_t module_physical_addr = (uint32_t)user_elf_physical_addr - module_offset;
+    uint32_t module_page_count = paging_page_count(module_offset + user_elf_size);
+    uint32_t module_addr = (uint32_t)vmm_map_pages(&kern_vmm_ctx, 0, module_physical_addr,
+                           module_page_count, PAGE_FLAG_PRESENT);
+    paging_map_range(kern_paging_ctx, module_addr, module_physical_addr, module_page_count,
+                     PAGE_FLAG_PRESENT | PAGE_FLAG_GLOBAL);
 
-    int res = elf_parse_header(user_elf, file_len, &header);
+    init_module_t *module = kmalloc(sizeof(init_module_t));
+    int res = elf_image_init(&module->image, (void *)(module_addr + module_offset),
+                             (uint32_t)user_elf_physical_addr, user_elf_size);
 
     if (res) {
-        PANIC("failed to parse ELF: %d %u\n", res, header.type);
+        PANIC("failed to parse ELF: %d\n", res);
     }
 
+    module->next = MODULES;
+    MODULES = module;
+
+    return &module->image;
+}
+
+task_control_block_t *
+init_create_user_task(paging_context_t kern_paging_ctx, vmm_context_t kern_vmm_ctx,
+                      void *user_elf_physical_addr, size_t user_elf_size,
+                      task_control_block_t *parent) {
+    elf_image_t *image = init_module_image(kern_paging_ctx, kern_vmm_ctx, user_elf_physical_addr,
+                                           user_elf_size);
+
     task_control_block_t *task = task_create(kern_paging_ctx, kern_vmm_ctx, init_goto_user_mode,
-                                 (void *)header.entry, true);
+                                 (void *)image->header.entry, true);
     task->parent = parent;
 
     vmm_context_t vmm_context = vmm_clone_context(kern_vmm_ctx);
-    elf_load(kern_paging_ctx, &kern_vmm_ctx, &vmm_context, header, user_elf);
+    elf_load(&vmm_context, image);
 
-    for (size_t i = 0; i < USER_STACK_PAGE_COUNT; ++i) {
-        uint32_t physical_addr = (uint32_t)pmm_alloc_page();
-        vmm_map_pages(&vmm_context,
-                      USER_STACK_TOP - USER_STACK_SIZE + i * PAGE_SIZE, physical_addr, 1,
-                      PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER);
-    }
+    // The stack is anonymous memory, so its pages are only allocated when they
+    // are first written to. The page fault handler grows it downwards (up to
+    // USER_STACK_MAX_SIZE) as needed.
+    vmm_map_pages(&vmm_context, USER_STACK_TOP - USER_STACK_SIZE, 0, USER_STACK_PAGE_COUNT,
+                  PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER);
+    // The guard page keeps the stack from growing into whatever is below it.
+    vmm_map_pages(&vmm_context, USER_STACK_TOP - USER_STACK_MAX_SIZE - PAGE_SIZE, 0, 1,
+                  PAGE_FLAG_USER);
 
     task->vmm_context = vmm_context;
 
@@ -6,11 +6,15 @@
 #include <printk.h>
 #include <flags.h>
 #include <ps2.h>
+#include <mm/memblock.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
 #include <mm/paging.h>
 #include <mm/addr_space.h>
+#include <mm/ksm.h>
+#include <mm/hugepage.h>
 #include <kmalloc.h>
+#include <memstat.h>
 #include <sched.h>
 #include <task.h>
 #include <init.h>
@@ -70,12 +74,15 @@ kernel_main(kernel_meminfo_t meminfo, multiboot_info_t multiboot_info) {
     printk_debug("kernel stack top %#x\n", meminfo.stack_top);
 
     printk_debug("Initializing memory manager\n");
-    pmm_init(multiboot_info);
+    memblock_init(multiboot_info);
+    pmm_init();
     printk_debug("PMM: OK\n");
     paging_context_t paging_ctx = init_paging();
     printk_debug("paging: OK\n");
     kmalloc_init();
     printk_debug("kmalloc: OK\n");
+    pmm_rmap_init();
+    ksm_init();
 
     vmm_context_t vmm_context = vmm_init();
 
@@ -104,10 +111,11 @@ kernel_main(kernel_meminfo_t meminfo, multiboot_info_t multiboot_info) {
     init_sched(paging_ctx, vmm_context);
     printk_debug("scheduler init: OK\n");
 
-    task_control_block_t *init_task = init_create_task0(paging_ctx, vmm_context, (void *)init_mod_addr);
+    task_control_block_t *init_task = init_create_task0(paging_ctx, vmm_context, (void *)init_mod_addr,
+                                      init_mod->mod_end - init_mod->mod_start);
 
     task_control_block_t *child = init_create_user_task(paging_ctx, vmm_context, (void *)user_mod_addr,
-                                  init_task);
+                                  user_mod->mod_end - user_mod->mod_start, init_task);
 
     for (size_t i = 0; i < 3; ++i) {
         task_control_block_t *task = task_create(paging_ctx,
@@ -116,11 +124,21 @@ kernel_main(kernel_meminfo_t meminfo, multiboot_info_t multiboot_info) {
         sched_add(task, TASK_PRIORITY_LOW);
     }
 
+    // Merge the identical pages of the user tasks in the background.
+    sched_add(task_create(paging_ctx, vmm_context, ksm_task, NULL, false), TASK_PRIORITY_LOW);
+    // Back the fully populated regions of the user tasks with 4 MB pages.
+    sched_add(task_create(paging_ctx, vmm_context, hugepage_task, NULL, false),
+              TASK_PRIORITY_LOW);
+
     sched_add(init_task, TASK_PRIORITY_LOW);
     sched_add(child, TASK_PRIORITY_LOW);
 
     for (;;) {
         printk_debug("task %u\n", CURRENT_TASK.task->pid);
+        // Nothing else to do, so get some pages ready for the page fault
+        // handler.
+        pmm_refill_zeroed_pages();
+        memstat_dump_if_requested();
         asm volatile("hlt");
     }
 
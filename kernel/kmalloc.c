@@ -1,66 +1,643 @@
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <flags.h>
 #include <kmalloc.h>
+#include <panic.h>
+#include <mm/bitmap.h>
+#include <mm/paging.h>
+#include <mm/pmm.h>
+
+// The block is in use.
+#define KMALLOC_BLOCK_USED      1
+// The block before this one is in use (so prev_size is not valid).
+#define KMALLOC_BLOCK_PREV_USED (1 << 1)
+#define KMALLOC_BLOCK_FLAGS     (KMALLOC_BLOCK_USED | KMALLOC_BLOCK_PREV_USED)
+
+// The part of the header that is always valid (the data of an allocated block
+// starts right after it).
+#define KMALLOC_OVERHEAD  offsetof(kmalloc_header_t, next)
+// The smallest block that can hold the free list pointers.
+#define KMALLOC_MIN_BLOCK sizeof(kmalloc_header_t)
+
+// The heads of the free lists of each size class.
+static kmalloc_header_t *FREE_LISTS[KMALLOC_CLASS_COUNT];
+// Bit `i` is set if the free list of class `i` is non-empty.
+static uint32_t FREE_LIST_MAP[KMALLOC_CLASS_COUNT / 32];
+// The block that marks the end of the heap. It is always in use, so it is
+// never merged with the last block of the heap.
+static kmalloc_header_t *HEAP_END;
+
+// Bit `i` is set if the `i`-th page of the heap is backed by physical memory.
+//
+// The pages of the allocated blocks are always backed, and so are the headers
+// of the free blocks. The rest of a free block is only backed if it used to be
+// part of an allocated block (until kmalloc_release_free_pages is called).
+static uint32_t HEAP_PAGES_BITMAP_STORAGE[BITMAP_STORAGE_WORDS(KERNEL_HEAP_PAGE_COUNT)];
+static bitmap_t HEAP_PAGES;
+// The number of bits set in HEAP_PAGES.
+static uint32_t HEAP_BACKED_PAGES;
+// The number of bytes (including the headers) of the allocated blocks.
+static uint32_t HEAP_USED_BYTES;
+
+// The allocations of each call site of kmalloc (open addressing, keyed by the
+// return address). The call sites that don't fit are accounted for in
+// OVERFLOW_CALLSITE.
+static memstat_callsite_t CALLSITES[KMALLOC_CALLSITE_COUNT];
+static memstat_callsite_t OVERFLOW_CALLSITE;
+
+extern paging_context_t ACTIVE_PAGING_CTX;
+
+// Disable interrupts, returning whether they were enabled.
+//
+// NOTE: the page fault handler allocates from the heap too (e.g. for the
+// reverse mappings), so this keeps it from running in the middle of an
+// allocation made by a task it preempted.
+static bool
+kmalloc_lock() {
+    bool enabled = interrupts_enabled();
+
+    asm volatile("cli" ::: "memory");
+
+    return enabled;
+}
+
+static void
+kmalloc_unlock(bool enabled) {
+    if (enabled) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+static inline uint32_t
+bsf(uint32_t word) {
+    uint32_t index;
+    asm("bsf %1, %0" : "=r"(index) : "rm"(word));
+    return index;
+}
+
+static inline uint32_t
+bsr(uint32_t word) {
+    uint32_t index;
+    asm("bsr %1, %0" : "=r"(index) : "rm"(word));
+    return index;
+}
+
+static size_t
+align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static size_t
+block_size(kmalloc_header_t *block) {
+    return block->size & ~KMALLOC_BLOCK_FLAGS;
+}
+
+static bool
+block_is_used(kmalloc_header_t *block) {
+    return block->size & KMALLOC_BLOCK_USED;
+}
+
+static bool
+block_is_prev_used(kmalloc_header_t *block) {
+    return block->size & KMALLOC_BLOCK_PREV_USED;
+}
 
-kmalloc_header_t *KMALLOC_HEAD;
+static kmalloc_header_t *
+block_next(kmalloc_header_t *block) {
+    return (kmalloc_header_t *)((char *)block + block_size(block));
+}
+
+static kmalloc_header_t *
+block_prev(kmalloc_header_t *block) {
+    return (kmalloc_header_t *)((char *)block - block->prev_size);
+}
+
+static void *
+block_to_addr(kmalloc_header_t *block) {
+    return (char *)block + KMALLOC_OVERHEAD;
+}
+
+static kmalloc_header_t *
+addr_to_block(void *addr) {
+    return (kmalloc_header_t *)((char *)addr - KMALLOC_OVERHEAD);
+}
+
+static uint32_t
+heap_page_index(uintptr_t addr) {
+    return (addr - KERNEL_HEAP_VIRT_START) / PAGE_SIZE;
+}
+
+// Make sure the heap memory in [start, end) is backed by physical pages.
+static void
+heap_back_range(uintptr_t start, uintptr_t end) {
+    for (uint32_t page = heap_page_index(start); page <= heap_page_index(end - 1); ++page) {
+        if (bitmap_test(&HEAP_PAGES, page)) {
+            continue;
+        }
+
+        // The kernel page tables are shared by all contexts.
+        paging_map_virtual_to_physical(ACTIVE_PAGING_CTX, KERNEL_HEAP_VIRT_START + page * PAGE_SIZE,
+                                       (uint32_t)pmm_alloc_page(),
+                                       PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_GLOBAL);
+        bitmap_set(&HEAP_PAGES, page);
+        HEAP_BACKED_PAGES++;
+    }
+}
+
+// Set the size and the "used" flag of the block (preserving its "previous
+// used" flag), and let the next block know whether this block is in use.
+static void
+block_set(kmalloc_header_t *block, size_t size, bool used) {
+    block->size = size | (block->size & KMALLOC_BLOCK_PREV_USED) | (used ? KMALLOC_BLOCK_USED : 0);
+
+    kmalloc_header_t *next = block_next(block);
+    if (used) {
+        next->size |= KMALLOC_BLOCK_PREV_USED;
+    } else {
+        next->size &= ~KMALLOC_BLOCK_PREV_USED;
+        next->prev_size = size;
+    }
+}
+
+// Return the size class of a free block of the specified size.
+static uint32_t
+size_class(size_t size) {
+    if (size < KMALLOC_SMALL_LIMIT) {
+        return size / KMALLOC_ALIGN;
+    }
+
+    uint32_t log2 = bsr(size);
+    uint32_t subclass = (size >> (log2 - KMALLOC_SUBCLASS_LOG2)) & (KMALLOC_SUBCLASS_COUNT - 1);
+
+    return KMALLOC_SMALL_LIMIT / KMALLOC_ALIGN
+           + (log2 - bsr(KMALLOC_SMALL_LIMIT)) * KMALLOC_SUBCLASS_COUNT + subclass;
+}
+
+// Return the smallest size class whose blocks are all at least `size` bytes
+// long.
+static uint32_t
+size_class_search(size_t size) {
+    if (size >= KMALLOC_SMALL_LIMIT) {
+        // Round up to the next class boundary, so any block in the class is
+        // large enough.
+        size += (1 << (bsr(size) - KMALLOC_SUBCLASS_LOG2)) - 1;
+    }
+
+    return size_class(size);
+}
+
+static void
+free_list_insert(kmalloc_header_t *block) {
+    uint32_t class = size_class(block_size(block));
+
+    block->prev = NULL;
+    block->next = FREE_LISTS[class];
+    if (block->next) {
+        block->next->prev = block;
+    }
+
+    FREE_LISTS[class] = block;
+    FREE_LIST_MAP[class / 32] |= 1u << (class % 32);
+}
+
+static void
+free_list_remove(kmalloc_header_t *block) {
+    uint32_t class = size_class(block_size(block));
+
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        FREE_LISTS[class] = block->next;
+    }
+
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+
+    if (!FREE_LISTS[class]) {
+        FREE_LIST_MAP[class / 32] &= ~(1u << (class % 32));
+    }
+}
+
+// Find a free block of at least `size` bytes (without removing it from its
+// free list), or return NULL if there isn't one.
+//
+// This only looks at the head of one free list, so it takes constant time.
+static kmalloc_header_t *
+free_list_find(size_t size) {
+    uint32_t class = size_class_search(size);
+
+    for (uint32_t i = class / 32; i < KMALLOC_CLASS_COUNT / 32; ++i) {
+        uint32_t word = FREE_LIST_MAP[i];
+
+        // Ignore the classes that are too small.
+        if (i == class / 32) {
+            word &= ~((1u << (class % 32)) - 1);
+        }
+
+        if (word) {
+            return FREE_LISTS[i * 32 + bsf(word)];
+        }
+    }
+
+    return NULL;
+}
+
+// Free the block, merging it with its neighbours if they are free too.
+static void
+block_release(kmalloc_header_t *block) {
+    size_t size = block_size(block);
+    kmalloc_header_t *next = block_next(block);
+
+    if (!block_is_used(next)) {
+        free_list_remove(next);
+        size += block_size(next);
+    }
+
+    if (!block_is_prev_used(block)) {
+        kmalloc_header_t *prev = block_prev(block);
+
+        free_list_remove(prev);
+        size += block_size(prev);
+        block = prev;
+    }
+
+    block_set(block, size, false);
+    free_list_insert(block);
+}
+
+// Make sure the (used) block can be trimmed to `size` bytes: the first `size`
+// bytes of the block, and the header of the block that would be split off, must
+// be backed by physical memory.
+static void
+block_back(kmalloc_header_t *block, size_t size) {
+    size_t backed_size = size + KMALLOC_MIN_BLOCK;
+
+    if (backed_size > block_size(block)) {
+        backed_size = block_size(block);
+    }
+
+    heap_back_range((uintptr_t)block, (uintptr_t)block + backed_size);
+}
+
+// Shrink the (used) block to `size` bytes, freeing the rest (if it's large
+// enough to form a block of its own).
+static void
+block_trim(kmalloc_header_t *block, size_t size) {
+    size_t remaining = block_size(block) - size;
+
+    if (remaining < KMALLOC_MIN_BLOCK) {
+        return;
+    }
+
+    block_set(block, size, true);
+
+    kmalloc_header_t *rest = block_next(block);
+    rest->size = remaining | KMALLOC_BLOCK_PREV_USED;
+    block_release(rest);
+}
+
+// Return the size of the block needed to satisfy a request for `size` bytes.
+static size_t
+request_to_block_size(size_t size) {
+    size_t block_size = align_up(size + KMALLOC_OVERHEAD, KMALLOC_ALIGN);
+
+    return block_size < KMALLOC_MIN_BLOCK ? KMALLOC_MIN_BLOCK : block_size;
+}
 
 void
 kmalloc_init() {
-    KMALLOC_HEAD = (kmalloc_header_t *)KERNEL_HEAP_VIRT_START;
-    *KMALLOC_HEAD = (kmalloc_header_t) {
-        .size = KERNEL_HEAP_SIZE - sizeof(kmalloc_header_t),
-        .next = NULL,
-    };
+    bitmap_init(&HEAP_PAGES, HEAP_PAGES_BITMAP_STORAGE, KERNEL_HEAP_PAGE_COUNT);
+
+    for (size_t i = 0; i < KMALLOC_CLASS_COUNT; ++i) {
+        FREE_LISTS[i] = NULL;
+    }
+
+    for (size_t i = 0; i < KMALLOC_CLASS_COUNT / 32; ++i) {
+        FREE_LIST_MAP[i] = 0;
+    }
+
+    // The whole heap is one big free block, followed by the end marker. Only
+    // the pages that hold their headers are backed for now.
+    kmalloc_header_t *block = (kmalloc_header_t *)KERNEL_HEAP_VIRT_START;
+    size_t size = KERNEL_HEAP_SIZE - KMALLOC_MIN_BLOCK;
+
+    HEAP_END = (kmalloc_header_t *)(KERNEL_HEAP_VIRT_START + size);
+    heap_back_range((uintptr_t)block, (uintptr_t)block + KMALLOC_MIN_BLOCK);
+    heap_back_range((uintptr_t)HEAP_END, (uintptr_t)HEAP_END + KMALLOC_MIN_BLOCK);
+    HEAP_END->size = 0 | KMALLOC_BLOCK_USED;
+
+    // There is nothing before the first block.
+    block->size = KMALLOC_BLOCK_PREV_USED;
+    block_set(block, size, false);
+    free_list_insert(block);
+}
+
+// Return the profiler entry of the specified call site.
+static memstat_callsite_t *
+callsite_find(uintptr_t caller) {
+    uint32_t index = (caller >> 2) % KMALLOC_CALLSITE_COUNT;
+
+    for (uint32_t i = 0; i < KMALLOC_CALLSITE_COUNT; ++i) {
+        memstat_callsite_t *callsite = &CALLSITES[(index + i) % KMALLOC_CALLSITE_COUNT];
+
+        if (callsite->caller == caller) {
+            return callsite;
+        }
+
+        if (!callsite->caller) {
+            callsite->caller = caller;
+            return callsite;
+        }
+    }
+
+    return &OVERFLOW_CALLSITE;
+}
+
+// Record the allocation of the (used) block by `caller`.
+static void
+profile_alloc(kmalloc_header_t *block, uintptr_t caller) {
+    memstat_callsite_t *callsite = callsite_find(caller);
+
+    block->caller = caller;
+    callsite->live_allocs++;
+    callsite->live_bytes += block_size(block);
+    callsite->total_allocs++;
+    HEAP_USED_BYTES += block_size(block);
+}
+
+// Record that the (used) block is about to be freed (or resized).
+static void
+profile_free(kmalloc_header_t *block) {
+    memstat_callsite_t *callsite = callsite_find(block->caller);
+
+    callsite->live_allocs--;
+    callsite->live_bytes -= block_size(block);
+    HEAP_USED_BYTES -= block_size(block);
+}
+
+// Allocate a block of `size` bytes (including the header), or return NULL if
+// there is no free block large enough.
+static kmalloc_header_t *
+block_alloc(size_t size) {
+    kmalloc_header_t *block = free_list_find(size);
+
+    if (!block) {
+        return NULL;
+    }
+
+    free_list_remove(block);
+    block_set(block, block_size(block), true);
+    block_back(block, size);
+    block_trim(block, size);
+
+    return block;
+}
+
+// Allocate `size` bytes on behalf of `caller`.
+static void *
+heap_alloc(size_t size, uintptr_t caller) {
+    kmalloc_header_t *block = block_alloc(request_to_block_size(size));
+
+    if (!block) {
+        // No suitably sized free block found.
+        return NULL;
+    }
+
+    profile_alloc(block, caller);
+
+    return block_to_addr(block);
+}
+
+// Allocate `size` bytes aligned to `align` bytes on behalf of `caller`.
+static void *
+heap_alloc_aligned(size_t size, size_t align, uintptr_t caller) {
+    if (align <= KMALLOC_ALIGN) {
+        return heap_alloc(size, caller);
+    }
+
+    // Allocate enough memory to be able to split off a free block before the
+    // aligned address.
+    size_t needed = request_to_block_size(size);
+    size_t padded = request_to_block_size(needed + align + KMALLOC_MIN_BLOCK);
+    kmalloc_header_t *block = block_alloc(padded);
+    if (!block) {
+        return NULL;
+    }
+
+    char *addr = block_to_addr(block);
+    uintptr_t aligned_addr = align_up((uintptr_t)addr, align);
+
+    if (aligned_addr != (uintptr_t)addr) {
+        while (aligned_addr - (uintptr_t)addr < KMALLOC_MIN_BLOCK) {
+            aligned_addr += align;
+        }
+
+        kmalloc_header_t *aligned_block = addr_to_block((void *)aligned_addr);
+        size_t front_size = (char *)aligned_block - (char *)block;
+
+        aligned_block->size = 0;
+        block_set(aligned_block, block_size(block) - front_size, true);
+        block_set(block, front_size, true);
+        // The block before `block` is in use (otherwise the two would have
+        // been merged), so this doesn't merge anything.
+        block_release(block);
+
+        block = aligned_block;
+    }
+
+    block_trim(block, needed);
+    profile_alloc(block, caller);
+
+    return block_to_addr(block);
+}
+
+// Resize the allocation at `addr` on behalf of `caller`.
+static void *
+heap_realloc(void *addr, size_t size, uintptr_t caller) {
+    if (!addr) {
+        return heap_alloc(size, caller);
+    }
+
+    if (!size) {
+        kfree(addr);
+        return NULL;
+    }
+
+    kmalloc_header_t *block = addr_to_block(addr);
+    size_t needed = request_to_block_size(size);
+    size_t current = block_size(block);
+
+    if (needed <= current) {
+        profile_free(block);
+        block_trim(block, needed);
+        profile_alloc(block, caller);
+        return addr;
+    }
+
+    // Try to grow the block into the next one.
+    kmalloc_header_t *next = block_next(block);
+    if (!block_is_used(next) && current + block_size(next) >= needed) {
+        profile_free(block);
+        free_list_remove(next);
+        block_set(block, current + block_size(next), true);
+        block_back(block, needed);
+        block_trim(block, needed);
+        profile_alloc(block, caller);
+        return addr;
+    }
+
+    void *new_addr = heap_alloc(size, caller);
+    if (!new_addr) {
+        return NULL;
+    }
+
+    memcpy(new_addr, addr, current - KMALLOC_OVERHEAD);
+    kfree(addr);
+
+    return new_addr;
 }
 
 void *
 kmalloc(size_t size) {
-    kmalloc_header_t *free_region = KMALLOC_HEAD;
-    kmalloc_header_t *prev_region = NULL;
-
-    while (free_region != NULL) {
-        if (free_region->size == size) {
-            // Return the entire block.
-            if (prev_region == NULL) {
-                KMALLOC_HEAD = KMALLOC_HEAD->next;
-            } else {
-                prev_region->next = free_region->next;
-            }
+    bool enabled = kmalloc_lock();
+    void *addr = heap_alloc(size, (uintptr_t)__builtin_return_address(0));
+    kmalloc_unlock(enabled);
 
-            return (void *)((char *)free_region + sizeof(kmalloc_header_t));
-        } else if (free_region->size > size + sizeof(kmalloc_header_t)) {
-            // Split the block
-            size_t remaining = free_region->size - size;
-            kmalloc_header_t *new_region =
-                (kmalloc_header_t *)((char *)free_region + sizeof(kmalloc_header_t) + size);
-
-            *new_region = (kmalloc_header_t) {
-                .size = remaining - sizeof(kmalloc_header_t),
-                .next = free_region->next,
-            };
-
-            if (prev_region == NULL) {
-                KMALLOC_HEAD = new_region;
-            } else {
-                prev_region->next = new_region;
-            }
+    return addr;
+}
+
+void *
+kmalloc_aligned(size_t size, size_t align) {
+    ASSERT(!(align & (align - 1)), "alignment must be a power of 2: %u", align);
+
+    bool enabled = kmalloc_lock();
+    void *addr = heap_alloc_aligned(size, align, (uintptr_t)__builtin_return_address(0));
+    kmalloc_unlock(enabled);
+
+    return addr;
+}
+
+void *
+krealloc(void *addr, size_t size) {
+    bool enabled = kmalloc_lock();
+    void *new_addr = heap_realloc(addr, size, (uintptr_t)__builtin_return_address(0));
+    kmalloc_unlock(enabled);
+
+    return new_addr;
+}
+
+void
+kfree(void *addr) {
+    if (!addr) {
+        return;
+    }
+
+    kmalloc_header_t *block = addr_to_block(addr);
+    bool enabled = kmalloc_lock();
+
+    ASSERT(block_is_used(block), "double free of %#x", (uint32_t)addr);
+
+    profile_free(block);
+    block_release(block);
+    kmalloc_unlock(enabled);
+}
 
-            free_region->size = size;
+uint32_t
+kmalloc_release_free_pages() {
+    uint32_t released = 0;
+    bool enabled = kmalloc_lock();
 
-            return (void *)((char *)free_region + sizeof(kmalloc_header_t));
+    for (size_t i = 0; i < KMALLOC_CLASS_COUNT; ++i) {
+        for (kmalloc_header_t *block = FREE_LISTS[i]; block; block = block->next) {
+            // Keep the header of the block (and of the block after it) backed.
+            uintptr_t start = (uintptr_t)block + KMALLOC_MIN_BLOCK;
+            uintptr_t end = (uintptr_t)block_next(block);
+
+            uint32_t first_page = heap_page_index(start + PAGE_SIZE - 1);
+            uint32_t end_page = heap_page_index(end);
+            // The start of the current run of backed pages.
+            uint32_t run_start = first_page;
+
+            for (uint32_t page = first_page; page <= end_page; ++page) {
+                if (page < end_page && bitmap_test(&HEAP_PAGES, page)) {
+                    uint32_t virtual_addr = KERNEL_HEAP_VIRT_START + page * PAGE_SIZE;
+
+                    // The heap pages are always below 4 GB.
+                    pmm_free_page((void *)(uint32_t)paging_physical_addr(ACTIVE_PAGING_CTX,
+                                  virtual_addr));
+                    bitmap_clear(&HEAP_PAGES, page);
+                    HEAP_BACKED_PAGES--;
+                    released++;
+                    continue;
+                }
+
+                // Unmap the whole run at once (nothing can allocate the freed
+                // frames in the meantime).
+                if (page > run_start) {
+                    paging_unmap_range(ACTIVE_PAGING_CTX,
+                                       KERNEL_HEAP_VIRT_START + run_start * PAGE_SIZE,
+                                       page - run_start);
+                }
+
+                run_start = page + 1;
+            }
         }
-        prev_region = free_region;
-        free_region = free_region->next;
     }
 
-    // No suitably sized free block found.
-    return NULL;
+    kmalloc_unlock(enabled);
+
+    return released;
+}
+
+// Insert the call site into `top` (which holds the `count` call sites holding
+// the most memory so far, largest first).
+static void
+callsite_rank(memstat_callsite_t *top, uint32_t count, memstat_callsite_t *callsite) {
+    if (!callsite->live_allocs || callsite->live_bytes <= top[count - 1].live_bytes) {
+        return;
+    }
+
+    uint32_t i = count - 1;
+    for (; i > 0 && top[i - 1].live_bytes < callsite->live_bytes; --i) {
+        top[i] = top[i - 1];
+    }
+
+    top[i] = *callsite;
 }
 
 void
-kfree(void *addr) {
-    kmalloc_header_t *region =
-        (kmalloc_header_t *)((char *)addr - sizeof(kmalloc_header_t));
+kmalloc_memstat(memstat_t *stat) {
+    bool enabled = kmalloc_lock();
+
+    stat->heap_size = KERNEL_HEAP_SIZE;
+    stat->heap_backed_pages = HEAP_BACKED_PAGES;
+    stat->heap_used_bytes = HEAP_USED_BYTES;
+    stat->heap_free_bytes = 0;
+    stat->heap_free_block_count = 0;
+
+    for (size_t i = 0; i < MEMSTAT_HISTOGRAM_BUCKETS; ++i) {
+        stat->heap_free_histogram[i] = 0;
+    }
+
+    for (size_t i = 0; i < KMALLOC_CLASS_COUNT; ++i) {
+        for (kmalloc_header_t *block = FREE_LISTS[i]; block; block = block->next) {
+            stat->heap_free_bytes += block_size(block);
+            stat->heap_free_block_count++;
+            stat->heap_free_histogram[bsr(block_size(block))]++;
+        }
+    }
+
+    for (size_t i = 0; i < MEMSTAT_CALLSITE_COUNT; ++i) {
+        stat->heap_callsites[i] = (memstat_callsite_t) { 0 };
+    }
+
+    for (size_t i = 0; i < KMALLOC_CALLSITE_COUNT; ++i) {
+        callsite_rank(stat->heap_callsites, MEMSTAT_CALLSITE_COUNT, &CALLSITES[i]);
+    }
 
-    region->next = KMALLOC_HEAD;
-    KMALLOC_HEAD = region;
+    callsite_rank(stat->heap_callsites, MEMSTAT_CALLSITE_COUNT, &OVERFLOW_CALLSITE);
+    kmalloc_unlock(enabled);
 }
@@ -0,0 +1,226 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lz4.h>
+#include <panic.h>
+
+// The shortest match that can be encoded.
+#define LZ4_MIN_MATCH    4
+// The last bytes of a block are always literals...
+#define LZ4_LAST_LITERALS 5
+// ...and the last match starts at least this many bytes before its end.
+#define LZ4_MF_LIMIT     12
+// The log2 of the number of entries of the table of recently seen sequences.
+#define LZ4_HASH_LOG     10
+// A length of 15 in a token means more length bytes follow.
+#define LZ4_RUN_MASK     15
+
+// The last position each (hashed) 4 byte sequence was seen at. This is too
+// large for the kernel stack (compression can happen in the middle of any
+// allocation, see reclaim_pages), so lz4_compress isn't reentrant: the caller
+// must serialize the calls (see swap_compress).
+static uint16_t HASH_TABLE[1 << LZ4_HASH_LOG];
+
+static uint32_t
+read32(const uint8_t *p) {
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return value;
+}
+
+static uint32_t
+hash_sequence(uint32_t sequence) {
+    // Knuth's multiplicative hash.
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Append the extra bytes of a length that didn't fit in its token.
+static uint8_t *
+write_length(uint8_t *out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+
+    *out++ = length;
+
+    return out;
+}
+
+// Read the extra bytes of a length that didn't fit in its token. Returns
+// false if the input ends first.
+static bool
+read_length(const uint8_t **in, const uint8_t *in_end, size_t *length) {
+    uint8_t byte;
+
+    do {
+        if (*in == in_end) {
+            return false;
+        }
+
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+// Append a sequence: the literals, followed by a match of match_len bytes
+// `offset` bytes back (or nothing, if match_len is 0). Returns NULL if the
+// sequence doesn't fit before out_end.
+static uint8_t *
+write_sequence(uint8_t *out, uint8_t *out_end, const uint8_t *literals, size_t literal_len,
+               uint16_t offset, size_t match_len) {
+    // The worst case size of the sequence.
+    size_t size = 1 + literal_len / 255 + 1 + literal_len + 2 + match_len / 255 + 1;
+
+    if (size > (size_t)(out_end - out)) {
+        return NULL;
+    }
+
+    uint8_t *token = out++;
+
+    if (literal_len >= LZ4_RUN_MASK) {
+        *token = LZ4_RUN_MASK << 4;
+        out = write_length(out, literal_len - LZ4_RUN_MASK);
+    } else {
+        *token = literal_len << 4;
+    }
+
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+
+    if (!match_len) {
+        return out;
+    }
+
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+
+    match_len -= LZ4_MIN_MATCH;
+    if (match_len >= LZ4_RUN_MASK) {
+        *token |= LZ4_RUN_MASK;
+        out = write_length(out, match_len - LZ4_RUN_MASK);
+    } else {
+        *token |= match_len;
+    }
+
+    return out;
+}
+
+size_t
+lz4_compress(const void *src, size_t src_size, void *dst, size_t dst_capacity) {
+    ASSERT(src_size <= LZ4_MAX_INPUT_SIZE, "cannot compress %u bytes", src_size);
+
+    const uint8_t *in = src;
+    uint8_t *out = dst;
+    uint8_t *out_end = out + dst_capacity;
+    size_t anchor = 0;
+
+    memset(HASH_TABLE, 0, sizeof(HASH_TABLE));
+
+    if (src_size > LZ4_MF_LIMIT) {
+        size_t match_limit = src_size - LZ4_MF_LIMIT;
+        size_t pos = 0;
+
+        while (pos < match_limit) {
+            uint32_t sequence = read32(in + pos);
+            uint32_t hash = hash_sequence(sequence);
+            size_t ref = HASH_TABLE[hash];
+
+            HASH_TABLE[hash] = pos;
+
+            if (ref >= pos || read32(in + ref) != sequence) {
+                pos++;
+                continue;
+            }
+
+            size_t match_len = LZ4_MIN_MATCH;
+            while (pos + match_len < src_size - LZ4_LAST_LITERALS
+                    && in[ref + match_len] == in[pos + match_len]) {
+                match_len++;
+            }
+
+            out = write_sequence(out, out_end, in + anchor, pos - anchor, pos - ref, match_len);
+            if (!out) {
+                return 0;
+            }
+
+            pos += match_len;
+            anchor = pos;
+        }
+    }
+
+    out = write_sequence(out, out_end, in + anchor, src_size - anchor, 0, 0);
+    if (!out) {
+        return 0;
+    }
+
+    return out - (uint8_t *)dst;
+}
+
+size_t
+lz4_decompress(const void *src, size_t src_size, void *dst, size_t dst_capacity) {
+    const uint8_t *in = src;
+    const uint8_t *in_end = in + src_size;
+    uint8_t *out = dst;
+    uint8_t *out_end = out + dst_capacity;
+
+    while (in < in_end) {
+        uint8_t token = *in++;
+        size_t literal_len = token >> 4;
+
+        if (literal_len == LZ4_RUN_MASK && !read_length(&in, in_end, &literal_len)) {
+            return 0;
+        }
+
+        if (literal_len > (size_t)(in_end - in) || literal_len > (size_t)(out_end - out)) {
+            return 0;
+        }
+
+        memcpy(out, in, literal_len);
+        in += literal_len;
+        out += literal_len;
+
+        // The last sequence has no match.
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return 0;
+        }
+
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        if (!offset || offset > (size_t)(out - (uint8_t *)dst)) {
+            return 0;
+        }
+
+        size_t match_len = token & LZ4_RUN_MASK;
+
+        if (match_len == LZ4_RUN_MASK && !read_length(&in, in_end, &match_len)) {
+            return 0;
+        }
+
+        match_len += LZ4_MIN_MATCH;
+
+        if (match_len > (size_t)(out_end - out)) {
+            return 0;
+        }
+
+        // The match may overlap the bytes it produces (e.g. a run of the same
+        // byte), so it is copied one byte at a time.
+        const uint8_t *match = out - offset;
+        for (size_t i = 0; i < match_len; ++i) {
+            out[i] = match[i];
+        }
+
+        out += match_len;
+    }
+
+    return out - (uint8_t *)dst;
+}
@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memstat.h>
+#include <kmalloc.h>
+#include <printk.h>
+#include <task.h>
+#include <mm/pmm.h>
+#include <mm/vmm.h>
+#include <mm/paging.h>
+#include <mm/swap.h>
+#include <mm/ksm.h>
+
+extern struct task_list CURRENT_TASK;
+
+// Set by memstat_request_dump (which may run in an interrupt handler).
+static volatile bool DUMP_REQUESTED;
+
+void
+memstat_collect(memstat_t *stat) {
+    pmm_memstat(stat);
+    kmalloc_memstat(stat);
+    swap_memstat(stat);
+    ksm_memstat(stat);
+    paging_memstat(stat);
+
+    if (CURRENT_TASK.task) {
+        vmm_memstat(&CURRENT_TASK.task->vmm_context, stat);
+    } else {
+        stat->vmm_allocations = 0;
+        stat->vmm_free_blocks = 0;
+    }
+}
+
+void
+memstat_dump() {
+    // This is too large for the kernel stack.
+    static memstat_t stat;
+
+    memstat_collect(&stat);
+
+    printk_info("pmm: %u frames, %u free, %u used, %u zeroed\n", stat.pmm_frame_count,
+                stat.pmm_free_frames, stat.pmm_used_frames, stat.pmm_zeroed_frames);
+
+    for (uint32_t order = 0; order <= MEMSTAT_MAX_ORDER; ++order) {
+        if (stat.pmm_free_blocks[order]) {
+            printk_info("pmm:   order %u: %u free blocks\n", order, stat.pmm_free_blocks[order]);
+        }
+    }
+
+    printk_info("heap: %u pages backed, %u bytes used, %u bytes free in %u blocks\n",
+                stat.heap_backed_pages, stat.heap_used_bytes, stat.heap_free_bytes,
+                stat.heap_free_block_count);
+
+    for (uint32_t i = 0; i < MEMSTAT_HISTOGRAM_BUCKETS; ++i) {
+        if (stat.heap_free_histogram[i]) {
+            printk_info("heap:   [2^%u, 2^%u) bytes: %u free blocks\n", i, i + 1,
+                        stat.heap_free_histogram[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < MEMSTAT_CALLSITE_COUNT; ++i) {
+        memstat_callsite_t *callsite = &stat.heap_callsites[i];
+
+        if (!callsite->live_allocs) {
+            break;
+        }
+
+        printk_info("heap:   caller %#x: %u bytes in %u blocks (%u allocations)\n",
+                    callsite->caller, callsite->live_bytes, callsite->live_allocs,
+                    callsite->total_allocs);
+    }
+
+    printk_info("vmm: %u allocations, %u free blocks\n", stat.vmm_allocations,
+                stat.vmm_free_blocks);
+    printk_info("swap: %u pages in %u bytes\n", stat.swap_pages, stat.swap_compressed_bytes);
+    printk_info("ksm: %u pages sharing %u frames (%u merges, %u unmerges)\n",
+                stat.ksm_sharing_pages, stat.ksm_shared_frames, stat.ksm_merges,
+                stat.ksm_unmerges);
+    printk_info("ksm: %u pages scanned (%u full scans, %u pages per scan)\n",
+                stat.ksm_scanned_pages, stat.ksm_full_scans, stat.ksm_pages_per_scan);
+    printk_info("paging: %u large pages (%u splits, %u collapses)\n", stat.paging_large_pages,
+                stat.paging_large_page_splits, stat.paging_large_page_collapses);
+}
+
+void
+memstat_request_dump() {
+    DUMP_REQUESTED = true;
+}
+
+void
+memstat_dump_if_requested() {
+    if (DUMP_REQUESTED) {
+        DUMP_REQUESTED = false;
+        memstat_dump();
+    }
+}
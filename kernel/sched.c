@@ -3,10 +3,11 @@
 #include <sched.h>
 #include <gdt.h>
 #include <flags.h>
-#include <kmalloc.h>
+#include <slab.h>
 #include <printk.h>
 #include <mm/vmm.h>
 #include <mm/paging.h>
+#include <mm/addr_space.h>
 #include <mm/meminfo.h>
 #include <panic.h>
 
@@ -22,16 +23,28 @@ int SCHED_INIT = 0;
 
 struct task_list CURRENT_TASK;
 static struct task_list *tasks_head, *tasks_tail, *tasks_sched_head;
+static kmem_cache_t *TASK_LIST_CACHE;
 
 static void
 sched_switch_task(task_control_block_t *next) {
+    if (!next->virtual_addr_space) {
+        // The kernel stack of the task might have been allocated after the
+        // page directory it is about to borrow was cloned. Unlike the other
+        // kernel page directory entries, this one can't be synced lazily, as
+        // the page fault handler would need the stack to run on.
+        paging_sync_kernel_pdes(next->esp0 - KERNEL_STACK_SIZE, next->esp0);
+    }
+
     do_task_switch(next);
 }
 
 void
 init_sched(paging_context_t paging_ctx, vmm_context_t vmm_context) {
+    task_init_cache();
+    TASK_LIST_CACHE = kmem_cache_create("task_list", sizeof(struct task_list), 0, NULL);
+
     task_control_block_t *task = task_create(paging_ctx, vmm_context, NULL, NULL, false);
-    tasks_sched_head = tasks_head = tasks_tail = kmalloc(sizeof(struct task_list));
+    tasks_sched_head = tasks_head = tasks_tail = kmem_cache_alloc(TASK_LIST_CACHE);
 
     // Create the first kernel task
     *tasks_head = (struct task_list) {
@@ -49,7 +62,7 @@ init_sched(paging_context_t paging_ctx, vmm_context_t vmm_context) {
 
 void
 sched_add(task_control_block_t *task, task_priority_t priority) {
-    struct task_list *new_tasks = kmalloc(sizeof(struct task_list));
+    struct task_list *new_tasks = kmem_cache_alloc(TASK_LIST_CACHE);
     *new_tasks = (struct task_list) {
         .next = tasks_tail->next,
         .task = task,
@@ -69,7 +82,7 @@ sched_remove(uint32_t pid) {
     if (task->task->pid == pid) {
         tasks_tail = tasks_tail->next;
         tasks_head->next = tasks_tail;
-        kfree(task);
+        kmem_cache_free(TASK_LIST_CACHE, task);
         return;
     }
 
@@ -82,7 +95,7 @@ sched_remove(uint32_t pid) {
             if (task == tasks_head) {
                 tasks_head = task->next;
             }
-            kfree(task);
+            kmem_cache_free(TASK_LIST_CACHE, task);
             return;
         }
     } while (task != tasks_tail);
@@ -98,6 +111,16 @@ sched_context_switch() {
     sched_switch_task(task);
 }
 
+void
+sched_for_each_task(void (*fn)(task_control_block_t *, void *), void *data) {
+    struct task_list *task = tasks_head;
+
+    do {
+        fn(task->task, data);
+        task = task->next;
+    } while (task != tasks_head);
+}
+
 __attribute__((noreturn)) void
 sched_halt_or_crash() {
     halt_or_crash();
@@ -0,0 +1,146 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <flags.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <panic.h>
+
+// Disable interrupts, returning whether they were enabled.
+//
+// NOTE: like kmalloc_lock, this keeps the page fault handler (which allocates
+// reverse mappings and VMM tree nodes from caches) from running in the middle
+// of an allocation made by a task it preempted.
+static bool
+kmem_lock() {
+    bool enabled = interrupts_enabled();
+
+    asm volatile("cli" ::: "memory");
+
+    return enabled;
+}
+
+static void
+kmem_unlock(bool enabled) {
+    if (enabled) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+static kmem_free_object_t *
+free_object(kmem_cache_t *cache, void *object) {
+    return (kmem_free_object_t *)((char *)object + cache->free_offset);
+}
+
+static void *
+free_object_to_object(kmem_cache_t *cache, kmem_free_object_t *free_object) {
+    return (char *)free_object - cache->free_offset;
+}
+
+static size_t
+align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Allocate a new slab and add all its objects to the free list of the cache.
+static void
+kmem_cache_grow(kmem_cache_t *cache) {
+    // Make sure there is room for the slab header, the padding needed to align
+    // the first object, and at least one object.
+    size_t slab_size = sizeof(kmem_slab_t) + cache->align + cache->object_size;
+    if (slab_size < KMEM_SLAB_SIZE) {
+        slab_size = KMEM_SLAB_SIZE;
+    }
+
+    kmem_slab_t *slab = kmalloc(slab_size);
+    ASSERT(slab, "kmem_cache %s: failed to allocate slab", cache->name);
+
+    uintptr_t first = align_up((uintptr_t)slab + sizeof(kmem_slab_t), cache->align);
+    uintptr_t end = (uintptr_t)slab + slab_size;
+
+    *slab = (kmem_slab_t) {
+        .next = cache->slabs,
+        .object_count = (end - first) / cache->object_size,
+    };
+    cache->slabs = slab;
+    cache->total += slab->object_count;
+
+    // Chain the objects in address order.
+    for (uint32_t i = slab->object_count; i > 0; --i) {
+        void *object = (void *)(first + (i - 1) * cache->object_size);
+
+        if (cache->ctor) {
+            cache->ctor(object);
+        }
+
+        kmem_free_object_t *free = free_object(cache, object);
+        free->next = cache->free_objects;
+        cache->free_objects = free;
+    }
+}
+
+kmem_cache_t *
+kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)) {
+    if (!align) {
+        align = KMEM_CACHE_LINE_SIZE;
+    }
+
+    ASSERT(!(align & (align - 1)), "kmem_cache %s: alignment must be a power of 2", name);
+
+    // The free list is threaded through the free objects.
+    size_t free_offset = 0;
+    if (ctor) {
+        size = align_up(size, sizeof(kmem_free_object_t)) + sizeof(kmem_free_object_t);
+        free_offset = size - sizeof(kmem_free_object_t);
+    } else if (size < sizeof(kmem_free_object_t)) {
+        size = sizeof(kmem_free_object_t);
+    }
+
+    kmem_cache_t *cache = kmalloc(sizeof(kmem_cache_t));
+    ASSERT(cache, "kmem_cache %s: failed to allocate cache", name);
+
+    *cache = (kmem_cache_t) {
+        .name = name,
+        .object_size = align_up(size, align),
+        .align = align,
+        .free_offset = free_offset,
+        .ctor = ctor,
+        .free_objects = NULL,
+        .slabs = NULL,
+        .in_use = 0,
+        .total = 0,
+    };
+
+    return cache;
+}
+
+void *
+kmem_cache_alloc(kmem_cache_t *cache) {
+    bool enabled = kmem_lock();
+
+    if (!cache->free_objects) {
+        kmem_cache_grow(cache);
+    }
+
+    kmem_free_object_t *free = cache->free_objects;
+    cache->free_objects = free->next;
+    cache->in_use++;
+    kmem_unlock(enabled);
+
+    return free_object_to_object(cache, free);
+}
+
+void
+kmem_cache_free(kmem_cache_t *cache, void *addr) {
+    bool enabled = kmem_lock();
+
+    ASSERT(cache->in_use, "kmem_cache %s: free of unallocated object %#x", cache->name,
+           (uint32_t)addr);
+
+    kmem_free_object_t *free = free_object(cache, addr);
+    free->next = cache->free_objects;
+    cache->free_objects = free;
+    cache->in_use--;
+    kmem_unlock(enabled);
+}
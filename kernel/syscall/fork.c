@@ -1,8 +1,15 @@
 #include <syscall/fork.h>
 #include <task.h>
+#include <sched.h>
+
+extern struct task_list CURRENT_TASK;
 
 void
 fork(registers_t *regs) {
-    // TODO clone current task
-    regs->eax = 0xbeef;
+    task_control_block_t *child = task_fork(CURRENT_TASK.task, regs);
+
+    sched_add(child, TASK_PRIORITY_LOW);
+
+    // The parent gets the PID of the child (and the child gets 0).
+    regs->eax = child->pid;
 }
@@ -0,0 +1,33 @@
+#include <syscall/memstat.h>
+#include <memstat.h>
+#include <string.h>
+#include <task.h>
+#include <mm/vmm.h>
+
+extern struct task_list CURRENT_TASK;
+
+void
+memstat(registers_t *regs) {
+    memstat_t *buf = (memstat_t *)regs->ebx;
+    uint32_t size = regs->ecx;
+
+    // Older (smaller) versions of the structure are prefixes of newer ones.
+    if (size > sizeof(memstat_t)) {
+        size = sizeof(memstat_t);
+    }
+
+    // The buffer must be writable user memory, or the copy would fault in the
+    // kernel.
+    if (!vmm_is_user_range(&CURRENT_TASK.task->vmm_context, (uint32_t)buf, size,
+                           PAGE_FLAG_WRITE)) {
+        regs->eax = -1;
+        return;
+    }
+
+    // This is too large for the kernel stack.
+    static memstat_t stat;
+    memstat_collect(&stat);
+
+    memcpy(buf, &stat, size);
+    regs->eax = size;
+}
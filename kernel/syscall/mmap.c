@@ -0,0 +1,41 @@
+#include <syscall/mmap.h>
+#include <task.h>
+#include <mm/vmm.h>
+#include <mm/paging.h>
+#include <mm/meminfo.h>
+
+extern struct task_list CURRENT_TASK;
+extern kernel_meminfo_t KERNEL_MEMINFO;
+
+void
+mmap(registers_t *regs) {
+    uint32_t length = regs->ecx;
+    uint32_t map_flags = regs->edx;
+    vmm_context_t *vmm_ctx = &CURRENT_TASK.task->vmm_context;
+
+    if (!length || length > KERNEL_MEMINFO.higher_half_base - LARGE_PAGE_SIZE
+            || (map_flags & ~MAP_LARGE)) {
+        regs->eax = -1;
+        return;
+    }
+
+    uint32_t page_count = paging_page_count(length);
+    uint32_t flags = PAGE_FLAG_PRESENT | PAGE_FLAG_WRITE | PAGE_FLAG_USER;
+    uint32_t align = PAGE_SIZE;
+
+    if (map_flags & MAP_LARGE) {
+        page_count = (page_count + PAGE_TABLE_SIZE - 1) / PAGE_TABLE_SIZE * PAGE_TABLE_SIZE;
+        flags |= PAGE_FLAG_PAGE_SIZE;
+        align = LARGE_PAGE_SIZE;
+    }
+
+    uint32_t addr = vmm_find_user_range(vmm_ctx, page_count, align);
+
+    if (!addr) {
+        regs->eax = -1;
+        return;
+    }
+
+    // Nothing is mapped until the pages are accessed.
+    regs->eax = (uint32_t)vmm_map_pages(vmm_ctx, addr, 0, page_count, flags);
+}
@@ -3,6 +3,8 @@
 #include <syscall/syscall.h>
 #include <syscall/exit.h>
 #include <syscall/fork.h>
+#include <syscall/memstat.h>
+#include <syscall/mmap.h>
 #include <printk.h>
 #include <panic.h>
 
@@ -26,6 +28,12 @@ syscall_handler(interrupt_state_t *state, registers_t *regs) {
         case SYS_FORK:
             fork(regs);
             break;
+        case SYS_MEMSTAT:
+            memstat(regs);
+            break;
+        case SYS_MMAP:
+            mmap(regs);
+            break;
         default:
             PANIC("unknown syscall %d", syscall_num);
     }
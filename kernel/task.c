@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 
 #include <mm/vmm.h>
 #include <mm/pmm.h>
@@ -6,8 +7,18 @@
 #include <mm/addr_space.h>
 #include <task.h>
 #include <sched.h>
-#include <kmalloc.h>
+#include <slab.h>
 #include <panic.h>
+#include <registers.h>
+
+// What a system call leaves on the kernel stack of a user task: the
+// registers_t pushed by syscall_interrupt_handler, the user's EBP, and the
+// EIP, CS, EFLAGS, ESP and SS pushed by the CPU.
+#define SYSCALL_FRAME_SIZE (sizeof(registers_t) + 6 * sizeof(uint32_t))
+
+extern void syscall_fork_return();
+
+static kmem_cache_t *TASK_CACHE;
 
 static void
 push_uint32(uint32_t *kernel_stack_top, uint32_t value) {
@@ -15,17 +26,28 @@ push_uint32(uint32_t *kernel_stack_top, uint32_t value) {
     *kernel_stack_top -= sizeof(uint32_t);
 }
 
+static uint32_t
+task_next_pid() {
+    static uint32_t last_pid = 0;
+
+    return last_pid++;
+}
+
+void
+task_init_cache() {
+    TASK_CACHE = kmem_cache_create("task_control_block", sizeof(task_control_block_t), 0, NULL);
+}
+
 task_control_block_t *
 task_create(paging_context_t paging_ctx, vmm_context_t vmm_ctx, void (*task_fn)(void),
             void *ret_addr, bool is_userspace) {
-    static uint32_t last_pid = 0;
     uint32_t kernel_stack_top = (uint32_t)alloc_kernel_stack(paging_ctx, &vmm_ctx);
 
     paging_context_t task_paging_ctx = is_userspace ?
                                        vmm_clone_paging_context(&vmm_ctx, paging_ctx) : paging_ctx;
 
-    task_control_block_t *task = (task_control_block_t *)kmalloc(sizeof(task_control_block_t));
-    uint32_t pid = last_pid++;
+    task_control_block_t *task = kmem_cache_alloc(TASK_CACHE);
+    uint32_t pid = task_next_pid();
 
     // pid
     push_uint32(&kernel_stack_top, pid);
@@ -48,19 +70,10 @@ task_create(paging_context_t paging_ctx, vmm_context_t vmm_ctx, void (*task_fn)(
     // EDI
     *(uint32_t *)kernel_stack_top = 0;
 
-    uint32_t cr3 = 0;
-
-    // TODO: both cases should be handled by vmm_find_allocation.
-    if (is_userspace) {
-        vmm_allocation_t alloc = vmm_find_allocation(&vmm_ctx, (uint32_t)task_paging_ctx.page_directory);
-
-        ASSERT(alloc.page_count, "invalid VMM state");
-
-        cr3 = alloc.physical_addr;
-    } else {
-        cr3 = vmm_virtual_to_physical((uint32_t)task_paging_ctx.page_directory);
-    }
-
+    // Kernel tasks don't have an address space of their own: they run in the
+    // address space of whichever task ran before them (the kernel half of all
+    // address spaces is the same), which saves a TLB flush.
+    uint32_t cr3 = is_userspace ? task_paging_ctx.cr3 : 0;
 
     *task = (task_control_block_t) {
         .pid = pid,
@@ -74,3 +87,44 @@ task_create(paging_context_t paging_ctx, vmm_context_t vmm_ctx, void (*task_fn)(
 
     return task;
 }
+
+task_control_block_t *
+task_fork(task_control_block_t *parent, registers_t *regs) {
+    vmm_context_t vmm_ctx = vmm_clone_context(parent->vmm_context);
+    // NOTE: the stack is allocated before the page directory, so the page
+    // directory has the (kernel) page directory entry that maps it.
+    uint32_t esp0 = (uint32_t)alloc_kernel_stack(parent->paging_ctx, &vmm_ctx);
+    paging_context_t paging_ctx = vmm_fork_paging_context(&vmm_ctx, parent->paging_ctx);
+    task_control_block_t *task = kmem_cache_alloc(TASK_CACHE);
+
+    // The child returns to user mode with the registers of the parent, using
+    // a copy of the parent's system call frame (at the top of its own stack).
+    uint32_t frame = esp0 + sizeof(uint32_t) - SYSCALL_FRAME_SIZE;
+    memcpy((void *)frame, regs, SYSCALL_FRAME_SIZE);
+    // fork returns 0 in the child.
+    ((registers_t *)frame)->eax = 0;
+
+    uint32_t kernel_stack_top = frame - sizeof(uint32_t);
+    // EIP
+    push_uint32(&kernel_stack_top, (uint32_t)syscall_fork_return);
+    // EBP
+    push_uint32(&kernel_stack_top, 0);
+    // EBX
+    push_uint32(&kernel_stack_top, 0);
+    // ESI
+    push_uint32(&kernel_stack_top, 0);
+    // EDI
+    *(uint32_t *)kernel_stack_top = 0;
+
+    *task = (task_control_block_t) {
+        .pid = task_next_pid(),
+        .kernel_stack_top = kernel_stack_top,
+        .virtual_addr_space = paging_ctx.cr3,
+        .esp0 = esp0,
+        .vmm_context = vmm_ctx,
+        .paging_ctx = paging_ctx,
+        .parent = parent,
+    };
+
+    return task;
+}
@@ -0,0 +1,76 @@
+#ifndef __SYS_MEMSTAT_H__
+#define __SYS_MEMSTAT_H__
+
+#include <stdint.h>
+
+// The largest order of the blocks handed out by the PMM (see PMM_MAX_ORDER).
+#define MEMSTAT_MAX_ORDER         10
+// Bucket `i` of the free block histogram counts the free heap blocks of
+// [2^i, 2^(i + 1)) bytes.
+#define MEMSTAT_HISTOGRAM_BUCKETS 32
+// The number of kmalloc call sites reported (the ones holding the most memory).
+#define MEMSTAT_CALLSITE_COUNT    16
+
+// The heap memory allocated by a kmalloc call site.
+typedef struct memstat_callsite {
+    // The return address of the call to kmalloc (0 for the call sites that
+    // didn't fit in the profiler's table).
+    uint32_t caller;
+    // The number of blocks (and bytes) allocated and not yet freed.
+    uint32_t live_allocs;
+    uint32_t live_bytes;
+    // The total number of allocations.
+    uint32_t total_allocs;
+} memstat_callsite_t;
+
+// A snapshot of the memory usage of the system.
+//
+// NOTE: this must match the definition in kernel/include/syscall/memstat.h.
+typedef struct memstat {
+    // Physical memory (in 4 KB frames)
+    uint32_t pmm_frame_count;
+    uint32_t pmm_free_frames;
+    uint32_t pmm_used_frames;
+    uint32_t pmm_zeroed_frames;
+    uint32_t pmm_free_blocks[MEMSTAT_MAX_ORDER + 1];
+
+    // Kernel heap
+    uint32_t heap_size;
+    uint32_t heap_backed_pages;
+    uint32_t heap_used_bytes;
+    uint32_t heap_free_bytes;
+    uint32_t heap_free_block_count;
+    uint32_t heap_free_histogram[MEMSTAT_HISTOGRAM_BUCKETS];
+    memstat_callsite_t heap_callsites[MEMSTAT_CALLSITE_COUNT];
+
+    // The virtual address space of the current task
+    uint32_t vmm_allocations;
+    uint32_t vmm_free_blocks;
+
+    // The swap store (the number of pages stored, and their compressed size)
+    uint32_t swap_pages;
+    uint32_t swap_compressed_bytes;
+
+    // Same-page merging: the frames shared by merged pages, the number of
+    // pages mapped to them, the number of merges and of writes that undid
+    // them, and the progress (and speed) of the scanner
+    uint32_t ksm_shared_frames;
+    uint32_t ksm_sharing_pages;
+    uint32_t ksm_merges;
+    uint32_t ksm_unmerges;
+    uint32_t ksm_scanned_pages;
+    uint32_t ksm_full_scans;
+    uint32_t ksm_pages_per_scan;
+
+    // 4 MB user pages: the number mapped, and the number of times they were
+    // split into 4 KB pages or assembled from them
+    uint32_t paging_large_pages;
+    uint32_t paging_large_page_splits;
+    uint32_t paging_large_page_collapses;
+} memstat_t;
+
+// Copy a snapshot of the memory usage of the system to `buf` (at most `size`
+// bytes of it). Returns the number of bytes copied, or -1 on error.
+int memstat(memstat_t *buf, uint32_t size);
+
+#endif /* __SYS_MEMSTAT_H__ */
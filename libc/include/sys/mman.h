@@ -0,0 +1,19 @@
+#ifndef __SYS_MMAN_H__
+#define __SYS_MMAN_H__
+
+#include <stddef.h>
+
+// Back the mapping with 4 MB pages: the length is rounded up to a multiple of
+// 4 MB, and the mapping is 4 MB aligned.
+//
+// NOTE: this must match the flags in kernel/include/syscall/mmap.h
+#define MAP_LARGE 1
+
+#define MAP_FAILED ((void *)-1)
+
+// Map `length` bytes of anonymous (zero-filled), readable and writable memory,
+// with the MAP_* flags in `flags`. Returns the address of the mapping, or
+// MAP_FAILED on error.
+void *mmap(size_t length, int flags);
+
+#endif /* __SYS_MMAN_H__ */
@@ -0,0 +1,10 @@
+#ifndef __LIBC_SYSCALL_H__
+#define __LIBC_SYSCALL_H__
+
+// NOTE: these must match the syscall numbers in kernel/include/syscall/syscall.h
+#define SYS_EXIT    1
+#define SYS_FORK    2
+#define SYS_MEMSTAT 3
+#define SYS_MMAP    4
+
+#endif /* __LIBC_SYSCALL_H__ */